@@ -15,144 +15,1354 @@
 #include <linux/buffer_head.h>
 #include <linux/bitops.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/sort.h>
+#include <linux/mm.h>
 
-static DEFINE_SPINLOCK(bitmap_lock);
+/*
+ * Protects the inode map, the zone map is locked per allocation group.
+ * Bitmap blocks are read while holding these, so they are mutexes.
+ */
+static DEFINE_MUTEX(bitmap_lock);
+
+/* Allocation groups per possible CPU and minimum group size in bits */
+#define MINIX_GROUPS_PER_CPU	4
+#define MINIX_MIN_GROUP_BITS	1024
+
+/* s_imap_free entry of an inode map block that has not been counted yet */
+#define MINIX_IMAP_UNCOUNTED	UINT_MAX
+
+/* Upper limit for the preallocation window of an inode, in zones */
+#define MINIX_MAX_PREALLOC	1024
+
+/*
+ * Refcounts are stored in one of two encodings, chosen by mkfs:
+ *
+ * The full table has a uint32_t per data zone.
+ *
+ * In the compact encoding (MINIX_FEATURE_COMPACT_REFCOUNT) a zone with its
+ * bit set in the zone map has a refcount of at least 1. The shared map has
+ * one bit per zone that is set once the refcount reaches 2, and only those
+ * refcounts are stored, in an open addressing hash table behind the shared
+ * map. The shared map is laid out like the zone map, so an allocation group
+ * covers part of exactly one block of each.
+ *
+ * Either way, a refcount is accessed through a struct refcount_ref.
+ */
+struct refcount_ref {
+	size_t index;
+	struct buffer_head *bh;		/* refcount table or shared map block */
+	struct buffer_head *zmap_bh;	/* compact encoding only */
+	uint32_t *entry;		/* full table only */
+};
+
+static inline unsigned int map_bit(struct super_block *sb, size_t data_block_index)
+{
+	return data_block_index & (8 * sb->s_blocksize - 1);
+}
+
+/*
+ * Finds the slot of a zone in the overflow table, or with insert set,
+ * the slot to store it in. Empty slots end a probe sequence, deleted ones
+ * are reused. Returns the block holding the slot, or NULL if the zone is
+ * not in the table or the table is full. The caller holds s_overflow_lock.
+ */
+static struct buffer_head *find_overflow_slot(struct super_block *sb, size_t data_block_index,
+		int insert, struct minix_refcount_entry **slot)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	unsigned long per_block = sb->s_blocksize / sizeof(struct minix_refcount_entry);
+	unsigned long nslots = sbi->s_refcount_overflow_blocks * per_block;
+	sector_t start = sbi->s_refcount_table_start + sbi->s_refcount_table_blocks - sbi->s_refcount_overflow_blocks;
+	unsigned long pos = hash_32(data_block_index, 32) % nslots;
+	unsigned long reuse = nslots, n;
+	struct minix_refcount_entry *entry = NULL;
+	struct buffer_head *bh = NULL;
+
+	for (n = 0; n < nslots; n++, pos = (pos + 1) % nslots) {
+		if (!bh || bh->b_blocknr != start + pos / per_block) {
+			brelse(bh);
+			bh = sb_bread(sb, start + pos / per_block);
+			if (!bh) {
+				printk("MINIX-fs: unable to read refcount overflow block %lu\n", pos / per_block);
+				return NULL;
+			}
+		}
+		entry = (struct minix_refcount_entry *)bh->b_data + pos % per_block;
+		if (entry->zone == data_block_index) {
+			*slot = entry;
+			return bh;
+		}
+		if (!entry->zone)
+			break;
+		if (!entry->count && reuse == nslots)
+			reuse = pos;
+	}
+
+	if (!insert || (reuse == nslots && n == nslots)) {
+		brelse(bh);
+		return NULL;
+	}
+	if (reuse != nslots) {
+		pos = reuse;
+		if (bh->b_blocknr != start + pos / per_block) {
+			brelse(bh);
+			bh = sb_bread(sb, start + pos / per_block);
+			if (!bh)
+				return NULL;
+		}
+		entry = (struct minix_refcount_entry *)bh->b_data + pos % per_block;
+	}
+	*slot = entry;
+	return bh;
+}
+
+/*
+ * Returns the refcount of a shared zone from the overflow table
+ */
+static uint32_t get_overflow(struct super_block *sb, size_t data_block_index)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	struct minix_refcount_entry *slot;
+	struct buffer_head *bh;
+	uint32_t refcount = 2;
+
+	mutex_lock(&sbi->s_overflow_lock);
+	bh = find_overflow_slot(sb, data_block_index, 0, &slot);
+	if (bh && slot->count >= 2)
+		refcount = slot->count;
+	else
+		printk("MINIX-fs: shared data block %lu has no overflow entry\n", (unsigned long)data_block_index);
+	mutex_unlock(&sbi->s_overflow_lock);
+	brelse(bh);
+	return refcount;
+}
+
+/*
+ * Stores the refcount of a shared zone in the overflow table,
+ * a refcount of 0 deletes its entry
+ */
+static int set_overflow(struct super_block *sb, size_t data_block_index, uint32_t refcount)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	struct minix_refcount_entry *slot;
+	struct buffer_head *bh;
+	bool live;
+
+	mutex_lock(&sbi->s_overflow_lock);
+	bh = find_overflow_slot(sb, data_block_index, refcount != 0, &slot);
+	if (!bh) {
+		mutex_unlock(&sbi->s_overflow_lock);
+		return refcount ? -ENOSPC : 0;
+	}
+	live = slot->zone == data_block_index && slot->count >= 2;
+	if (sbi->s_overflow_counted && live != (refcount >= 2)) {
+		if (live)
+			sbi->s_overflow_used--;
+		else
+			sbi->s_overflow_used++;
+	}
+	slot->zone = data_block_index;
+	slot->count = refcount;
+	minix_journal_dirty(sb, bh);
+	mutex_unlock(&sbi->s_overflow_lock);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Counts the live entries of the overflow table the first time they are
+ * needed. The caller holds s_overflow_lock.
+ */
+static int count_overflow_entries(struct super_block *sb)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	unsigned long per_block = sb->s_blocksize / sizeof(struct minix_refcount_entry);
+	sector_t start = sbi->s_refcount_table_start + sbi->s_refcount_table_blocks - sbi->s_refcount_overflow_blocks;
+	struct minix_refcount_entry *entries;
+	struct buffer_head *bh;
+	unsigned long used = 0, i, j;
+
+	if (sbi->s_overflow_counted)
+		return 0;
+	for (i = 0; i < sbi->s_refcount_overflow_blocks; i++) {
+		bh = sb_bread(sb, start + i);
+		if (!bh)
+			return -EIO;
+		entries = (struct minix_refcount_entry *)bh->b_data;
+		for (j = 0; j < per_block; j++)
+			used += entries[j].zone && entries[j].count >= 2;
+		brelse(bh);
+	}
+	sbi->s_overflow_used = used;
+	sbi->s_overflow_counted = true;
+	return 0;
+}
+
+/*
+ * Sets aside overflow table entries for the zones a batch makes shared,
+ * so the batch either fits as a whole or changes nothing. The table is
+ * kept at most 7/8 full: probe sequences in a fuller table run across
+ * many blocks, and a full one is only noticed after reading all of them.
+ */
+static int reserve_overflow_entries(struct super_block *sb, unsigned long count)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	unsigned long nslots = sbi->s_refcount_overflow_blocks *
+		(sb->s_blocksize / sizeof(struct minix_refcount_entry));
+	int ret;
+
+	if (!count)
+		return 0;
+	mutex_lock(&sbi->s_overflow_lock);
+	ret = count_overflow_entries(sb);
+	if (!ret && sbi->s_overflow_used + sbi->s_overflow_reserved + count > nslots - nslots / 8)
+		ret = -ENOSPC;
+	if (!ret)
+		sbi->s_overflow_reserved += count;
+	mutex_unlock(&sbi->s_overflow_lock);
+	return ret;
+}
+
+static void release_overflow_entries(struct super_block *sb, unsigned long count)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+
+	if (!count)
+		return;
+	mutex_lock(&sbi->s_overflow_lock);
+	sbi->s_overflow_reserved -= count;
+	mutex_unlock(&sbi->s_overflow_lock);
+}
+
+static void put_refcount_ref(struct refcount_ref *ref)
+{
+	brelse(ref->zmap_bh);
+	brelse(ref->bh);
+	ref->zmap_bh = NULL;
+	ref->bh = NULL;
+}
+
+/*
+ * Block of the refcount area that holds the refcount of a data block
+ */
+static unsigned long refcount_block(struct super_block *sb, size_t data_block_index)
+{
+	if (minix_has_feature(minix_sb(sb), COMPACT_REFCOUNT))
+		return data_block_index / (8 * sb->s_blocksize);
+	return data_block_index / (sb->s_blocksize / sizeof(uint32_t));
+}
+
+/*
+ * Points ref at another data block whose refcount is in the same block
+ */
+static void move_refcount_ref(struct super_block *sb, struct refcount_ref *ref, size_t data_block_index)
+{
+	ref->index = data_block_index;
+	if (ref->entry)
+		ref->entry = (uint32_t*)ref->bh->b_data + data_block_index % (sb->s_blocksize / sizeof(uint32_t));
+}
+
+/*
+ * Reads the blocks holding the refcount of a data block.
+ * Release them with put_refcount_ref().
+ */
+static int get_refcount_ref(struct super_block *sb, size_t data_block_index, struct refcount_ref *ref)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	unsigned long block;
+
+	ref->index = data_block_index;
+	ref->zmap_bh = NULL;
+	ref->entry = NULL;
+
+	if (minix_has_feature(sbi, COMPACT_REFCOUNT)) {
+		block = data_block_index / (8 * sb->s_blocksize);
+		if (block >= sbi->s_refcount_table_blocks - sbi->s_refcount_overflow_blocks ||
+		    block >= sbi->s_zmap_blocks)
+			goto out_range;
+		ref->zmap_bh = sb_bread(sb, minix_zmap_block(sbi, block));
+		ref->bh = sb_bread(sb, sbi->s_refcount_table_start + block);
+	} else {
+		uint32_t refcounts_per_block = sb->s_blocksize / sizeof(uint32_t);
+
+		block = data_block_index / refcounts_per_block;
+		if (block >= sbi->s_refcount_table_blocks)
+			goto out_range;
+		ref->bh = sb_bread(sb, sbi->s_refcount_table_start + block);
+		if (ref->bh)
+			ref->entry = (uint32_t*)ref->bh->b_data + data_block_index % refcounts_per_block;
+	}
+	if (!ref->bh || (minix_has_feature(sbi, COMPACT_REFCOUNT) && !ref->zmap_bh)) {
+		printk("MINIX-fs: unable to read refcount of data block %lu\n", (unsigned long)data_block_index);
+		put_refcount_ref(ref);
+		return -EIO;
+	}
+	return 0;
+
+out_range:
+	printk("MINIX-fs: refcount of data block %lu out of range\n", (unsigned long)data_block_index);
+	ref->bh = NULL;
+	return -EINVAL;
+}
+
+
+static uint32_t refcount_value(struct super_block *sb, struct refcount_ref *ref)
+{
+	unsigned int bit;
+
+	if (ref->entry)
+		return *ref->entry;
+
+	bit = map_bit(sb, ref->index);
+	if (!minix_test_bit(bit, ref->zmap_bh->b_data))
+		return 0;
+	if (!minix_test_bit(bit, ref->bh->b_data))
+		return 1;
+	return get_overflow(sb, ref->index);
+}
+
+/*
+ * Stores a refcount without dirtying ref->bh.
+ * Returns 1 if ref->bh changed, 0 if not, or an error.
+ * The compact encoding cannot store a refcount of 0 for an allocated zone,
+ * clearing the zone map bit is up to minix_free_block().
+ */
+static int __refcount_store(struct super_block *sb, struct refcount_ref *ref, uint32_t value)
+{
+	unsigned int bit;
+	int ret;
+
+	if (ref->entry) {
+		if (*ref->entry == value)
+			return 0;
+		*ref->entry = value;
+		return 1;
+	}
+
+	bit = map_bit(sb, ref->index);
+	if (value >= 2) {
+		if (!minix_test_bit(bit, ref->zmap_bh->b_data)) {
+			printk("MINIX-fs: sharing free data block %lu\n", (unsigned long)ref->index);
+			return -EINVAL;
+		}
+		ret = set_overflow(sb, ref->index, value);
+		if (ret) {
+			printk("MINIX-fs: refcount overflow table full\n");
+			return ret;
+		}
+		return !minix_test_and_set_bit(bit, ref->bh->b_data);
+	}
+	if (!minix_test_and_clear_bit(bit, ref->bh->b_data))
+		return 0;
+	set_overflow(sb, ref->index, 0);
+	return 1;
+}
+
+/*
+ * Stores a refcount, the blocks are only dirtied if it changes
+ */
+static int refcount_store(struct super_block *sb, struct refcount_ref *ref, uint32_t value)
+{
+	int ret = __refcount_store(sb, ref, value);
+
+	if (ret > 0)
+		minix_journal_dirty(sb, ref->bh);
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * Get the refcount of a particular data block
+ */
+inline uint32_t get_refcount(struct super_block *sb, size_t data_block_index) {
+	struct refcount_ref ref;
+	uint32_t refcount;
+
+	if (get_refcount_ref(sb, data_block_index, &ref))
+		return 0;
+	refcount = refcount_value(sb, &ref);
+	put_refcount_ref(&ref);
+	return refcount;
+}
+
+/*
+ * Returns the allocation group a data zone index belongs to
+ */
+static inline struct minix_alloc_group *zone_group(struct minix_sb_info *sbi, size_t data_block_index) {
+	return &sbi->s_zgroups[data_block_index / sbi->s_zgroup_bits];
+}
+
+/**
+ * Set the refcount of a particular data block
+ * Returns 0 or a negative error, -ENOSPC if the overflow table is full
+ */
+inline int set_refcount(struct super_block *sb, size_t data_block_index, uint32_t value) {
+	struct minix_alloc_group *group = zone_group(minix_sb(sb), data_block_index);
+	struct refcount_ref ref;
+	int ret;
+
+	ret = get_refcount_ref(sb, data_block_index, &ref);
+	if (ret)
+		return ret;
+	mutex_lock(&group->lock);
+	ret = refcount_store(sb, &ref, value);
+	mutex_unlock(&group->lock);
+	put_refcount_ref(&ref);
+
+	debug_log("Set refcount of data block %d to %d\n", data_block_index, value);
+	return ret;
+}
+
+/*
+ * Decrements a refcount, the caller holds the group lock
+ */
+static uint32_t __decrement_refcount(struct super_block *sb, struct refcount_ref *ref) {
+	uint32_t refcount = refcount_value(sb, ref);
+
+	if (refcount != 0) {
+		refcount--;
+		refcount_store(sb, ref, refcount);
+	} else {
+		debug_log("ERROR: Underflow in refcount for data block %d\n", ref->index);
+	}
+	return refcount;
+}
+
+/**
+ * Increments the refcount of a particular data block
+ * Returns 0 or a negative error, -ENOSPC if the overflow table is full
+ */
+inline int increment_refcount(struct super_block *sb, size_t data_block_index) {
+	struct minix_alloc_group *group = zone_group(minix_sb(sb), data_block_index);
+	struct refcount_ref ref;
+	uint32_t refcount;
+	int ret;
+
+	ret = get_refcount_ref(sb, data_block_index, &ref);
+	if (ret)
+		return ret;
+
+	mutex_lock(&group->lock);
+	refcount = refcount_value(sb, &ref);
+	if (refcount+1 == 0) {
+		debug_log("ERROR: Overflow in refcount for data block %d\n", data_block_index);
+		ret = -EOVERFLOW;
+	} else {
+		ret = refcount_store(sb, &ref, refcount+1);
+	}
+	mutex_unlock(&group->lock);
+	put_refcount_ref(&ref);
+	return ret;
+}
+
+/**
+ * Decrements the refcount of a particular data block
+ * Returns the new refcount
+ */
+inline uint32_t decrement_refcount(struct super_block *sb, size_t data_block_index) {
+	struct minix_alloc_group *group = zone_group(minix_sb(sb), data_block_index);
+	struct refcount_ref ref;
+	uint32_t refcount;
+
+	if (get_refcount_ref(sb, data_block_index, &ref))
+		return 0;
+
+	mutex_lock(&group->lock);
+	refcount = __decrement_refcount(sb, &ref);
+	mutex_unlock(&group->lock);
+	put_refcount_ref(&ref);
+	return refcount;
+}
+
+/**
+ * Transforms a zone number into a data zone index
+ */
+inline uint32_t data_zone_index_for_zone_number(struct minix_sb_info *sbi, size_t zone_number) {
+	return zone_number - sbi->s_firstdatazone + 1;
+}
+
+/*
+ * Drops a reference to an indirect or extent tree block unless it is
+ * the last one. Returns true for the last one: the caller then drops
+ * the references of the block to its entries and frees it, nobody else
+ * can take a reference meanwhile.
+ */
+bool minix_put_tree_block(struct super_block *sb, unsigned long zone)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	struct minix_alloc_group *group;
+	struct refcount_ref ref;
+	bool last = true;
+	size_t idx;
+
+	if (zone < sbi->s_firstdatazone || zone >= sbi->s_nzones)
+		return false;
+	idx = data_zone_index_for_zone_number(sbi, zone);
+	if (get_refcount_ref(sb, idx, &ref))
+		return false;
+	group = zone_group(sbi, idx);
+
+	mutex_lock(&group->lock);
+	if (refcount_value(sb, &ref) > 1) {
+		__decrement_refcount(sb, &ref);
+		last = false;
+	}
+	mutex_unlock(&group->lock);
+	put_refcount_ref(&ref);
+	return last;
+}
+
+/*
+ * Takes a reference for an inode on the zones it references directly:
+ * its direct zones and top indirect blocks, or what the root of its
+ * extent tree holds. Everything below a tree block is shared through
+ * the block, its entries only get their own reference when it is
+ * copied (see the CoW walks) and drop it with the last reference to
+ * the block.
+ */
+void minix_refcount_batch_get_zones(struct minix_refcount_batch *batch, __u32 *zones, bool extents)
+{
+	int i;
+
+	if (extents) {
+		minix_ext_get_root(batch, zones);
+		return;
+	}
+	for (i = 0; i < NUM_ZONES_IN_INODE; i++) {
+		if (zones[i])
+			minix_refcount_batch_add(batch, zones[i], 1);
+	}
+}
+
+/*
+ * Drops the references minix_refcount_batch_get_zones() took. Tree
+ * blocks that lose their last reference are read and drop the
+ * references to their entries right away, the data zones and the
+ * freed tree blocks go into the batch.
+ */
+int minix_refcount_batch_put_zones(struct minix_refcount_batch *batch, __u32 *zones, bool extents)
+{
+	int i, err = 0, ret;
+
+	if (extents)
+		err = minix_ext_put_root(batch, zones);
+	else for (i = 0; i < NUM_ZONES_IN_INODE; i++) {
+		if (!zones[i])
+			continue;
+		ret = minix_put_branch(batch, zones[i], i < INDIRECT_BLOCK_INDEX ? 0 : i - INDIRECT_BLOCK_INDEX + 1);
+		if (ret && !err)
+			err = ret;
+	}
+	if (err && !batch->error)
+		batch->error = err;
+	return err;
+}
+
+/* Initial and maximum number of changes a batch holds before it is applied */
+#define MINIX_REFCOUNT_BATCH_MIN	512
+#define MINIX_REFCOUNT_BATCH_MAX	(1 << 20)
+
+static int cmp_refcount_delta(const void *a, const void *b)
+{
+	const struct minix_refcount_delta *x = a, *y = b;
+
+	if (x->zone != y->zone)
+		return x->zone < y->zone ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Number of zones that sorted refcount changes make shared, in the
+ * compact encoding each of them needs an overflow table entry
+ */
+static long count_new_shared(struct super_block *sb, struct minix_refcount_delta *deltas, unsigned int count)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	struct refcount_ref ref = { .bh = NULL };
+	unsigned int i, j, bit;
+	long delta, shared = 0;
+	size_t idx;
+
+	for (i = 0; i < count; i = j) {
+		delta = 0;
+		for (j = i; j < count && deltas[j].zone == deltas[i].zone; j++)
+			delta += deltas[j].delta;
+		if (delta <= 0 || deltas[i].zone < sbi->s_firstdatazone || deltas[i].zone >= sbi->s_nzones)
+			continue;
+		idx = data_zone_index_for_zone_number(sbi, deltas[i].zone);
+		if (ref.bh && refcount_block(sb, idx) != refcount_block(sb, ref.index))
+			put_refcount_ref(&ref);
+		if (!ref.bh && get_refcount_ref(sb, idx, &ref))
+			return -EIO;
+		move_refcount_ref(sb, &ref, idx);
+
+		bit = map_bit(sb, idx);
+		if (!minix_test_bit(bit, ref.bh->b_data) &&
+		    !!minix_test_bit(bit, ref.zmap_bh->b_data) + delta >= 2)
+			shared++;
+	}
+	put_refcount_ref(&ref);
+	return shared;
+}
+
+/*
+ * Dirties and releases the blocks apply_refcount_deltas() works on
+ */
+static void put_refcount_bufs(struct super_block *sb, struct refcount_ref *ref, int *ref_dirty,
+			      struct buffer_head **zmap_bh, int *zmap_dirty)
+{
+	if (ref->bh && *ref_dirty)
+		minix_journal_dirty(sb, ref->bh);
+	put_refcount_ref(ref);
+	if (*zmap_bh && *zmap_dirty)
+		minix_journal_dirty(sb, *zmap_bh);
+	brelse(*zmap_bh);
+	*zmap_bh = NULL;
+	*ref_dirty = 0;
+	*zmap_dirty = 0;
+}
+
+/*
+ * Applies refcount changes. They are sorted by zone and the changes to
+ * one zone are summed up first, so +1/-1 pairs cancel out. Every refcount
+ * and zone map block is then read, changed and dirtied once, and each
+ * allocation group is locked once per run of its zones.
+ * A zone whose refcount drops to 0 is freed, as by minix_free_block().
+ * Nothing changes if the overflow table has no room for the zones
+ * that become shared, -ENOSPC is returned then.
+ * With restart a long run of changes may span several transactions.
+ */
+static int apply_refcount_deltas(struct super_block *sb, struct minix_refcount_delta *deltas, unsigned int count,
+				 bool restart)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	unsigned long bits_per_block = 8 * sb->s_blocksize;
+	struct minix_alloc_group *group = NULL;
+	struct buffer_head *zmap_bh = NULL;
+	struct refcount_ref ref = { .bh = NULL };
+	int ref_dirty = 0, zmap_dirty = 0, ret = 0, err;
+	unsigned int i, j;
+	long long refcount;
+	long delta, shared = 0;
+	size_t idx;
+
+	sort(deltas, count, sizeof(*deltas), cmp_refcount_delta, NULL);
+
+	if (minix_has_feature(sbi, COMPACT_REFCOUNT)) {
+		shared = count_new_shared(sb, deltas, count);
+		if (shared < 0)
+			return shared;
+		err = reserve_overflow_entries(sb, shared);
+		if (err)
+			return err;
+	}
+
+	for (i = 0; i < count; i = j) {
+		delta = 0;
+		for (j = i; j < count && deltas[j].zone == deltas[i].zone; j++)
+			delta += deltas[j].delta;
+		if (!delta)
+			continue;
+		if (deltas[i].zone < sbi->s_firstdatazone || deltas[i].zone >= sbi->s_nzones) {
+			printk("MINIX-fs: refcount change for zone %u outside the data zones\n", deltas[i].zone);
+			continue;
+		}
+		idx = data_zone_index_for_zone_number(sbi, deltas[i].zone);
+
+		// Move on to the blocks and the group of this zone
+		if (group && group != zone_group(sbi, idx)) {
+			mutex_unlock(&group->lock);
+			group = NULL;
+			if (restart) {
+				put_refcount_bufs(sb, &ref, &ref_dirty, &zmap_bh, &zmap_dirty);
+				minix_journal_restart(sb);
+			}
+		}
+		if (ref.bh && refcount_block(sb, idx) != refcount_block(sb, ref.index)) {
+			if (ref_dirty)
+				minix_journal_dirty(sb, ref.bh);
+			put_refcount_ref(&ref);
+			ref_dirty = 0;
+		}
+		if (zmap_bh && zmap_bh->b_blocknr != minix_zmap_block(sbi, idx / bits_per_block)) {
+			if (zmap_dirty)
+				minix_journal_dirty(sb, zmap_bh);
+			brelse(zmap_bh);
+			zmap_bh = NULL;
+			zmap_dirty = 0;
+		}
+		if (!ref.bh && get_refcount_ref(sb, idx, &ref)) {
+			ret = -EIO;
+			continue;
+		}
+		move_refcount_ref(sb, &ref, idx);
+		if (!zmap_bh) {
+			zmap_bh = sb_bread(sb, minix_zmap_block(sbi, idx / bits_per_block));
+			if (!zmap_bh) {
+				printk("MINIX-fs: unable to read zone map\n");
+				ret = -EIO;
+				continue;
+			}
+		}
+		if (!group) {
+			group = zone_group(sbi, idx);
+			mutex_lock(&group->lock);
+		}
+
+		refcount = (long long)refcount_value(sb, &ref) + delta;
+		if (refcount > U32_MAX) {
+			debug_log("ERROR: Overflow in refcount for data block %d\n", idx);
+			continue;
+		}
+		if (refcount > 0) {
+			err = __refcount_store(sb, &ref, refcount);
+		} else {
+			if (refcount < 0)
+				debug_log("ERROR: Underflow in refcount for data block %d\n", idx);
+			err = __refcount_store(sb, &ref, 0);
+
+			// Last reference gone: free the zone
+			if (!minix_test_and_clear_bit(idx % bits_per_block, zmap_bh->b_data)) {
+				printk("MINIX-fs: freeing free data block %lu\n", (unsigned long)idx);
+			} else {
+				zmap_dirty = 1;
+				// Groups not counted yet see the bit when they are
+				if (group->counted) {
+					if (!group->free++)
+						group->cursor = idx - group->first;
+					percpu_counter_inc(&sbi->s_free_zones);
+				}
+				minix_journal_revoke(sb, deltas[i].zone);
+			}
+		}
+		if (err > 0)
+			ref_dirty = 1;
+		else if (err < 0)
+			ret = err;
+	}
+
+	if (group)
+		mutex_unlock(&group->lock);
+	put_refcount_bufs(sb, &ref, &ref_dirty, &zmap_bh, &zmap_dirty);
+	release_overflow_entries(sb, shared);
+	return ret;
+}
+
+void minix_refcount_batch_init(struct minix_refcount_batch *batch, struct super_block *sb)
+{
+	batch->sb = sb;
+	batch->deltas = NULL;
+	batch->count = 0;
+	batch->size = 0;
+	batch->error = 0;
+	batch->restart = false;
+}
+
+static int grow_refcount_batch(struct minix_refcount_batch *batch)
+{
+	unsigned int size = batch->size ? 2 * batch->size : MINIX_REFCOUNT_BATCH_MIN;
+	struct minix_refcount_delta *deltas;
+
+	if (size > MINIX_REFCOUNT_BATCH_MAX)
+		return -ENOMEM;
+	deltas = kvmalloc_array(size, sizeof(*deltas), GFP_KERNEL);
+	if (!deltas)
+		return -ENOMEM;
+	if (batch->count)
+		memcpy(deltas, batch->deltas, batch->count * sizeof(*deltas));
+	kvfree(batch->deltas);
+	batch->deltas = deltas;
+	batch->size = size;
+	return 0;
+}
+
+/*
+ * Queues a refcount change of a zone. When the batch cannot grow any more,
+ * the queued changes are applied early.
+ */
+void minix_refcount_batch_add(struct minix_refcount_batch *batch, unsigned long zone, int delta)
+{
+	struct minix_refcount_delta *last;
+	int err;
+
+	// Walks often see the same zone twice in a row
+	if (batch->count) {
+		last = &batch->deltas[batch->count - 1];
+		if (last->zone == zone) {
+			last->delta += delta;
+			return;
+		}
+	}
+
+	if (batch->count == batch->size && grow_refcount_batch(batch)) {
+		if (!batch->count) {
+			struct minix_refcount_delta single = { .zone = zone, .delta = delta };
+
+			err = apply_refcount_deltas(batch->sb, &single, 1, batch->restart);
+			if (err)
+				batch->error = err;
+			return;
+		}
+		err = apply_refcount_deltas(batch->sb, batch->deltas, batch->count, batch->restart);
+		if (err)
+			batch->error = err;
+		batch->count = 0;
+	}
+	batch->deltas[batch->count].zone = zone;
+	batch->deltas[batch->count].delta = delta;
+	batch->count++;
+}
+
+void minix_refcount_batch_add_range(struct minix_refcount_batch *batch, unsigned long zone,
+		unsigned long count, int delta)
+{
+	while (count--)
+		minix_refcount_batch_add(batch, zone++, delta);
+}
+
+/*
+ * File systems from before tree blocks held the references of their
+ * entries count one reference per owner on every zone of a shared
+ * tree. Their counts only agree with the current rules while no zone
+ * is shared, such a file system is upgraded before it is written to.
+ * Returns -EROFS for any other one, it can only be mounted read-only.
+ */
+int minix_upgrade_tree_refcount(struct super_block *sb)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	struct minix3_super_block *m3s = (struct minix3_super_block *)sbi->s_sbh->b_data;
+	unsigned long zones = sbi->s_nzones - sbi->s_firstdatazone + 1;
+	unsigned long per_block = sb->s_blocksize / sizeof(uint32_t);
+	unsigned long blocks, b, i;
+	struct buffer_head *bh;
+	bool shared = false;
+
+	if (minix_has_feature(sbi, TREE_REFCOUNT))
+		return 0;
+
+	// The shared map of the compact encoding has a bit set for every shared zone
+	if (minix_has_feature(sbi, COMPACT_REFCOUNT))
+		blocks = min_t(unsigned long, sbi->s_zmap_blocks,
+			       sbi->s_refcount_table_blocks - sbi->s_refcount_overflow_blocks);
+	else
+		blocks = min_t(unsigned long, DIV_ROUND_UP(zones, per_block), sbi->s_refcount_table_blocks);
+	for (b = 0; b < blocks && !shared; b++) {
+		bh = sb_bread(sb, sbi->s_refcount_table_start + b);
+		if (!bh)
+			return -EIO;
+		if (minix_has_feature(sbi, COMPACT_REFCOUNT))
+			shared = memchr_inv(bh->b_data, 0, sb->s_blocksize) != NULL;
+		else for (i = 0; i < per_block && !shared; i++)
+			shared = ((uint32_t *)bh->b_data)[i] > 1;
+		brelse(bh);
+	}
+	if (shared) {
+		printk("MINIX-fs: file system shares zones with refcounts from before "
+		       "tree sharing, mounting read-write is not supported\n");
+		return -EROFS;
+	}
+
+	sbi->s_features |= MINIX_FEATURE_TREE_REFCOUNT;
+	m3s->s_features = sbi->s_features;
+	mark_buffer_dirty(sbi->s_sbh);
+	sync_dirty_buffer(sbi->s_sbh);
+	return 0;
+}
+
+/*
+ * Applies the queued changes and frees the batch.
+ * Returns the first error seen while the batch was in use.
+ */
+int minix_refcount_batch_commit(struct minix_refcount_batch *batch)
+{
+	int err = apply_refcount_deltas(batch->sb, batch->deltas, batch->count, batch->restart);
+
+	if (err && !batch->error)
+		batch->error = err;
+	kvfree(batch->deltas);
+	batch->deltas = NULL;
+	batch->count = 0;
+	batch->size = 0;
+	return batch->error;
+}
+
+/*
+ * Clear bits of one bitmap block, counted a machine word at a time.
+ * The bit order within the words does not matter for that.
+ */
+static unsigned count_free_in_block(struct buffer_head *bh, unsigned blocksize)
+{
+	return blocksize * 8 - bitmap_weight((unsigned long *)bh->b_data, blocksize * 8);
+}
+
+/*
+ * bitmap consists of blocks filled with 16bit words
+ * bit set == busy, bit clear == free
+ * endianness is a mess, but for counting zero bits it really doesn't matter...
+ */
+static __u32 count_free(struct super_block *sb, sector_t map, __u32 numbits)
+{
+	__u32 sum = 0;
+	unsigned blocks = DIV_ROUND_UP(numbits, sb->s_blocksize * 8);
+	struct buffer_head *bh;
+
+	while (blocks--) {
+		bh = sb_bread(sb, map++);
+		if (!bh)
+			continue;
+		sum += count_free_in_block(bh, sb->s_blocksize);
+		brelse(bh);
+	}
+
+	return sum;
+}
+
+/*
+ * Counts the free bits in [start, start + nbits) of a bitmap block.
+ * start has to be a multiple of BITS_PER_LONG.
+ */
+static unsigned count_free_in_range(struct buffer_head *bh, unsigned long start, unsigned long nbits)
+{
+	unsigned long whole = nbits & ~(BITS_PER_LONG - 1);
+	unsigned sum = whole - bitmap_weight((unsigned long *)bh->b_data + start / BITS_PER_LONG, whole);
+	unsigned long i;
 
-/**
- * Get the refcount of a particular data block
+	for (i = start + whole; i < start + nbits; i++)
+		sum += !minix_test_bit(i, bh->b_data);
+	return sum;
+}
+
+/*
+ * Counts the free bits of an allocation group the first time it is
+ * needed, so mounting does not read the whole zone map. Until then the
+ * group is left out of the free zone counter.
+ * Must be called with the group lock held.
+ */
+static int count_zone_group(struct super_block *sb, struct minix_alloc_group *group)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	unsigned long bits_per_block = 8 * sb->s_blocksize;
+	struct buffer_head *bh;
+
+	if (group->counted)
+		return 0;
+	bh = sb_bread(sb, minix_zmap_block(sbi, group->first / bits_per_block));
+	if (!bh)
+		return -EIO;
+	group->free = count_free_in_range(bh, group->first % bits_per_block, group->nbits);
+	// Zone 0 does not exist, its bit is only fixed on read-write mounts
+	if (group->first == 0 && !minix_test_bit(0, bh->b_data))
+		group->free--;
+	brelse(bh);
+	group->counted = true;
+	percpu_counter_add(&sbi->s_free_zones, group->free);
+	return 0;
+}
+
+/*
+ * Counts the groups that were not counted yet, until the free zone
+ * counter reaches want. Returns whether any group was counted.
  */
-inline uint32_t get_refcount(struct minix_sb_info *sbi, size_t data_block_index) {
-	// This could be easier by simply casting sbi->s_refcount_table[0] to uint32_t*
-	// And indexing it with data_block_index, but that's kind of dirty
-	// since we'd be reading over the actual size of the buffer_head.
-	// So we do the same procedure as in set_refcount...
+static bool count_zone_groups(struct super_block *sb, unsigned long want)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	s64 free = percpu_counter_sum_positive(&sbi->s_free_zones);
+	bool counted = false;
+	unsigned long i;
 
-	// Get index of block and index within block
-	size_t block_size = sbi->s_refcount_table[0]->b_size;
-	uint32_t refcounts_per_block = block_size / sizeof(uint32_t);
-	size_t block_index = data_block_index / refcounts_per_block;
-	size_t entry_index = data_block_index % refcounts_per_block;
+	for (i = 0; i < sbi->s_zgroup_count && free < want; i++) {
+		struct minix_alloc_group *group = &sbi->s_zgroups[i];
 
-	// Get refcounter
-	struct buffer_head *refcount_table_block = sbi->s_refcount_table[block_index];
-	uint32_t *refcount_table_section = (uint32_t*)refcount_table_block->b_data;
-	return refcount_table_section[entry_index]; 
+		if (READ_ONCE(group->counted))
+			continue;
+		mutex_lock(&group->lock);
+		if (!group->counted && !count_zone_group(sb, group)) {
+			free += group->free;
+			counted = true;
+		}
+		mutex_unlock(&group->lock);
+	}
+	return counted;
 }
 
-/**
- * Set the refcount of a particular data block
+/*
+ * Counts an inode map block the first time it is read, like
+ * count_zone_group(). Must be called with bitmap_lock held.
  */
-inline void set_refcount(struct minix_sb_info *sbi, size_t data_block_index, uint32_t value) {
-	// Get index of block and index within block
-	size_t block_size = sbi->s_refcount_table[0]->b_size;
-	uint32_t refcounts_per_block = block_size / sizeof(uint32_t);
-	size_t block_index = data_block_index / refcounts_per_block;
-	size_t entry_index = data_block_index % refcounts_per_block;
+static void count_imap_block(struct super_block *sb, unsigned long block, struct buffer_head *bh)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	unsigned int free;
+
+	if (sbi->s_imap_free[block] != MINIX_IMAP_UNCOUNTED)
+		return;
+	free = count_free_in_block(bh, sb->s_blocksize);
+	// Inode 0 does not exist, its bit is only fixed on read-write mounts
+	if (block == 0 && !minix_test_bit(0, bh->b_data))
+		free--;
+	sbi->s_imap_free[block] = free;
+	percpu_counter_add(&sbi->s_free_inodes, free);
+}
 
-	// Set refcounter
-	struct buffer_head *refcount_table_block = sbi->s_refcount_table[block_index];
-	uint32_t *refcount_table_section = (uint32_t*)refcount_table_block->b_data;
-	refcount_table_section[entry_index] = value;
-	mark_buffer_dirty(refcount_table_block);
+#if CHECK_FREE_COUNTS
+/*
+ * Counts the data zones that have a refcount of 0
+ */
+static unsigned long count_free_refcounts(struct super_block *sb, unsigned long numbits)
+{
+	unsigned long i, sum = 0;
 
-	debug_log("Set refcount of data block %d to %d\n", data_block_index, refcount_table_section[entry_index]);
+	// Index 0 is not a data zone, just like bit 0 of the zone map
+	for (i = 1; i < numbits; i++)
+		if (!get_refcount(sb, i))
+			sum++;
+	return sum;
 }
 
-/**
- * Increments the refcount of a particular data block
- * Returns the new refcount
+/*
+ * Compares the free zone counter with the zone map and the refcount table
+ * and with the per group counts, and logs a warning if they disagree
  */
-inline uint32_t increment_refcount(struct minix_sb_info *sbi, size_t data_block_index) {
-	uint32_t refcount = get_refcount(sbi, data_block_index);
-	if (refcount+1 != 0) {
-		set_refcount(sbi, data_block_index, refcount+1);
-	} else {
-		debug_log("ERROR: Overflow in refcount for data block %d\n", data_block_index);
+static void check_free_zones(struct super_block *sb)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	unsigned long bits_per_block = 8 * sb->s_blocksize;
+	unsigned long numbits = sbi->s_nzones - sbi->s_firstdatazone + 1;
+	unsigned long by_map = 0, by_groups = 0, by_refcount, reserved = 0, i;
+	s64 counter;
+
+	count_zone_groups(sb, ULONG_MAX);
+	counter = percpu_counter_sum(&sbi->s_free_zones);
+
+	for (i = 0; i < sbi->s_zgroup_count; i++) {
+		struct minix_alloc_group *group = &sbi->s_zgroups[i];
+		struct buffer_head *bh;
+
+		mutex_lock(&group->lock);
+		bh = sb_bread(sb, minix_zmap_block(sbi, group->first / bits_per_block));
+		if (bh) {
+			by_map += count_free_in_range(bh, group->first % bits_per_block, group->nbits);
+			brelse(bh);
+		}
+		by_groups += group->free;
+		if (group->reserved)
+			reserved += bitmap_weight(group->reserved, group->nbits);
+		mutex_unlock(&group->lock);
 	}
-	return get_refcount(sbi, data_block_index);
+	by_refcount = count_free_refcounts(sb, numbits);
+
+	// Preallocated zones are free on disk only
+	by_map -= reserved;
+	by_refcount -= reserved;
+
+	if (by_map != counter || by_map != by_groups || by_map != by_refcount)
+		printk("MINIX-fs: free zone counts disagree: counter %lld, zone map %lu, "
+		       "groups %lu, refcount table %lu\n",
+		       (long long)counter, by_map, by_groups, by_refcount);
 }
+#endif
 
-inline uint32_t increment_refcount_snapshot_callback(struct super_block *sb, size_t block_index) {
+/*
+ * Splits the zone map into allocation groups.
+ * Groups are a power of two in size, so they never cross a bitmap block,
+ * and there are a few of them per CPU so concurrent writers rarely meet.
+ */
+static int init_zone_groups(struct super_block *sb)
+{
 	struct minix_sb_info *sbi = minix_sb(sb);
-	return increment_refcount(sbi, data_zone_index_for_zone_number(sbi, block_index));
+	unsigned long bits_per_block = 8 * sb->s_blocksize;
+	unsigned long nbits = sbi->s_nzones - sbi->s_firstdatazone + 1;
+	unsigned long group_bits, i;
+
+	group_bits = roundup_pow_of_two(DIV_ROUND_UP(nbits, MINIX_GROUPS_PER_CPU * num_possible_cpus()));
+	group_bits = clamp_t(unsigned long, group_bits, MINIX_MIN_GROUP_BITS, bits_per_block);
+
+	sbi->s_zgroup_bits = group_bits;
+	sbi->s_zgroup_count = DIV_ROUND_UP(nbits, group_bits);
+	sbi->s_zgroups = kcalloc(sbi->s_zgroup_count, sizeof(struct minix_alloc_group), GFP_KERNEL);
+	if (!sbi->s_zgroups)
+		return -ENOMEM;
+
+	for (i = 0; i < sbi->s_zgroup_count; i++) {
+		struct minix_alloc_group *group = &sbi->s_zgroups[i];
+
+		mutex_init(&group->lock);
+		group->first = i * group_bits;
+		group->nbits = min(group_bits, nbits - group->first);
+	}
+	return 0;
 }
 
-/**
- * Decrements the refcount of a particular data block
- * Returns the new refcount
+/*
+ * Sets up the inode map summary and the zone allocation groups
+ * Called once at mount time. Nothing is read here, the bitmap blocks
+ * are counted when they are first needed and are not kept in memory.
  */
-inline uint32_t decrement_refcount(struct minix_sb_info *sbi, size_t data_block_index) {
-	uint32_t refcount = get_refcount(sbi, data_block_index);
-	if (refcount != 0) {
-		set_refcount(sbi, data_block_index, refcount-1);
-	} else {
-		debug_log("ERROR: Underflow in refcount for data block %d\n", data_block_index);
+int minix_init_bitmap_summary(struct super_block *sb)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	unsigned long i;
+	int ret = -ENOMEM;
+
+	sbi->s_imap_free = kcalloc(sbi->s_imap_blocks, sizeof(unsigned int), GFP_KERNEL);
+	if (!sbi->s_imap_free)
+		return -ENOMEM;
+	for (i = 0; i < sbi->s_imap_blocks; i++)
+		sbi->s_imap_free[i] = MINIX_IMAP_UNCOUNTED;
+	sbi->s_imap_cursor = 0;
+
+	ret = init_zone_groups(sb);
+	if (ret)
+		goto out_free;
+	ret = -ENOMEM;
+
+	// Free counts of the blocks and groups counted so far,
+	// kept up to date wherever a bit flips
+	if (percpu_counter_init(&sbi->s_free_inodes, 0, GFP_KERNEL))
+		goto out_free;
+	if (percpu_counter_init(&sbi->s_free_zones, 0, GFP_KERNEL))
+		goto out_free;
+	return 0;
+
+out_free:
+	minix_free_bitmap_summary(sb);
+	return ret;
+}
+
+/*
+ * Inode 0 and zone 0 do not exist: their map bits are always set and
+ * the refcount of zone 0 is 0. Called when the file system is mounted
+ * or remounted read-write, only blocks that were wrong are dirtied.
+ */
+int minix_fix_map_bits(struct super_block *sb)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	struct buffer_head *bh;
+	struct refcount_ref ref;
+	struct minix_handle handle;
+	int ret = 0;
+
+	minix_journal_start(sb, &handle);
+	bh = sb_bread(sb, minix_imap_block(sbi, 0));
+	if (!bh) {
+		ret = -EIO;
+		goto out;
+	}
+	// Counted blocks and groups already left the bits out
+	mutex_lock(&bitmap_lock);
+	if (!minix_test_and_set_bit(0, bh->b_data))
+		minix_journal_dirty(sb, bh);
+	mutex_unlock(&bitmap_lock);
+	brelse(bh);
+
+	bh = sb_bread(sb, minix_zmap_block(sbi, 0));
+	if (!bh) {
+		ret = -EIO;
+		goto out;
+	}
+	mutex_lock(&sbi->s_zgroups[0].lock);
+	if (!minix_test_and_set_bit(0, bh->b_data))
+		minix_journal_dirty(sb, bh);
+	mutex_unlock(&sbi->s_zgroups[0].lock);
+	brelse(bh);
+
+	// Minix clears the 0 bit on zone and inode map, so we also clear the refcount
+	if (get_refcount_ref(sb, 0, &ref)) {
+		ret = -EIO;
+		goto out;
 	}
-	return get_refcount(sbi, data_block_index);
+	refcount_store(sb, &ref, 0);
+	put_refcount_ref(&ref);
+out:
+	minix_journal_stop(sb, &handle);
+	return ret;
 }
 
-/**
- * Transforms a zone number into a data zone index
+void minix_free_bitmap_summary(struct super_block *sb)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	unsigned long i;
+
+	percpu_counter_destroy(&sbi->s_free_inodes);
+	percpu_counter_destroy(&sbi->s_free_zones);
+	kfree(sbi->s_imap_free);
+	for (i = 0; sbi->s_zgroups && i < sbi->s_zgroup_count; i++)
+		kfree(sbi->s_zgroups[i].reserved);
+	kfree(sbi->s_zgroups);
+	sbi->s_imap_free = NULL;
+	sbi->s_zgroups = NULL;
+}
+
+/*
+ * Recounts the inode map summary after the inode map
+ * has been replaced as a whole (snapshot rollback)
  */
-inline uint32_t data_zone_index_for_zone_number(struct minix_sb_info *sbi, size_t zone_number) {
-	return zone_number - sbi->s_firstdatazone + 1;
+void minix_update_imap_summary(struct super_block *sb)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	unsigned long i, free_inodes = 0;
+
+	mutex_lock(&bitmap_lock);
+	for (i = 0; i < sbi->s_imap_blocks; i++) {
+		struct buffer_head *bh = sb_bread(sb, minix_imap_block(sbi, i));
+
+		if (!bh)
+			continue;
+		sbi->s_imap_free[i] = count_free_in_block(bh, sb->s_blocksize);
+		free_inodes += sbi->s_imap_free[i];
+		brelse(bh);
+	}
+	sbi->s_imap_cursor = 0;
+	percpu_counter_set(&sbi->s_free_inodes, free_inodes);
+	mutex_unlock(&bitmap_lock);
 }
 
 /*
- * Increments the refcounts of an indirect block and all referenced data blocks
+ * Finds a free bit in the inode map, starting at the cursor
+ * Bitmap blocks without free bits are skipped by looking at their
+ * free count only, so the cost does not depend on how full the map is.
+ * Returns the bit number relative to the start of the map, or -1 if the map is full.
+ * The block holding the bit is returned in *bhp.
+ * Must be called with bitmap_lock held.
  */
-void increment_refcounts_on_indirect_block(struct super_block *sb, uint32_t physical_block_number) {
-	size_t data_zone_index;
-	uint32_t *indirect_block;
+static long find_free_inode_bit(struct super_block *sb, struct buffer_head **bhp)
+{
 	struct minix_sb_info *sbi = minix_sb(sb);
-	size_t n_blockrefs_in_block = sb->s_blocksize / sizeof(uint32_t);
+	struct btrminix_map_stats *stats = &sbi->s_imap_stats;
+	unsigned long bits_per_block = 8 * sb->s_blocksize;
+	unsigned long nblocks = sbi->s_imap_blocks;
+	unsigned long block = sbi->s_imap_cursor / bits_per_block;
+	unsigned long offset = sbi->s_imap_cursor % bits_per_block;
 	struct buffer_head *bh;
-	size_t i;
+	unsigned long n, bit;
 
-	// Increase refcount on indirect block
-	data_zone_index = data_zone_index_for_zone_number(sbi, physical_block_number);
-	increment_refcount(sbi, data_zone_index);
+	stats->allocs++;
+	for (n = 0; n < nblocks; n++, block++, offset = 0) {
+		if (block >= nblocks)
+			block = 0;
+		if (!sbi->s_imap_free[block])
+			continue;
 
-	// Increase refcount on all data blocks
-	bh = sb_bread(sb, physical_block_number);
-	indirect_block = (uint32_t*) bh->b_data;
-
-	for (i = 0; i < n_blockrefs_in_block; i++) {
-		if (indirect_block[i] != 0) {
-			// Increase refcount on data block
-			data_zone_index = data_zone_index_for_zone_number(sbi, indirect_block[i]);
-			increment_refcount(sbi, data_zone_index);
+		stats->blocks_searched++;
+		bh = sb_bread(sb, minix_imap_block(sbi, block));
+		if (!bh)
+			continue;
+		count_imap_block(sb, block, bh);
+		if (!sbi->s_imap_free[block]) {
+			brelse(bh);
+			continue;
+		}
+		bit = minix_find_next_zero_bit(bh->b_data, bits_per_block, offset);
+		if (bit >= bits_per_block)
+			bit = minix_find_first_zero_bit(bh->b_data, bits_per_block);
+		if (bit >= bits_per_block) {
+			printk("MINIX-fs: bitmap summary out of sync, fixing\n");
+			sbi->s_imap_free[block] = 0;
+			brelse(bh);
+			continue;
 		}
+
+		stats->summary_steps += n + 1;
+		if (n + 1 > stats->longest_scan)
+			stats->longest_scan = n + 1;
+		sbi->s_imap_cursor = block * bits_per_block + bit;
+		*bhp = bh;
+		return sbi->s_imap_cursor;
 	}
+
+	stats->summary_steps += nblocks;
+	if (nblocks > stats->longest_scan)
+		stats->longest_scan = nblocks;
+	return -1;
 }
 
 /*
- * bitmap consists of blocks filled with 16bit words
- * bit set == busy, bit clear == free
- * endianness is a mess, but for counting zero bits it really doesn't matter...
+ * Next clear bit of a zone map block from bit from on that is not
+ * reserved for a preallocation window either
  */
-static __u32 count_free(struct buffer_head *map[], unsigned blocksize, __u32 numbits)
+static unsigned long next_unreserved_bit(void *data, struct minix_alloc_group *group,
+					 unsigned long start, unsigned long end, unsigned long from)
 {
-	__u32 sum = 0;
-	unsigned blocks = DIV_ROUND_UP(numbits, blocksize * 8);
+	unsigned long bit = minix_find_next_zero_bit(data, end, from);
 
-	while (blocks--) {
-		unsigned words = blocksize / 2;
-		__u16 *p = (__u16 *)(*map++)->b_data;
-		while (words--)
-			sum += 16 - hweight16(*p++);
+	while (group->reserved && bit < end && test_bit(bit - start, group->reserved))
+		bit = minix_find_next_zero_bit(data, end, bit + 1);
+	return bit;
+}
+
+/*
+ * Finds a free bit inside an allocation group, starting at bit from
+ * (relative to the group) and wrapping around to its start.
+ * Returns the bit number relative to the start of the zone map, or -1.
+ * Must be called with the group lock held.
+ */
+static long find_free_bit_in_group(struct buffer_head *bh, struct minix_alloc_group *group,
+				   unsigned long from, unsigned bits_per_block)
+{
+	void *data = bh->b_data;
+	unsigned long start = group->first % bits_per_block;
+	unsigned long end = start + group->nbits;
+	unsigned long bit;
+
+	bit = next_unreserved_bit(data, group, start, end, start + from);
+	if (bit >= end)
+		bit = next_unreserved_bit(data, group, start, end, start);
+	if (bit >= end) {
+		printk("MINIX-fs: allocation group summary out of sync, fixing\n");
+		group->free = 0;
+		return -1;
 	}
+	return group->first + bit - start;
+}
 
-	// TODO: Maybe we should also count the free zones according to the refcount table
-	// and log a warning if they are not the same
+/*
+ * The group a CPU starts allocating from
+ */
+static inline unsigned long start_group(struct minix_sb_info *sbi)
+{
+	return (raw_smp_processor_id() * sbi->s_zgroup_count / num_possible_cpus())
+		% sbi->s_zgroup_count;
+}
 
-	return sum;
+static void add_map_stats(struct btrminix_map_stats *sum, struct btrminix_map_stats *stats)
+{
+	sum->allocs += stats->allocs;
+	sum->summary_steps += stats->summary_steps;
+	sum->blocks_searched += stats->blocks_searched;
+	if (stats->longest_scan > sum->longest_scan)
+		sum->longest_scan = stats->longest_scan;
+}
+
+/*
+ * Copies the allocator statistics
+ */
+void minix_get_stats(struct super_block *sb, struct btrminix_stats *stats)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	unsigned long i;
+
+	memset(stats, 0, sizeof(*stats));
+	mutex_lock(&bitmap_lock);
+	stats->imap = sbi->s_imap_stats;
+	mutex_unlock(&bitmap_lock);
+
+	for (i = 0; i < sbi->s_zgroup_count; i++) {
+		mutex_lock(&sbi->s_zgroups[i].lock);
+		add_map_stats(&stats->zmap, &sbi->s_zgroups[i].stats);
+		mutex_unlock(&sbi->s_zgroups[i].lock);
+	}
+
+	stats->cow.remapped_pages = atomic64_read(&sbi->s_cow_remapped_pages);
+	stats->cow.invalidated_pages = atomic64_read(&sbi->s_cow_invalidated_pages);
 }
 
 void minix_free_block(struct super_block *sb, unsigned long block)
 {
 	struct minix_sb_info *sbi = minix_sb(sb);
+	struct minix_alloc_group *group;
 	struct buffer_head *bh;
+	struct refcount_ref ref;
 	int k = sb->s_blocksize_bits + 3;
 	uint32_t refcount_table_index;
 	unsigned long bit, zone;
@@ -169,60 +1379,454 @@ void minix_free_block(struct super_block *sb, unsigned long block)
 		printk("minix_free_block: nonexistent bitmap buffer\n");
 		return;
 	}
-	bh = sbi->s_zmap[zone];
+	bh = sb_bread(sb, minix_zmap_block(sbi, zone));
+	if (!bh) {
+		printk("minix_free_block: unable to read zone map\n");
+		return;
+	}
+	if (get_refcount_ref(sb, refcount_table_index, &ref)) {
+		brelse(bh);
+		return;
+	}
+	group = zone_group(sbi, refcount_table_index);
 
-	spin_lock(&bitmap_lock);
+	mutex_lock(&group->lock);
 
 	// Decrement refcount
 	// If refcount is 0, free block in bitmap
-	if (decrement_refcount(sbi, refcount_table_index) == 0) {
+	if (__decrement_refcount(sb, &ref) == 0) {
 		debug_log("Freeing data block %d\n", refcount_table_index);
-		if (!minix_test_and_clear_bit(bit, bh->b_data))
+		if (!minix_test_and_clear_bit(bit, bh->b_data)) {
 			printk("minix_free_block (%s:%lu): bit already cleared\n",
 			       sb->s_id, block);
+		} else {
+			// Point the cursor here if the group had nothing left,
+			// groups not counted yet see the bit when they are
+			if (group->counted) {
+				if (!group->free++)
+					group->cursor = refcount_table_index - group->first;
+				percpu_counter_inc(&sbi->s_free_zones);
+			}
+			minix_journal_revoke(sb, block);
+		}
 	}
-	spin_unlock(&bitmap_lock);
-	mark_buffer_dirty(bh);
+	mutex_unlock(&group->lock);
+	minix_journal_dirty(sb, bh);
+	put_refcount_ref(&ref);
+	brelse(bh);
 	return;
 }
 
-int minix_new_block(struct inode * inode)
+/*
+ * Counter error away from which the free zone counter is read without summing it
+ */
+#define MINIX_FREE_SLACK	(4 * percpu_counter_batch * nr_cpu_ids)
+
+/*
+ * Number of the count zones an allocation for inode may take. Zones
+ * reserved for delayed buffers stay free for writeback, which draws
+ * on the reservation of the inode it allocates for.
+ */
+static unsigned int zones_allowed(struct inode *inode, unsigned int count)
 {
 	struct minix_sb_info *sbi = minix_sb(inode->i_sb);
-	int bits_per_zone = 8 * inode->i_sb->s_blocksize;
-	int i;
+	struct minix_inode_info *minix_inode = minix_i(inode);
+	unsigned long reserved, own;
+	s64 free;
+
+	for (;;) {
+		reserved = READ_ONCE(sbi->s_reserved);
+		if (READ_ONCE(minix_inode->i_claim_task) == current) {
+			own = READ_ONCE(minix_inode->i_reserved_data) + READ_ONCE(minix_inode->i_reserved_meta);
+			reserved -= min(reserved, own);
+		}
+		free = percpu_counter_read_positive(&sbi->s_free_zones);
+		if (free >= reserved + count + MINIX_FREE_SLACK)
+			return count;
+		free = percpu_counter_sum_positive(&sbi->s_free_zones);
+		if (free >= reserved + count)
+			return count;
+		// Groups not counted since mount may still have the zones
+		if (!count_zone_groups(inode->i_sb, reserved + count))
+			return free > reserved ? free - reserved : 0;
+	}
+}
+
+/*
+ * Allocates a run of up to *count contiguous zones, as close to goal as possible
+ * goal may be 0 if the caller has no preference.
+ * With reserve the zones are only set aside in memory, for a preallocation
+ * window, and get allocated on disk by commit_reserved_zone().
+ * Zones reserved for delayed buffers are left alone, see zones_allowed().
+ * Returns the first zone of the run and stores its length in *count,
+ * or returns 0 if no zone is free.
+ */
+unsigned long minix_new_blocks(struct inode *inode, unsigned long goal, unsigned int *count, bool reserve)
+{
+	struct super_block *sb = inode->i_sb;
+	struct minix_sb_info *sbi = minix_sb(sb);
+	int bits_per_zone = 8 * sb->s_blocksize;
+	uint32_t refcounts_per_block = sb->s_blocksize / sizeof(uint32_t);
+	struct minix_alloc_group *group;
+	struct buffer_head *bh;
+	struct refcount_ref ref;
+	unsigned long first, from, end, n, searched = 0, j;
+	unsigned int len;
+	long bit;
 
-	for (i = 0; i < sbi->s_zmap_blocks; i++) {
-		struct buffer_head *bh = sbi->s_zmap[i];
-		int j;
+	*count = zones_allowed(inode, *count);
+	if (!*count)
+		return 0;
 
-		spin_lock(&bitmap_lock);
-		j = minix_find_first_zero_bit(bh->b_data, bits_per_zone);
-		if (j < bits_per_zone) {
-			// Set refcount to 1
-			size_t refcount_table_index = i * bits_per_zone + j;
-			set_refcount(sbi, refcount_table_index, 1);
+	// Start in the group of the goal, or of this CPU,
+	// and only move on when it is full
+	if (goal >= sbi->s_firstdatazone && goal < sbi->s_nzones)
+		first = data_zone_index_for_zone_number(sbi, goal) / sbi->s_zgroup_bits;
+	else
+		first = start_group(sbi);
 
-			// Set zone used in bitmap
-			minix_set_bit(j, bh->b_data);
-			spin_unlock(&bitmap_lock);
-			mark_buffer_dirty(bh);
-			j += i * bits_per_zone + sbi->s_firstdatazone-1;
-			if (j < sbi->s_firstdatazone || j >= sbi->s_nzones)
+	for (n = 0; n < sbi->s_zgroup_count; n++) {
+		group = &sbi->s_zgroups[(first + n) % sbi->s_zgroup_count];
+		if (READ_ONCE(group->counted) && !READ_ONCE(group->free))
+			continue;
+
+		mutex_lock(&group->lock);
+		searched++;
+		if (count_zone_group(sb, group) || !group->free) {
+			mutex_unlock(&group->lock);
+			continue;
+		}
+		bh = sb_bread(sb, minix_zmap_block(sbi, group->first / bits_per_zone));
+		if (!bh) {
+			mutex_unlock(&group->lock);
+			continue;
+		}
+		from = group->cursor;
+		if (n == 0 && goal >= sbi->s_firstdatazone && goal < sbi->s_nzones)
+			from = data_zone_index_for_zone_number(sbi, goal) - group->first;
+		bit = find_free_bit_in_group(bh, group, from, bits_per_zone);
+		if (bit < 0) {
+			mutex_unlock(&group->lock);
+			brelse(bh);
+			continue;
+		}
+
+		j = bit + sbi->s_firstdatazone - 1;
+		if (j < sbi->s_firstdatazone || j >= sbi->s_nzones) {
+			mutex_unlock(&group->lock);
+			brelse(bh);
+			return 0;
+		}
+		if (reserve && !group->reserved)
+			group->reserved = kcalloc(BITS_TO_LONGS(group->nbits), sizeof(long), GFP_NOFS);
+		if (reserve && !group->reserved) {
+			mutex_unlock(&group->lock);
+			brelse(bh);
+			return 0;
+		}
+		memset(&ref, 0, sizeof(ref));
+		if (!reserve && get_refcount_ref(sb, bit, &ref)) {
+			mutex_unlock(&group->lock);
+			brelse(bh);
+			return 0;
+		}
+
+		// Take free zones after the first one until the run is long enough.
+		// The run stays within one refcount table block.
+		// The shared map of the compact encoding always covers the whole group.
+		end = min(group->first + group->nbits, sbi->s_nzones - sbi->s_firstdatazone + 1);
+		if (ref.entry)
+			end = min(end, (bit / refcounts_per_block + 1) * refcounts_per_block);
+		for (len = 0; len < *count && bit + len < end; len++) {
+			if (minix_test_bit((bit + len) % bits_per_zone, bh->b_data))
 				break;
-			return j;
+			if (group->reserved && test_bit(bit + len - group->first, group->reserved))
+				break;
+			if (reserve) {
+				set_bit(bit + len - group->first, group->reserved);
+				continue;
+			}
+
+			// Set refcount to 1, the zone map bit alone does that
+			// in the compact encoding
+			if (ref.entry)
+				ref.entry[len] = 1;
+
+			// Set zone used in bitmap
+			minix_set_bit((bit + len) % bits_per_zone, bh->b_data);
 		}
-		spin_unlock(&bitmap_lock);
+		group->free -= len;
+		group->cursor = bit + len - group->first;
+		percpu_counter_sub(&sbi->s_free_zones, len);
+
+		group->stats.allocs++;
+		group->stats.summary_steps += n + 1;
+		group->stats.blocks_searched += searched;
+		if (n + 1 > group->stats.longest_scan)
+			group->stats.longest_scan = n + 1;
+		mutex_unlock(&group->lock);
+		if (!reserve) {
+			if (ref.entry)
+				minix_journal_dirty(sb, ref.bh);
+			minix_journal_dirty(sb, bh);
+			put_refcount_ref(&ref);
+		}
+		brelse(bh);
+		*count = len;
+		return j;
+	}
+	return 0;
+}
+
+int minix_new_block(struct inode * inode)
+{
+	unsigned int count = 1;
+
+	return minix_new_blocks(inode, 0, &count, false);
+}
+
+/*
+ * Gives count zones from block on, reserved by minix_new_blocks(),
+ * back to their allocation group. They never made it to the disk.
+ */
+static void release_reserved_zones(struct super_block *sb, unsigned long block, unsigned int count)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	unsigned long zone = data_zone_index_for_zone_number(sbi, block);
+	struct minix_alloc_group *group = zone_group(sbi, zone);
+	unsigned int i;
+
+	if (!count)
+		return;
+	mutex_lock(&group->lock);
+	for (i = 0; i < count; i++)
+		clear_bit(zone + i - group->first, group->reserved);
+	// Point the cursor here if the group had nothing left
+	if (!group->free)
+		group->cursor = zone - group->first;
+	group->free += count;
+	mutex_unlock(&group->lock);
+	percpu_counter_add(&sbi->s_free_zones, count);
+}
+
+/*
+ * Allocates a zone reserved by minix_new_blocks() on disk, now that it
+ * gets mapped. The reservation is dropped if that fails.
+ */
+static int commit_reserved_zone(struct super_block *sb, unsigned long block)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	unsigned long bits_per_block = 8 * sb->s_blocksize;
+	unsigned long zone = data_zone_index_for_zone_number(sbi, block);
+	struct minix_alloc_group *group = zone_group(sbi, zone);
+	struct buffer_head *bh;
+	struct refcount_ref ref;
+
+	bh = sb_bread(sb, minix_zmap_block(sbi, zone / bits_per_block));
+	if (!bh) {
+		release_reserved_zones(sb, block, 1);
+		return -EIO;
+	}
+	if (get_refcount_ref(sb, zone, &ref)) {
+		brelse(bh);
+		release_reserved_zones(sb, block, 1);
+		return -EIO;
 	}
+
+	mutex_lock(&group->lock);
+	clear_bit(zone - group->first, group->reserved);
+	// The zone map bit alone is a refcount of 1 in the compact encoding
+	if (ref.entry)
+		*ref.entry = 1;
+	minix_set_bit(zone % bits_per_block, bh->b_data);
+	mutex_unlock(&group->lock);
+
+	if (ref.entry)
+		minix_journal_dirty(sb, ref.bh);
+	minix_journal_dirty(sb, bh);
+	put_refcount_ref(&ref);
+	brelse(bh);
 	return 0;
 }
 
+/*
+ * Allocates one zone for an inode, preferably at goal
+ * Zones are handed out of the inode's preallocation window, which is
+ * refilled with a contiguous run sized to the current write, so that
+ * a large write ends up in one piece on disk. The window is only
+ * reserved in memory, each zone is allocated on disk when handed out.
+ */
+unsigned long minix_alloc_block(struct inode *inode, unsigned long goal)
+{
+	struct minix_inode_info *minix_inode = minix_i(inode);
+	unsigned long block = 0, unused_start = 0;
+	unsigned int want, unused = 0;
+
+	mutex_lock(&minix_inode->i_prealloc_lock);
+	if (minix_inode->i_prealloc_count && goal && goal != minix_inode->i_prealloc_start) {
+		// The writer moved somewhere else, give the rest of the window back
+		unused_start = minix_inode->i_prealloc_start;
+		unused = minix_inode->i_prealloc_count;
+		minix_inode->i_prealloc_count = 0;
+	}
+	if (!minix_inode->i_prealloc_count) {
+		want = clamp_t(unsigned int, minix_inode->i_alloc_hint, 1, MINIX_MAX_PREALLOC);
+		minix_inode->i_prealloc_start = minix_new_blocks(inode, goal, &want, true);
+		if (minix_inode->i_prealloc_start)
+			minix_inode->i_prealloc_count = want;
+	}
+	if (minix_inode->i_prealloc_count) {
+		block = minix_inode->i_prealloc_start++;
+		minix_inode->i_prealloc_count--;
+		if (minix_inode->i_alloc_hint)
+			minix_inode->i_alloc_hint--;
+	}
+	mutex_unlock(&minix_inode->i_prealloc_lock);
+
+	release_reserved_zones(inode->i_sb, unused_start, unused);
+	if (block && commit_reserved_zone(inode->i_sb, block))
+		block = 0;
+	// Without memory for the reservation the zone is allocated directly
+	if (!block) {
+		want = 1;
+		block = minix_new_blocks(inode, goal, &want, false);
+	}
+	return block;
+}
+
+/*
+ * Returns the unused zones of the preallocation window to their group
+ */
+void minix_discard_prealloc(struct inode *inode)
+{
+	struct minix_inode_info *minix_inode = minix_i(inode);
+	unsigned long start;
+	unsigned int count;
+
+	mutex_lock(&minix_inode->i_prealloc_lock);
+	start = minix_inode->i_prealloc_start;
+	count = minix_inode->i_prealloc_count;
+	minix_inode->i_prealloc_count = 0;
+	minix_inode->i_alloc_hint = 0;
+	mutex_unlock(&minix_inode->i_prealloc_lock);
+
+	release_reserved_zones(inode->i_sb, start, count);
+}
+
+/*
+ * Worst case number of indirect blocks needed to map one more delayed
+ * block. In an indirect tree every level of its path may need a new
+ * block or a copy of a shared one, unless the block before it already
+ * reserved the same path. An extent tree needs the most blocks when
+ * every block is an extent of its own.
+ */
+static unsigned int meta_blocks_for(struct inode *inode, sector_t block)
+{
+	struct minix_inode_info *minix_inode = minix_i(inode);
+	unsigned long refs = inode->i_sb->s_blocksize /
+		(INODE_VERSION(inode) == MINIX_V1 ? sizeof(__u16) : sizeof(__u32));
+	unsigned long span;
+	unsigned int meta, depth;
+
+	if (minix_inode_extents(inode)) {
+		refs = (inode->i_sb->s_blocksize - sizeof(struct minix_extent_header)) /
+			sizeof(struct minix_extent);
+		meta = DIV_ROUND_UP(minix_inode->i_reserved_data + 1, refs) + MINIX_EXT_MAX_DEPTH;
+		return meta > minix_inode->i_reserved_meta ? meta - minix_inode->i_reserved_meta : 0;
+	}
+
+	// The first 7 zones are direct in both versions
+	if (block < 7)
+		return 0;
+	if (minix_inode->i_reserved_data && minix_inode->i_reserved_last >= 7 &&
+	    (minix_inode->i_reserved_last - 7) / refs == (block - 7) / refs)
+		return 0;
+	block -= 7;
+	for (depth = 1, span = refs; block >= span; depth++) {
+		block -= span;
+		span *= refs;
+	}
+	return depth;
+}
+
+/*
+ * Reserves a zone (and the indirect blocks it might need) for a buffer
+ * whose allocation is delayed until writeback.
+ * Returns -ENOSPC if the zone could not be guaranteed.
+ */
+int minix_reserve_block(struct inode *inode, sector_t block)
+{
+	struct minix_sb_info *sbi = minix_sb(inode->i_sb);
+	struct minix_inode_info *minix_inode = minix_i(inode);
+	unsigned long needed;
+	unsigned int want;
+	int ret = 0;
+
+	mutex_lock(&minix_inode->i_prealloc_lock);
+	want = 1 + meta_blocks_for(inode, block);
+
+	for (;;) {
+		spin_lock(&sbi->s_reserve_lock);
+		needed = sbi->s_reserved + want;
+		// The counter is only summed close to the limit
+		if (percpu_counter_read_positive(&sbi->s_free_zones) >= needed + MINIX_FREE_SLACK ||
+		    percpu_counter_sum_positive(&sbi->s_free_zones) >= needed) {
+			sbi->s_reserved += want;
+			minix_inode->i_reserved_data++;
+			minix_inode->i_reserved_meta += want - 1;
+			minix_inode->i_reserved_last = block;
+			spin_unlock(&sbi->s_reserve_lock);
+			break;
+		}
+		spin_unlock(&sbi->s_reserve_lock);
+		// Groups not counted since mount may still have the zones
+		if (!count_zone_groups(inode->i_sb, needed)) {
+			ret = -ENOSPC;
+			break;
+		}
+	}
+	mutex_unlock(&minix_inode->i_prealloc_lock);
+	return ret;
+}
+
+/*
+ * Drops the reservation of count delayed buffers, either because they got
+ * their zones at writeback or because they were thrown away.
+ * The indirect block estimate is dropped with the last one.
+ */
+void minix_release_blocks(struct inode *inode, unsigned int count)
+{
+	struct minix_sb_info *sbi = minix_sb(inode->i_sb);
+	struct minix_inode_info *minix_inode = minix_i(inode);
+	unsigned int release;
+
+	mutex_lock(&minix_inode->i_prealloc_lock);
+	if (count > minix_inode->i_reserved_data) {
+		printk("MINIX-fs: releasing more zones than reserved\n");
+		count = minix_inode->i_reserved_data;
+	}
+	minix_inode->i_reserved_data -= count;
+	release = count;
+	if (!minix_inode->i_reserved_data) {
+		release += minix_inode->i_reserved_meta;
+		minix_inode->i_reserved_meta = 0;
+	}
+
+	spin_lock(&sbi->s_reserve_lock);
+	sbi->s_reserved -= min_t(unsigned long, release, sbi->s_reserved);
+	spin_unlock(&sbi->s_reserve_lock);
+	mutex_unlock(&minix_inode->i_prealloc_lock);
+}
+
 unsigned long minix_count_free_blocks(struct super_block *sb)
 {
 	struct minix_sb_info *sbi = minix_sb(sb);
-	u32 bits = sbi->s_nzones - sbi->s_firstdatazone + 1;
 
-	return (count_free(sbi->s_zmap, sb->s_blocksize, bits)
+	count_zone_groups(sb, ULONG_MAX);
+#if CHECK_FREE_COUNTS
+	check_free_zones(sb);
+#endif
+	return (percpu_counter_sum_positive(&sbi->s_free_zones)
 		<< sbi->s_log_zone_size);
 }
 
@@ -291,6 +1895,7 @@ static void minix_clear_inode(struct inode *inode)
 		}
 	} else {
 		struct minix2_inode *raw_inode;
+		minix_snapshot_capture_inode(inode);
 		raw_inode = minix_V2_raw_inode(inode->i_sb, inode->i_ino, &bh);
 		if (raw_inode) {
 			raw_inode->i_nlinks = 0;
@@ -298,7 +1903,7 @@ static void minix_clear_inode(struct inode *inode)
 		}
 	}
 	if (bh) {
-		mark_buffer_dirty(bh);
+		minix_journal_dirty(inode->i_sb, bh);
 		brelse (bh);
 	}
 }
@@ -326,12 +1931,23 @@ void minix_free_inode(struct inode * inode)
 
 	minix_clear_inode(inode);	/* clear on-disk copy */
 
-	bh = sbi->s_imap[ino];
-	spin_lock(&bitmap_lock);
+	minix_snapshot_capture(sb, ino);
+	bh = sb_bread(sb, minix_imap_block(sbi, ino));
+	if (!bh) {
+		printk("minix_free_inode: unable to read inode map\n");
+		return;
+	}
+	mutex_lock(&bitmap_lock);
 	if (!minix_test_and_clear_bit(bit, bh->b_data))
 		printk("minix_free_inode: bit %lu already cleared\n", bit);
-	spin_unlock(&bitmap_lock);
-	mark_buffer_dirty(bh);
+	else if (sbi->s_imap_free[ino] != MINIX_IMAP_UNCOUNTED) {
+		if (!sbi->s_imap_free[ino]++)
+			sbi->s_imap_cursor = inode->i_ino;
+		percpu_counter_inc(&sbi->s_free_inodes);
+	}
+	mutex_unlock(&bitmap_lock);
+	minix_journal_dirty(sb, bh);
+	brelse(bh);
 }
 
 struct inode *minix_new_inode(const struct inode *dir, umode_t mode, int *error)
@@ -342,35 +1958,37 @@ struct inode *minix_new_inode(const struct inode *dir, umode_t mode, int *error)
 	struct buffer_head * bh;
 	int bits_per_zone = 8 * sb->s_blocksize;
 	unsigned long j;
+	long bit;
 	int i;
 
 	if (!inode) {
 		*error = -ENOMEM;
 		return NULL;
 	}
-	j = bits_per_zone;
-	bh = NULL;
 	*error = -ENOSPC;
-	spin_lock(&bitmap_lock);
-	for (i = 0; i < sbi->s_imap_blocks; i++) {
-		bh = sbi->s_imap[i];
-		j = minix_find_first_zero_bit(bh->b_data, bits_per_zone);
-		if (j < bits_per_zone)
-			break;
-	}
-	if (!bh || j >= bits_per_zone) {
-		spin_unlock(&bitmap_lock);
+	mutex_lock(&bitmap_lock);
+	bit = find_free_inode_bit(sb, &bh);
+	if (bit < 0) {
+		mutex_unlock(&bitmap_lock);
 		iput(inode);
 		return NULL;
 	}
+	i = bit / bits_per_zone;
+	j = bit % bits_per_zone;
+	// Lazy snapshots copy the inode map block before it changes
+	minix_snapshot_capture(sb, i);
 	if (minix_test_and_set_bit(j, bh->b_data)) {	/* shouldn't happen */
-		spin_unlock(&bitmap_lock);
+		mutex_unlock(&bitmap_lock);
+		brelse(bh);
 		printk("minix_new_inode: bit already set\n");
 		iput(inode);
 		return NULL;
 	}
-	spin_unlock(&bitmap_lock);
-	mark_buffer_dirty(bh);
+	sbi->s_imap_free[i]--;
+	percpu_counter_dec(&sbi->s_free_inodes);
+	mutex_unlock(&bitmap_lock);
+	minix_journal_dirty(sb, bh);
+	brelse(bh);
 	j += i * bits_per_zone;
 	if (!j || j > sbi->s_ninodes) {
 		iput(inode);
@@ -382,6 +2000,8 @@ struct inode *minix_new_inode(const struct inode *dir, umode_t mode, int *error)
 	inode->i_mtime = inode->i_atime = inode->i_ctime = current_time(inode);
 	inode->i_blocks = 0;
 	memset(&minix_i(inode)->u, 0, sizeof(minix_i(inode)->u));
+	if (S_ISREG(mode) && minix_has_feature(sbi, EXTENTS_DEFAULT))
+		minix_ext_init(inode);
 	insert_inode_hash(inode);
 	mark_inode_dirty(inode);
 
@@ -392,7 +2012,26 @@ struct inode *minix_new_inode(const struct inode *dir, umode_t mode, int *error)
 unsigned long minix_count_free_inodes(struct super_block *sb)
 {
 	struct minix_sb_info *sbi = minix_sb(sb);
-	u32 bits = sbi->s_ninodes + 1;
+	struct buffer_head *bh;
+	unsigned long i;
+
+	// Count the inode map blocks no allocation has read yet
+	mutex_lock(&bitmap_lock);
+	for (i = 0; i < sbi->s_imap_blocks; i++) {
+		if (sbi->s_imap_free[i] != MINIX_IMAP_UNCOUNTED)
+			continue;
+		bh = sb_bread(sb, minix_imap_block(sbi, i));
+		if (!bh)
+			continue;
+		count_imap_block(sb, i, bh);
+		brelse(bh);
+	}
+	mutex_unlock(&bitmap_lock);
 
-	return count_free(sbi->s_imap, sb->s_blocksize, bits);
+#if CHECK_FREE_COUNTS
+	if (count_free(sb, minix_imap_block(sbi, 0), sbi->s_ninodes + 1) !=
+	    percpu_counter_sum(&sbi->s_free_inodes))
+		printk("MINIX-fs: free inode counter disagrees with the inode map\n");
+#endif
+	return percpu_counter_sum_positive(&sbi->s_free_inodes);
 }
@@ -0,0 +1,1048 @@
+/*
+ *  linux/fs/minix/extents.c
+ *
+ *  Extent mapped inodes
+ */
+
+/*
+ * A regular file with MINIX_I_EXTENTS maps its blocks with extents,
+ * runs of logical blocks stored in contiguous zones, instead of the
+ * indirect block tree. The root of the extent tree fills i_zone, the
+ * other nodes take a block each. Index entries hold the lowest logical
+ * block below them, so a lookup descends into the last entry that does
+ * not start behind the block, the first entry of a node is a lower
+ * bound of everything below the node.
+ *
+ * Refcounts stay per zone and count references from inodes and tree
+ * blocks, like for the indirect block tree: a node shared with a clone
+ * or snapshot is copied before it is changed, the copy then takes its
+ * own references on the entries. An extent adds its whole zone range
+ * to refcount batches. All changes to the tree happen under
+ * i_extent_sem.
+ */
+
+#include "minix.h"
+#include <linux/buffer_head.h>
+
+#define EXT_ROOT_SIZE	(NUM_ZONES_IN_INODE * sizeof(__u32))
+
+/* A node on the way from the root to a leaf */
+struct ext_path {
+	struct minix_extent_header *eh;
+	struct buffer_head *bh;		/* NULL for the root in the inode */
+	int pos;			/* entry the lookup took, -1 if before the first */
+};
+
+static inline struct minix_extent_header *ext_root(struct inode *inode)
+{
+	return (struct minix_extent_header *)minix_i(inode)->u.i2_data;
+}
+
+static inline struct minix_extent *ext_first(struct minix_extent_header *eh)
+{
+	return (struct minix_extent *)(eh + 1);
+}
+
+static inline struct minix_extent_idx *ext_first_idx(struct minix_extent_header *eh)
+{
+	return (struct minix_extent_idx *)(eh + 1);
+}
+
+/* First logical block behind an extent */
+static inline unsigned long ext_end(struct minix_extent *ex)
+{
+	return (unsigned long)ex->e_block + ex->e_len;
+}
+
+static inline unsigned int ext_max(unsigned int size, int depth)
+{
+	return (size - sizeof(struct minix_extent_header)) /
+		(depth ? sizeof(struct minix_extent_idx) : sizeof(struct minix_extent));
+}
+
+static int ext_check(struct super_block *sb, struct minix_extent_header *eh,
+		     int depth, unsigned int size)
+{
+	if (eh->eh_magic == MINIX_EXTENT_MAGIC && eh->eh_depth == depth &&
+	    eh->eh_max == ext_max(size, depth) && eh->eh_entries <= eh->eh_max)
+		return 0;
+	printk("MINIX-fs: bad extent tree node on dev %s\n", sb->s_id);
+	return -EIO;
+}
+
+static int ext_check_root(struct super_block *sb, struct minix_extent_header *eh)
+{
+	if (eh->eh_depth > MINIX_EXT_MAX_DEPTH) {
+		printk("MINIX-fs: extent tree too deep on dev %s\n", sb->s_id);
+		return -EIO;
+	}
+	return ext_check(sb, eh, eh->eh_depth, EXT_ROOT_SIZE);
+}
+
+/* Last extent starting at or before block, -1 if there is none */
+static int ext_search_leaf(struct minix_extent_header *eh, unsigned long block)
+{
+	struct minix_extent *ex = ext_first(eh);
+	int lo = 0, hi = eh->eh_entries - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (ex[mid].e_block <= block)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return hi;
+}
+
+/* Last index entry starting at or before block, the first one if there is none */
+static int ext_search_idx(struct minix_extent_header *eh, unsigned long block)
+{
+	struct minix_extent_idx *idx = ext_first_idx(eh);
+	int lo = 1, hi = eh->eh_entries - 1, mid;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (idx[mid].ei_block <= block)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return hi;
+}
+
+static void ext_release(struct ext_path *path, int depth)
+{
+	for (; depth > 0; depth--)
+		brelse(path[depth].bh);
+}
+
+static void ext_dirty(struct inode *inode, struct ext_path *p)
+{
+	if (p->bh)
+		minix_journal_dirty_inode(p->bh, inode);
+	else
+		mark_inode_dirty(inode);
+}
+
+static inline bool ext_zone_shared(struct super_block *sb, unsigned long zone)
+{
+	return get_refcount(sb, data_zone_index_for_zone_number(minix_sb(sb), zone)) > 1;
+}
+
+static void ext_add_entries(struct minix_refcount_batch *batch, struct minix_extent_header *eh, int delta);
+
+/*
+ * Gives a shared tree block its own copy before it is changed.
+ * What the block references gets a reference for the copy.
+ */
+static int ext_unshare_node(struct inode *inode, __u32 *zone, bool *changed)
+{
+	struct super_block *sb = inode->i_sb;
+	struct minix_refcount_batch batch;
+	struct buffer_head *bh;
+	uint32_t new_block;
+	int err;
+
+	if (!ext_zone_shared(sb, *zone))
+		return 0;
+	err = deep_copy_block(inode, *zone, true, &new_block);
+	if (err)
+		return err;
+	bh = sb_bread(sb, new_block);
+	if (!bh) {
+		minix_free_block(sb, new_block);
+		return -EIO;
+	}
+	minix_refcount_batch_init(&batch, sb);
+	ext_add_entries(&batch, (struct minix_extent_header *)bh->b_data, 1);
+	brelse(bh);
+	err = minix_refcount_batch_commit(&batch);
+	if (err) {
+		minix_free_block(sb, new_block);
+		return err;
+	}
+	decrement_refcount(sb, data_zone_index_for_zone_number(minix_sb(sb), *zone));
+	*zone = new_block;
+	*changed = true;
+	return 0;
+}
+
+/*
+ * Looks up the path to the leaf that maps block. With write, shared
+ * tree blocks on the path are copied first, so the caller can change
+ * the path. Returns the depth of the tree or an error, the caller
+ * releases the path with ext_release().
+ */
+static int ext_find(struct inode *inode, unsigned long block, struct ext_path *path, bool write)
+{
+	struct super_block *sb = inode->i_sb;
+	struct minix_extent_header *eh = ext_root(inode);
+	struct minix_extent_idx *idx;
+	struct buffer_head *bh;
+	bool changed;
+	int depth, i, err;
+
+	err = ext_check_root(sb, eh);
+	if (err)
+		return err;
+	depth = eh->eh_depth;
+	path[0].eh = eh;
+	path[0].bh = NULL;
+
+	for (i = 0; i < depth; i++) {
+		eh = path[i].eh;
+		// Only leaves may be empty
+		if (!eh->eh_entries) {
+			err = -EIO;
+			goto out;
+		}
+		path[i].pos = ext_search_idx(eh, block);
+		idx = ext_first_idx(eh) + path[i].pos;
+		if (write) {
+			changed = false;
+			err = ext_unshare_node(inode, &idx->ei_leaf, &changed);
+			if (err)
+				goto out;
+			if (changed)
+				ext_dirty(inode, &path[i]);
+		}
+		bh = sb_bread(sb, idx->ei_leaf);
+		if (!bh) {
+			printk("MINIX-fs: unable to read extent block %u\n", idx->ei_leaf);
+			err = -EIO;
+			goto out;
+		}
+		path[i + 1].bh = bh;
+		path[i + 1].eh = (struct minix_extent_header *)bh->b_data;
+		err = ext_check(sb, path[i + 1].eh, depth - i - 1, sb->s_blocksize);
+		if (err) {
+			i++;
+			goto out;
+		}
+	}
+	path[depth].pos = ext_search_leaf(path[depth].eh, block);
+	return depth;
+
+out:
+	ext_release(path, i);
+	return err;
+}
+
+/* Zone that maps block in the leaf of a path, 0 for a hole */
+static unsigned long ext_zone(struct ext_path *leaf, unsigned long block)
+{
+	struct minix_extent *ex;
+
+	if (leaf->pos < 0)
+		return 0;
+	ex = ext_first(leaf->eh) + leaf->pos;
+	if (block >= ext_end(ex))
+		return 0;
+	return ex->e_start + (block - ex->e_block);
+}
+
+/* First mapped logical block behind the position of a path, ~0UL if none */
+static unsigned long ext_next_mapped(struct ext_path *path, int depth)
+{
+	struct ext_path *p = &path[depth];
+
+	if (p->pos + 1 < p->eh->eh_entries)
+		return ext_first(p->eh)[p->pos + 1].e_block;
+	while (depth-- > 0) {
+		p = &path[depth];
+		if (p->pos + 1 < p->eh->eh_entries)
+			return ext_first_idx(p->eh)[p->pos + 1].ei_block;
+	}
+	return ~0UL;
+}
+
+static void ext_insert(struct minix_extent_header *eh, int pos, unsigned long block,
+		       unsigned long start, unsigned long len)
+{
+	struct minix_extent *ex = ext_first(eh) + pos;
+
+	memmove(ex + 1, ex, (eh->eh_entries - pos) * sizeof(*ex));
+	ex->e_block = block;
+	ex->e_start = start;
+	ex->e_len = len;
+	eh->eh_entries++;
+}
+
+static void ext_remove(struct minix_extent_header *eh, int pos)
+{
+	struct minix_extent *ex = ext_first(eh) + pos;
+
+	memmove(ex, ex + 1, (eh->eh_entries - pos - 1) * sizeof(*ex));
+	eh->eh_entries--;
+}
+
+/*
+ * Allocates an empty tree block. It is taken outside the preallocation
+ * window, which is kept for the data of the file.
+ */
+static struct buffer_head *ext_new_node(struct inode *inode, int depth)
+{
+	struct super_block *sb = inode->i_sb;
+	struct minix_extent_header *eh;
+	struct buffer_head *bh;
+	int zone = minix_new_block(inode);
+
+	if (!zone)
+		return NULL;
+	bh = sb_getblk(sb, zone);
+	lock_buffer(bh);
+	memset(bh->b_data, 0, bh->b_size);
+	eh = (struct minix_extent_header *)bh->b_data;
+	eh->eh_magic = MINIX_EXTENT_MAGIC;
+	eh->eh_max = ext_max(sb->s_blocksize, depth);
+	eh->eh_depth = depth;
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	return bh;
+}
+
+/* Moves the entries of the full root into a new block below it */
+static int ext_grow_root(struct inode *inode, struct ext_path *path)
+{
+	struct minix_extent_header *root = path[0].eh;
+	struct minix_extent_header *eh;
+	struct minix_extent_idx *idx;
+	struct buffer_head *bh;
+	int depth = root->eh_depth;
+
+	if (depth == MINIX_EXT_MAX_DEPTH)
+		return -ENOSPC;
+	bh = ext_new_node(inode, depth);
+	if (!bh)
+		return -ENOSPC;
+	eh = (struct minix_extent_header *)bh->b_data;
+	memcpy(eh + 1, root + 1, EXT_ROOT_SIZE - sizeof(*root));
+	eh->eh_entries = root->eh_entries;
+	minix_journal_dirty_inode(bh, inode);
+
+	root->eh_depth = depth + 1;
+	root->eh_max = ext_max(EXT_ROOT_SIZE, depth + 1);
+	root->eh_entries = 1;
+	idx = ext_first_idx(root);
+	idx->ei_block = 0;
+	idx->ei_leaf = bh->b_blocknr;
+	brelse(bh);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/*
+ * Moves entries of the node at level of a path into a new sibling,
+ * whose index entry goes into the parent. A block behind everything
+ * in a leaf starts an empty leaf, so files written sequentially get
+ * full leaves, other nodes are split in halves.
+ */
+static int ext_split(struct inode *inode, struct ext_path *path, int level, unsigned long block)
+{
+	struct ext_path *p = &path[level], *parent = &path[level - 1];
+	struct minix_extent_header *eh = p->eh, *new_eh;
+	struct minix_extent_idx *pidx;
+	struct buffer_head *bh;
+	int depth = eh->eh_depth;
+	size_t size = depth ? sizeof(struct minix_extent_idx) : sizeof(struct minix_extent);
+	unsigned int move;
+	unsigned long key;
+	void *from = NULL;
+
+	if (depth == 0 && eh->eh_entries && block >= ext_end(ext_first(eh) + eh->eh_entries - 1)) {
+		move = 0;
+		key = block;
+	} else {
+		move = eh->eh_entries / 2;
+		if (!move)
+			return -EIO;
+		from = (char *)(eh + 1) + (eh->eh_entries - move) * size;
+		key = depth ? ((struct minix_extent_idx *)from)->ei_block :
+			((struct minix_extent *)from)->e_block;
+	}
+
+	bh = ext_new_node(inode, depth);
+	if (!bh)
+		return -ENOSPC;
+	new_eh = (struct minix_extent_header *)bh->b_data;
+	if (move) {
+		memcpy(new_eh + 1, from, move * size);
+		new_eh->eh_entries = move;
+		eh->eh_entries -= move;
+		ext_dirty(inode, p);
+	}
+	minix_journal_dirty_inode(bh, inode);
+
+	pidx = ext_first_idx(parent->eh) + parent->pos + 1;
+	memmove(pidx + 1, pidx, (parent->eh->eh_entries - parent->pos - 1) * sizeof(*pidx));
+	pidx->ei_block = key;
+	pidx->ei_leaf = bh->b_blocknr;
+	parent->eh->eh_entries++;
+	ext_dirty(inode, parent);
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Makes room in the leaf of a path, one step at a time: splits the
+ * lowest node on the path whose parent has room, or moves the root
+ * down when every node on the path is full. The caller releases the
+ * path and looks the block up again.
+ */
+static int ext_make_room(struct inode *inode, struct ext_path *path, int depth, unsigned long block)
+{
+	int level = depth;
+
+	while (level > 0 && path[level - 1].eh->eh_entries == path[level - 1].eh->eh_max)
+		level--;
+	if (level == 0)
+		return ext_grow_root(inode, path);
+	return ext_split(inode, path, level, block);
+}
+
+/* Sets up an empty extent tree for an inode without blocks */
+void minix_ext_init(struct inode *inode)
+{
+	struct minix_extent_header *eh = ext_root(inode);
+
+	memset(eh, 0, EXT_ROOT_SIZE);
+	eh->eh_magic = MINIX_EXTENT_MAGIC;
+	eh->eh_max = ext_max(EXT_ROOT_SIZE, 0);
+	set_bit(MINIX_I_EXTENTS, &minix_i(inode)->i_flags);
+}
+
+/*
+ * Switches a regular file without blocks between the indirect block
+ * tree and extents. A filesystem with extent mapped files gets the
+ * feature bit, so drivers that do not know extents refuse to mount it.
+ */
+int minix_ext_set_mapping(struct inode *inode, bool extents)
+{
+	struct super_block *sb = inode->i_sb;
+	struct minix_sb_info *sbi = minix_sb(sb);
+	struct minix_extent_header *eh = ext_root(inode);
+	int i;
+
+	if (extents == minix_inode_extents(inode))
+		return 0;
+	if (!S_ISREG(inode->i_mode) || sbi->s_version != MINIX_V3)
+		return -EOPNOTSUPP;
+	if (inode->i_size)
+		return -EBUSY;
+
+	if (!extents) {
+		if (eh->eh_entries)
+			return -EBUSY;
+		memset(eh, 0, EXT_ROOT_SIZE);
+		clear_bit(MINIX_I_EXTENTS, &minix_i(inode)->i_flags);
+		mark_inode_dirty(inode);
+		return 0;
+	}
+
+	for (i = 0; i < NUM_ZONES_IN_INODE; i++) {
+		if (minix_i(inode)->u.i2_data[i])
+			return -EBUSY;
+	}
+	if (!minix_has_feature(sbi, EXTENTS)) {
+		struct minix3_super_block *m3s = (struct minix3_super_block *)sbi->s_sbh->b_data;
+
+		// On disk before any inode that needs it
+		sbi->s_features |= MINIX_FEATURE_EXTENTS;
+		m3s->s_features = sbi->s_features;
+		mark_buffer_dirty(sbi->s_sbh);
+		sync_dirty_buffer(sbi->s_sbh);
+		sb->s_maxbytes = U32_MAX;
+	}
+	minix_ext_init(inode);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/*
+ * get_block for extent mapped inodes. A new block goes right behind
+ * the extent before it, which then just grows.
+ */
+int minix_ext_get_block(struct inode *inode, sector_t block,
+			struct buffer_head *bh, int create)
+{
+	struct minix_inode_info *minix_inode = minix_i(inode);
+	struct ext_path path[MINIX_EXT_MAX_DEPTH + 1];
+	struct minix_extent_header *leaf;
+	struct minix_extent *ex;
+	unsigned long zone = 0, goal;
+	int depth, err = 0;
+
+	if (block >= U32_MAX) {
+		if (printk_ratelimit())
+			printk("MINIX-fs: block %llu too big on dev %pg\n",
+			       (unsigned long long)block, inode->i_sb->s_bdev);
+		return -EIO;
+	}
+
+	down_read(&minix_inode->i_extent_sem);
+	depth = ext_find(inode, block, path, false);
+	if (depth >= 0) {
+		zone = ext_zone(&path[depth], block);
+		ext_release(path, depth);
+	}
+	up_read(&minix_inode->i_extent_sem);
+	if (depth < 0)
+		return depth;
+	if (zone) {
+		map_bh(bh, inode->i_sb, zone);
+		return 0;
+	}
+	if (!create)
+		return 0;
+
+	down_write(&minix_inode->i_extent_sem);
+	depth = ext_find(inode, block, path, true);
+	if (depth < 0) {
+		err = depth;
+		goto out;
+	}
+	// Somebody else may have mapped it meanwhile
+	zone = ext_zone(&path[depth], block);
+	if (zone)
+		goto release;
+
+	leaf = path[depth].eh;
+	ex = path[depth].pos >= 0 ? ext_first(leaf) + path[depth].pos : NULL;
+	goal = ex ? ex->e_start + (block - ex->e_block) : 0;
+	zone = minix_alloc_block(inode, goal);
+	if (!zone) {
+		err = -ENOSPC;
+		goto release;
+	}
+
+	while (!(ex && ext_end(ex) == block && ex->e_start + ex->e_len == zone) &&
+	       leaf->eh_entries == leaf->eh_max) {
+		err = ext_make_room(inode, path, depth, block);
+		ext_release(path, depth);
+		if (!err)
+			depth = ext_find(inode, block, path, true);
+		if (err || depth < 0) {
+			minix_free_block(inode->i_sb, zone);
+			err = err ? err : depth;
+			goto out;
+		}
+		leaf = path[depth].eh;
+		ex = path[depth].pos >= 0 ? ext_first(leaf) + path[depth].pos : NULL;
+	}
+
+	if (ex && ext_end(ex) == block && ex->e_start + ex->e_len == zone)
+		ex->e_len++;
+	else
+		ext_insert(leaf, path[depth].pos + 1, block, zone, 1);
+	ext_dirty(inode, &path[depth]);
+	inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+	set_buffer_new(bh);
+
+release:
+	ext_release(path, depth);
+out:
+	up_write(&minix_inode->i_extent_sem);
+	if (!err)
+		map_bh(bh, inode->i_sb, zone);
+	return err;
+}
+
+/*
+ * Drops a reference to a tree block. With the last one, the block
+ * drops the references to what it maps.
+ */
+static int ext_put_node(struct minix_refcount_batch *batch, unsigned long zone, int depth)
+{
+	struct super_block *sb = batch->sb;
+	struct minix_extent_header *eh;
+	struct buffer_head *bh;
+	int i, err;
+
+	if (!minix_put_tree_block(sb, zone))
+		return 0;
+	bh = sb_bread(sb, zone);
+	if (!bh)
+		return -EIO;
+	eh = (struct minix_extent_header *)bh->b_data;
+	err = ext_check(sb, eh, depth, sb->s_blocksize);
+	for (i = 0; !err && i < eh->eh_entries; i++) {
+		if (depth)
+			err = ext_put_node(batch, ext_first_idx(eh)[i].ei_leaf, depth - 1);
+		else
+			minix_refcount_batch_add_range(batch, ext_first(eh)[i].e_start,
+						       ext_first(eh)[i].e_len, -1);
+	}
+	brelse(bh);
+	minix_refcount_batch_add(batch, zone, -1);
+	return err;
+}
+
+/* Adds delta to the refcounts of everything a node references directly */
+static void ext_add_entries(struct minix_refcount_batch *batch, struct minix_extent_header *eh, int delta)
+{
+	int i;
+
+	for (i = 0; i < eh->eh_entries; i++) {
+		if (eh->eh_depth)
+			minix_refcount_batch_add(batch, ext_first_idx(eh)[i].ei_leaf, delta);
+		else
+			minix_refcount_batch_add_range(batch, ext_first(eh)[i].e_start,
+						       ext_first(eh)[i].e_len, delta);
+	}
+}
+
+/* See minix_refcount_batch_get_zones() */
+void minix_ext_get_root(struct minix_refcount_batch *batch, __u32 *root)
+{
+	struct minix_extent_header *eh = (struct minix_extent_header *)root;
+
+	if (ext_check_root(batch->sb, eh)) {
+		batch->error = -EIO;
+		return;
+	}
+	ext_add_entries(batch, eh, 1);
+}
+
+/* See minix_refcount_batch_put_zones() */
+int minix_ext_put_root(struct minix_refcount_batch *batch, __u32 *root)
+{
+	struct minix_extent_header *eh = (struct minix_extent_header *)root;
+	int i, err, ret;
+
+	err = ext_check_root(batch->sb, eh);
+	if (err || !eh->eh_depth) {
+		if (!err)
+			ext_add_entries(batch, eh, -1);
+		return err;
+	}
+	for (i = 0; i < eh->eh_entries; i++) {
+		ret = ext_put_node(batch, ext_first_idx(eh)[i].ei_leaf, eh->eh_depth - 1);
+		if (ret && !err)
+			err = ret;
+	}
+	return err;
+}
+
+/*
+ * Moves the extents of a root leaf into a tree block, so that a clone
+ * shares all of them through a single reference. The caller holds
+ * i_extent_sem for writing.
+ */
+int minix_ext_share_root(struct inode *inode)
+{
+	struct ext_path path[1] = { { .eh = ext_root(inode) } };
+	int err = ext_check_root(inode->i_sb, path[0].eh);
+
+	if (err || path[0].eh->eh_depth || !path[0].eh->eh_entries)
+		return err;
+	return ext_grow_root(inode, path);
+}
+
+/*
+ * Removes the mappings of the blocks from on below a node.
+ * Returns the number of entries left in the node or an error.
+ */
+static int ext_truncate_node(struct inode *inode, struct ext_path *p, unsigned long from,
+			     struct minix_refcount_batch *batch)
+{
+	struct super_block *sb = inode->i_sb;
+	struct minix_extent_header *eh = p->eh;
+	struct minix_extent_idx *idx = ext_first_idx(eh);
+	struct minix_extent *ex = ext_first(eh);
+	struct ext_path child;
+	bool dirty = false;
+	int i, left, err = 0;
+
+	for (i = eh->eh_entries - 1; i >= 0; i--) {
+		if (eh->eh_depth == 0) {
+			if (ex[i].e_block < from) {
+				if (ext_end(&ex[i]) > from) {
+					minix_refcount_batch_add_range(batch, ex[i].e_start + (from - ex[i].e_block),
+								       ext_end(&ex[i]) - from, -1);
+					ex[i].e_len = from - ex[i].e_block;
+					dirty = true;
+				}
+				break;
+			}
+			minix_refcount_batch_add_range(batch, ex[i].e_start, ex[i].e_len, -1);
+		} else if (idx[i].ei_block >= from) {
+			err = ext_put_node(batch, idx[i].ei_leaf, eh->eh_depth - 1);
+		} else {
+			// Only this child is cut, the ones before it end before from
+			err = ext_unshare_node(inode, &idx[i].ei_leaf, &dirty);
+			if (err)
+				break;
+			child.bh = sb_bread(sb, idx[i].ei_leaf);
+			if (!child.bh) {
+				err = -EIO;
+				break;
+			}
+			child.eh = (struct minix_extent_header *)child.bh->b_data;
+			err = ext_check(sb, child.eh, eh->eh_depth - 1, sb->s_blocksize);
+			left = err ? err : ext_truncate_node(inode, &child, from, batch);
+			brelse(child.bh);
+			if (left) {
+				err = left < 0 ? left : 0;
+				break;
+			}
+			minix_refcount_batch_add(batch, idx[i].ei_leaf, -1);
+		}
+		if (err)
+			break;
+		eh->eh_entries = i;
+		dirty = true;
+	}
+	if (dirty)
+		ext_dirty(inode, p);
+	return err ? err : eh->eh_entries;
+}
+
+/* Whether the inode maps blocks from on, false if it surely does not */
+static bool ext_maps_from(struct inode *inode, unsigned long from)
+{
+	struct ext_path path[MINIX_EXT_MAX_DEPTH + 1];
+	struct minix_extent_header *leaf;
+	bool ret = true;
+	int depth;
+
+	depth = ext_find(inode, ~0UL, path, false);
+	if (depth < 0)
+		return true;
+	leaf = path[depth].eh;
+	if (!leaf->eh_entries)
+		ret = depth > 0;
+	else if (ext_end(ext_first(leaf) + leaf->eh_entries - 1) <= from)
+		ret = false;
+	ext_release(path, depth);
+	return ret;
+}
+
+void minix_ext_truncate(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct minix_inode_info *minix_inode = minix_i(inode);
+	struct minix_refcount_batch batch;
+	struct ext_path root = { .eh = ext_root(inode) };
+	unsigned long from;
+	int err;
+
+	from = (inode->i_size + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+	block_truncate_page(inode->i_mapping, inode->i_size, minix_ext_get_block);
+
+	minix_refcount_batch_init(&batch, sb);
+	down_write(&minix_inode->i_extent_sem);
+	// Growing a file must not copy the shared blocks on its right edge
+	err = ext_check_root(sb, root.eh);
+	if (!err && ext_maps_from(inode, from)) {
+		err = ext_truncate_node(inode, &root, from, &batch);
+		if (err == 0 && root.eh->eh_depth) {
+			minix_ext_init(inode);
+			mark_inode_dirty(inode);
+		}
+	}
+	up_write(&minix_inode->i_extent_sem);
+	if (err > 0)
+		err = 0;
+	if (minix_refcount_batch_commit(&batch) && !err)
+		err = -EIO;
+	if (err)
+		printk("MINIX-fs: error %d truncating inode %lu\n", err, inode->i_ino);
+
+	inode->i_mtime = inode->i_ctime = current_time(inode);
+	mark_inode_dirty(inode);
+}
+
+/*
+ * Points block b of extent pos to zone new. The block joins the extent
+ * before or after it when the zones line up, otherwise the extent is
+ * split around it. The leaf needs room for two more entries.
+ */
+static void ext_remap(struct minix_extent_header *eh, int pos, unsigned long b, unsigned long new)
+{
+	struct minix_extent *ex = ext_first(eh) + pos;
+	struct minix_extent *prev = pos > 0 ? ex - 1 : NULL;
+	struct minix_extent *next = pos + 1 < eh->eh_entries ? ex + 1 : NULL;
+	unsigned long off = b - ex->e_block;
+	bool join_prev = prev && off == 0 && ext_end(prev) == b && prev->e_start + prev->e_len == new;
+	bool join_next = next && off == ex->e_len - 1 && next->e_block == b + 1 && next->e_start == new + 1;
+
+	if (join_prev) {
+		prev->e_len++;
+	} else if (join_next) {
+		next->e_block--;
+		next->e_start--;
+		next->e_len++;
+	}
+
+	if (ex->e_len == 1) {
+		if (join_prev || join_next)
+			ext_remove(eh, pos);
+		else
+			ex->e_start = new;
+	} else if (off == 0) {
+		ex->e_block++;
+		ex->e_start++;
+		ex->e_len--;
+		if (!join_prev)
+			ext_insert(eh, pos, b, new, 1);
+	} else if (off == ex->e_len - 1) {
+		ex->e_len--;
+		if (!join_next)
+			ext_insert(eh, pos + 1, b, new, 1);
+	} else {
+		ext_insert(eh, pos + 1, b + 1, ex->e_start + off + 1, ex->e_len - off - 1);
+		ext_insert(eh, pos + 1, b, new, 1);
+		ex->e_len = off;
+	}
+}
+
+/*
+ * minix_cow_range() for extent mapped inodes: every shared block of
+ * first..last gets its own zone, the extents are split around it and
+ * the new zones of neighbouring blocks join into one extent again.
+ * Returns 1 if a data block changed, 0 if none did or a negative error.
+ */
+int minix_ext_cow_range(struct inode *inode, unsigned long first, unsigned long last, bool deep_copy)
+{
+	struct super_block *sb = inode->i_sb;
+	struct minix_inode_info *minix_inode = minix_i(inode);
+	struct ext_path path[MINIX_EXT_MAX_DEPTH + 1];
+	struct minix_extent_header *leaf;
+	struct minix_extent *ex;
+	unsigned long block = first, b, end, old, prev_new = 0;
+	uint32_t new;
+	bool changed = false;
+	int depth, err = 0;
+
+	last = min_t(unsigned long, last, U32_MAX - 1);
+	if (first > last)
+		return 0;
+	minix_set_alloc_hint(inode, last - first + 1);
+
+	down_write(&minix_inode->i_extent_sem);
+	while (block <= last) {
+		depth = ext_find(inode, block, path, true);
+		if (depth < 0) {
+			err = depth;
+			break;
+		}
+		leaf = path[depth].eh;
+		ex = path[depth].pos >= 0 ? ext_first(leaf) + path[depth].pos : NULL;
+
+		// Holes have nothing to copy
+		if (!ex || block >= ext_end(ex)) {
+			block = ext_next_mapped(path, depth);
+			ext_release(path, depth);
+			if (block == ~0UL)
+				break;
+			continue;
+		}
+
+		end = min(last, ext_end(ex) - 1);
+		for (b = block; b <= end; b++) {
+			if (ext_zone_shared(sb, ex->e_start + (b - ex->e_block)))
+				break;
+		}
+		if (b > end) {
+			block = end + 1;
+			ext_release(path, depth);
+			continue;
+		}
+
+		if (leaf->eh_entries + 2 > leaf->eh_max) {
+			err = ext_make_room(inode, path, depth, b);
+			ext_release(path, depth);
+			if (err)
+				break;
+			block = b;
+			continue;
+		}
+
+		old = ex->e_start + (b - ex->e_block);
+		if (deep_copy) {
+			err = deep_copy_block(inode, old, false, &new);
+		} else {
+			new = minix_alloc_block(inode, prev_new ? prev_new + 1 : 0);
+			if (!new)
+				err = -ENOSPC;
+		}
+		if (err) {
+			debug_log("ERROR: Could not get new block for CoW");
+			ext_release(path, depth);
+			break;
+		}
+		ext_remap(leaf, path[depth].pos, b, new);
+		ext_dirty(inode, &path[depth]);
+		decrement_refcount(sb, data_zone_index_for_zone_number(minix_sb(sb), old));
+		changed = true;
+		prev_new = new;
+		ext_release(path, depth);
+		block = b + 1;
+	}
+	up_write(&minix_inode->i_extent_sem);
+	return err ? err : changed;
+}
+
+/* Unmaps block b of extent pos. The leaf needs room for one more entry. */
+static void ext_punch(struct minix_extent_header *eh, int pos, unsigned long b)
+{
+	struct minix_extent *ex = ext_first(eh) + pos;
+	unsigned long off = b - ex->e_block;
+
+	if (ex->e_len == 1) {
+		ext_remove(eh, pos);
+	} else if (off == 0) {
+		ex->e_block++;
+		ex->e_start++;
+		ex->e_len--;
+	} else if (off == ex->e_len - 1) {
+		ex->e_len--;
+	} else {
+		ext_insert(eh, pos + 1, b + 1, ex->e_start + off + 1, ex->e_len - off - 1);
+		ex->e_len = off;
+	}
+}
+
+/*
+ * Maps the unmapped block b behind extent pos (-1: before the first one)
+ * to zone. The leaf needs room for one more entry.
+ */
+static void ext_map_hole(struct minix_extent_header *eh, int pos, unsigned long b, unsigned long zone)
+{
+	struct minix_extent *prev = pos >= 0 ? ext_first(eh) + pos : NULL;
+	struct minix_extent *next = pos + 1 < eh->eh_entries ? ext_first(eh) + pos + 1 : NULL;
+
+	if (prev && ext_end(prev) == b && prev->e_start + prev->e_len == zone) {
+		prev->e_len++;
+	} else if (next && next->e_block == b + 1 && next->e_start == zone + 1) {
+		next->e_block--;
+		next->e_start--;
+		next->e_len++;
+	} else {
+		ext_insert(eh, pos + 1, b, zone, 1);
+	}
+}
+
+/* minix_map_zone() for extent mapped inodes */
+int minix_ext_map_zone(struct inode *inode, unsigned long block, unsigned long zone,
+		       struct minix_refcount_batch *batch)
+{
+	struct minix_inode_info *minix_inode = minix_i(inode);
+	struct ext_path path[MINIX_EXT_MAX_DEPTH + 1];
+	struct minix_extent_header *leaf;
+	unsigned long old;
+	int depth, err;
+
+	if (block >= U32_MAX)
+		return -EFBIG;
+
+	down_write(&minix_inode->i_extent_sem);
+	for (;;) {
+		depth = ext_find(inode, block, path, true);
+		if (depth < 0) {
+			err = depth;
+			goto out;
+		}
+		leaf = path[depth].eh;
+		old = ext_zone(&path[depth], block);
+		// Remapping a block in the middle of an extent splits it in three
+		if (old == zone || leaf->eh_entries + 2 <= leaf->eh_max)
+			break;
+		err = ext_make_room(inode, path, depth, block);
+		ext_release(path, depth);
+		if (err)
+			goto out;
+	}
+
+	if (old != zone) {
+		if (old && zone)
+			ext_remap(leaf, path[depth].pos, block, zone);
+		else if (old)
+			ext_punch(leaf, path[depth].pos, block);
+		else
+			ext_map_hole(leaf, path[depth].pos, block, zone);
+		ext_dirty(inode, &path[depth]);
+	}
+	if (old)
+		minix_refcount_batch_add(batch, old, -1);
+	ext_release(path, depth);
+	err = 0;
+out:
+	up_write(&minix_inode->i_extent_sem);
+	return err;
+}
+
+static int ext_walk_node(struct minix_walk *walk, struct minix_extent_header *eh,
+			 unsigned long first, unsigned long last);
+
+static int ext_walk_branch(struct minix_walk *walk, uint32_t *zone, int depth,
+			   unsigned long block, unsigned long first, unsigned long last)
+{
+	struct super_block *sb = walk->sb;
+	struct buffer_head *bh;
+	int ret = 0;
+
+	if (walk->actor)
+		ret = walk->actor(walk, zone, depth, max(block, first));
+	if (ret == MINIX_WALK_SKIP)
+		return 0;
+	if (ret)
+		return ret;
+
+	bh = sb_bread(sb, *zone);
+	if (!bh) {
+		printk("MINIX-fs: unable to read extent block %u\n", *zone);
+		return -EIO;
+	}
+	ret = ext_check(sb, (struct minix_extent_header *)bh->b_data, depth - 1, sb->s_blocksize);
+	if (!ret)
+		ret = ext_walk_node(walk, (struct minix_extent_header *)bh->b_data, first, last);
+	brelse(bh);
+	return ret;
+}
+
+static int ext_walk_node(struct minix_walk *walk, struct minix_extent_header *eh,
+			 unsigned long first, unsigned long last)
+{
+	struct minix_extent_idx *idx = ext_first_idx(eh);
+	struct minix_extent *ex = ext_first(eh);
+	int i, ret;
+
+	for (i = 0; i < eh->eh_entries; i++) {
+		if (eh->eh_depth == 0) {
+			if (ex[i].e_block > last)
+				break;
+			if (ext_end(&ex[i]) <= first)
+				continue;
+			ret = walk->extent(walk, &ex[i]);
+		} else {
+			if (idx[i].ei_block > last)
+				break;
+			if (i + 1 < eh->eh_entries && idx[i + 1].ei_block <= first)
+				continue;
+			ret = ext_walk_branch(walk, &idx[i].ei_leaf, eh->eh_depth,
+					      idx[i].ei_block, first, last);
+		}
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Calls walk->actor for every tree block and walk->extent for every
+ * extent that maps logical blocks first..last, the tree blocks before
+ * what they reference. Live inodes are walked under i_extent_sem.
+ * Returns 0, MINIX_WALK_STOP or the first error.
+ */
+int minix_ext_walk(struct minix_walk *walk, __u32 *root, unsigned long first, unsigned long last)
+{
+	struct minix_extent_header *eh = (struct minix_extent_header *)root;
+	int ret = ext_check_root(walk->sb, eh);
+
+	if (ret)
+		return ret;
+	return ext_walk_node(walk, eh, first, last);
+}
@@ -10,89 +10,284 @@
 #include <linux/buffer_head.h>
 #include "ioctl_basic.h" 
 
-// CoW implementation
-static int minix_clone_file_range(struct file *src_file, loff_t off,
-		struct file *dst_file, loff_t destoff, u64 len) {
-
-	// Only src_file and dst_file are useful
-	// off, destoff and len are always 0 when called from ioctl (e.g. during cp)
-
-	struct inode *src_inode = src_file->f_inode;
-	struct inode *dst_inode = dst_file->f_inode;
+/*
+ * Makes dst reference all zones of src, in place of its own. Used when
+ * src replaces dst completely, the cost does not depend on the size.
+ */
+static int minix_clone_whole_file(struct inode *src_inode, struct inode *dst_inode)
+{
 	struct minix_inode_info *src_minix_inode = minix_i(src_inode);
 	struct minix_inode_info *dst_minix_inode = minix_i(dst_inode);
-	int i;
-	size_t data_zone_index;
+	bool extents = minix_inode_extents(src_inode);
+	bool old_extents = minix_inode_extents(dst_inode);
+	__u32 old_zones[NUM_ZONES_IN_INODE];
+	struct minix_refcount_batch batch;
+	int i, ret;
+
+	minix_discard_prealloc(dst_inode);
+
+	// Assign all zones to the target and take one reference on each zone the
+	// inode points to, the trees below are shared through their top blocks.
+	// A root leaf of extents first moves into a tree block, so that the
+	// clone stays independent of the number of extents.
+	down_write(&src_minix_inode->i_extent_sem);
+	down_write(&dst_minix_inode->i_extent_sem);
+	ret = extents ? minix_ext_share_root(src_inode) : 0;
+
+	// dst only points to the zones once they count its references
+	if (!ret) {
+		minix_refcount_batch_init(&batch, dst_inode->i_sb);
+		minix_refcount_batch_get_zones(&batch, src_minix_inode->u.i2_data, extents);
+		ret = minix_refcount_batch_commit(&batch);
+	}
+	if (!ret) {
+		for (i = 0; i < NUM_ZONES_IN_INODE; i++) {
+			old_zones[i] = dst_minix_inode->u.i2_data[i];
+			dst_minix_inode->u.i2_data[i] = src_minix_inode->u.i2_data[i];
+		}
+		if (extents)
+			set_bit(MINIX_I_EXTENTS, &dst_minix_inode->i_flags);
+		else
+			clear_bit(MINIX_I_EXTENTS, &dst_minix_inode->i_flags);
+
+		// Dropping the old zones frees tree blocks on their last
+		// reference right away, the new ones must count first
+		minix_refcount_batch_init(&batch, dst_inode->i_sb);
+		minix_refcount_batch_put_zones(&batch, old_zones, old_extents);
+		ret = minix_refcount_batch_commit(&batch);
+	}
+	up_write(&dst_minix_inode->i_extent_sem);
+	up_write(&src_minix_inode->i_extent_sem);
+	return ret;
+}
 
+/*
+ * Makes a range of dst share the zones of the range of src. With dedupe
+ * the ranges must hold the same bytes already, -EBADE otherwise. *len
+ * is the length shared, 0 for nothing to do.
+ */
+static int minix_share_range(struct file *src_file, loff_t off,
+		struct file *dst_file, loff_t destoff, u64 *len, bool dedupe) {
+	struct inode *src_inode = file_inode(src_file);
+	struct inode *dst_inode = file_inode(dst_file);
+	struct address_space *mapping = dst_inode->i_mapping;
 	struct super_block *sb = dst_inode->i_sb;
 	struct minix_sb_info *sbi = minix_sb(sb);
+	struct minix_handle handle;
+	unsigned long nrpages;
+	loff_t src_size, blen;
+	bool whole;
+	int ret;
 
 	PRINT_FUNC()
 	debug_log("\tShould clone file %x (inode %x) to file %x (inode %x)\n", src_file, src_file->f_inode, dst_file, dst_file->f_inode);
 
-	// Make sure all modifications of the src_file have been written to disk
-	// The content of dst_file will be read from disk after cloning,
-	// and if there are unsaved changes it will read 'old' data
-	// This is synchronous and maybe there is a better way to prevent this problem, but this works for now
-	write_inode_now(src_inode, 1);
+	if (INODE_VERSION(src_inode) == MINIX_V1)
+		return -EOPNOTSUPP;
 
-	// Direct blocks: assign to target and increase refcount on blocks
-	for (i = 0; i < INDIRECT_BLOCK_INDEX; i++) {
-		if (src_minix_inode->u.i2_data[i] != 0) {
-			// Assign the zone number
-			dst_minix_inode->u.i2_data[i] = src_minix_inode->u.i2_data[i];
-			debug_log("\tSetting block %d to %d\n", i, data_zone_index_for_zone_number(sbi, dst_minix_inode->u.i2_data[i]));
-			
-			// Increase refcount on data block
-			data_zone_index = data_zone_index_for_zone_number(sbi, dst_minix_inode->u.i2_data[i]);
-			increment_refcount(sbi, data_zone_index);
+	lock_two_nondirectories(src_inode, dst_inode);
+
+	// Checks the block alignment and the overlap within one file, turns
+	// len 0 into "up to the end of src" and writes back both ranges,
+	// so the zones looked up below hold the current contents.
+	// A dedupe compares the ranges as well, with both inodes locked.
+	ret = vfs_clone_file_prep_inodes(src_inode, off, dst_inode, destoff, len, dedupe);
+	if (ret <= 0) {
+		*len = 0;
+		goto out_unlock;
+	}
+
+	// Writeback of delayed buffers elsewhere in the files fills holes
+	// in the trees about to be shared, so it has to happen first
+	ret = filemap_write_and_wait(src_inode->i_mapping);
+	if (!ret && dst_inode != src_inode)
+		ret = filemap_write_and_wait(mapping);
+	if (ret) {
+		*len = 0;
+		goto out_unlock;
+	}
+
+	// A range that ends with src may end within its last block. The
+	// whole block is shared then, so the range has to cover the end
+	// of dst as well, or the tail of the block would replace its data.
+	// A dedupe leaves that block out instead.
+	src_size = i_size_read(src_inode);
+	blen = *len;
+	if (off + *len == src_size && !IS_ALIGNED(*len, sb->s_blocksize)) {
+		if (destoff + *len >= i_size_read(dst_inode)) {
+			blen = ALIGN(src_size, sb->s_blocksize) - off;
+		} else if (dedupe) {
+			*len = blen = round_down(*len, sb->s_blocksize);
+			if (!blen)
+				goto out_unlock;
+		} else {
+			ret = -EINVAL;
+			*len = 0;
+			goto out_unlock;
 		}
 	}
 
-	// Single indirect blocks: Assign indirect block and increase refcount on indirect block and data blocks
-	if (src_minix_inode->u.i2_data[INDIRECT_BLOCK_INDEX] != 0) {
-		// Assign indirect block
-		dst_minix_inode->u.i2_data[INDIRECT_BLOCK_INDEX] = src_minix_inode->u.i2_data[INDIRECT_BLOCK_INDEX];
-		debug_log("\tSetting block %d to %d\n", i, data_zone_index_for_zone_number(sbi, dst_minix_inode->u.i2_data[INDIRECT_BLOCK_INDEX]));
+	// dst keeps its mapping unless it takes over all of src
+	whole = off == 0 && destoff == 0 && *len == src_size && i_size_read(dst_inode) <= src_size;
+	if (!whole && destoff + *len > minix_max_bytes(dst_inode)) {
+		ret = -EFBIG;
+		*len = 0;
+		goto out_unlock;
+	}
+
+	minix_journal_start(sb, &handle);
+
+	// Lazy snapshots copy the inodes before their zones change
+	minix_snapshot_capture_inode(src_inode);
+	minix_snapshot_capture_inode(dst_inode);
+
+	// Both inodes reference the same zones from now on
+	minix_set_may_share(src_inode);
+	minix_set_may_share(dst_inode);
+
+	if (whole)
+		ret = minix_clone_whole_file(src_inode, dst_inode);
+	else
+		ret = minix_clone_blocks(src_inode, off >> sb->s_blocksize_bits, dst_inode,
+					 destoff >> sb->s_blocksize_bits, blen >> sb->s_blocksize_bits);
 
-		// Increase refcount on indirect block
-		increment_refcounts_on_indirect_block(sb, dst_minix_inode->u.i2_data[INDIRECT_BLOCK_INDEX]);
+	// The cached pages of the range still map the old zones of dst,
+	// the next read gets the new ones from disk. Pages of a clone
+	// hold the old contents as well.
+	nrpages = mapping->nrpages;
+	truncate_inode_pages_range(mapping, destoff, destoff + blen - 1);
+	atomic64_add(nrpages - mapping->nrpages, &sbi->s_cow_invalidated_pages);
+	if (!dedupe) {
+		if (!ret && destoff + *len > i_size_read(dst_inode))
+			i_size_write(dst_inode, destoff + *len);
+		dst_inode->i_mtime = dst_inode->i_ctime = current_time(dst_inode);
+		mark_inode_dirty(dst_inode);
 	}
 
-	// Double indirect blocks:
-	// - Assign double indirect block in inode
-	// - Increase refcount of double indirect block
-	// 		- Increase refcount of all single indirect blocks and their data blocks
-	if (src_minix_inode->u.i2_data[DOUBLE_INDIRECT_BLOCK_INDEX] != 0) {
-		struct buffer_head *bh;
-		uint32_t *double_indirect_block;
-		size_t n_blockrefs_in_block = sb->s_blocksize / sizeof(uint32_t);
-
-		// Assign double indirect block
-		dst_minix_inode->u.i2_data[DOUBLE_INDIRECT_BLOCK_INDEX] = src_minix_inode->u.i2_data[DOUBLE_INDIRECT_BLOCK_INDEX];
-
-		// Increase refcount on double indirect block
-		data_zone_index = data_zone_index_for_zone_number(sbi, dst_minix_inode->u.i2_data[DOUBLE_INDIRECT_BLOCK_INDEX]);
-		increment_refcount(sbi, data_zone_index);
-
-		// Read double indirect block to find single indirect blocks
-		bh = sb_bread(sb, dst_minix_inode->u.i2_data[DOUBLE_INDIRECT_BLOCK_INDEX]);
-		double_indirect_block = (uint32_t*) bh->b_data;
-
-		for (i = 0; i < n_blockrefs_in_block; i++) {
-			if (double_indirect_block[i] != 0) {
-				increment_refcounts_on_indirect_block(sb, double_indirect_block[i]);
-			}
+	minix_journal_stop(sb, &handle);
+out_unlock:
+	unlock_two_nondirectories(src_inode, dst_inode);
+	return ret;
+}
+
+// CoW implementation
+static int minix_clone_file_range(struct file *src_file, loff_t off,
+		struct file *dst_file, loff_t destoff, u64 len)
+{
+	return minix_share_range(src_file, off, dst_file, destoff, &len, false);
+}
+
+/*
+ * Lets a range of dst share the zones of a range of src with the same
+ * contents, its own zones are dropped. Returns the bytes deduplicated.
+ */
+static ssize_t minix_dedupe_file_range(struct file *src_file, u64 off, u64 len,
+		struct file *dst_file, u64 destoff)
+{
+	int ret = minix_share_range(src_file, off, dst_file, destoff, &len, true);
+
+	return ret ? ret : len;
+}
+
+/*
+ * copy_file_range() shares the blocks both files have at the same
+ * offset within a block and copies only the unaligned head and tail.
+ * A range up to the end of src that covers the end of dst shares the
+ * last block as well.
+ */
+static ssize_t minix_copy_file_range(struct file *src_file, loff_t off,
+		struct file *dst_file, loff_t destoff, size_t len, unsigned int flags)
+{
+	struct inode *src_inode = file_inode(src_file);
+	struct inode *dst_inode = file_inode(dst_file);
+	loff_t mask = src_inode->i_sb->s_blocksize - 1;
+	loff_t src_size = i_size_read(src_inode);
+	ssize_t copied = 0, ret;
+	size_t head, body;
+
+	// Different offsets within a block leave nothing to share,
+	// the VFS copies through the page cache then
+	if ((off & mask) != (destoff & mask))
+		return -EOPNOTSUPP;
+	if (off >= src_size)
+		return 0;
+	len = min_t(u64, len, src_size - off);
+
+	head = min_t(size_t, len, (mask + 1 - (off & mask)) & mask);
+	if (head) {
+		ret = do_splice_direct(src_file, &off, dst_file, &destoff, head, 0);
+		if (ret <= 0)
+			return ret;
+		copied += ret;
+		if (ret < head)
+			return copied;
+	}
+
+	body = (len - copied) & ~mask;
+	if (off + (len - copied) == src_size && destoff + (len - copied) >= i_size_read(dst_inode))
+		body = len - copied;
+	if (body) {
+		// Inodes that cannot share zones get the body copied below
+		ret = minix_clone_file_range(src_file, off, dst_file, destoff, body);
+		if (ret && ret != -EINVAL && ret != -EOPNOTSUPP)
+			return copied ? copied : ret;
+		if (!ret) {
+			off += body;
+			destoff += body;
+			copied += body;
 		}
 	}
 
-	// Set proper size and truncate all currently cached pages of the destination inode
-	// so that the next read will read the new data
-	truncate_setsize(dst_inode, src_inode->i_size);
-	truncate_inode_pages_range(&dst_inode->i_data, 0, PAGE_ALIGN(dst_inode->i_size));
-	mark_inode_dirty(dst_inode);
+	if (copied < len) {
+		ret = do_splice_direct(src_file, &off, dst_file, &destoff, len - copied, 0);
+		if (ret > 0)
+			copied += ret;
+		else if (!copied)
+			return ret;
+	}
+	return copied;
+}
+
+/*
+ * FS_IOC_SETFLAGS only knows FS_EXTENT_FL, which switches an empty
+ * regular file to extents and back
+ */
+static long minix_ioctl_setflags(struct file *filp, int __user *arg)
+{
+	struct inode *inode = file_inode(filp);
+	struct minix_handle handle;
+	int flags, ret;
 
-	return 0;
+	if (!inode_owner_or_capable(inode))
+		return -EACCES;
+	if (get_user(flags, arg))
+		return -EFAULT;
+	if (flags & ~FS_EXTENT_FL)
+		return -EOPNOTSUPP;
+
+	ret = mnt_want_write_file(filp);
+	if (ret)
+		return ret;
+	inode_lock(inode);
+	minix_journal_start(inode->i_sb, &handle);
+	ret = minix_ext_set_mapping(inode, flags & FS_EXTENT_FL);
+	minix_journal_stop(inode->i_sb, &handle);
+	inode_unlock(inode);
+	mnt_drop_write_file(filp);
+	return ret;
+}
+
+/*
+ * Copies a snapshot name from user space. Names are stored and looked
+ * up with at most SNAPSHOT_NAME_LENGTH - 1 bytes, longer ones are refused.
+ */
+static long get_snapshot_name(char *name, const char __user *uname)
+{
+	long len = strncpy_from_user(name, uname, SNAPSHOT_NAME_LENGTH);
+
+	if (len < 0)
+		return len;
+	return len < SNAPSHOT_NAME_LENGTH ? 0 : -EINVAL;
 }
 
 long ioctl_funcs(struct file *filp, unsigned int cmd, unsigned long arg) {
@@ -107,27 +302,35 @@ long ioctl_funcs(struct file *filp, unsigned int cmd, unsigned long arg) {
 	int __user *slot_info;
 	int slots_taken = 0;
 	char names[sbi->s_snapshots_slots * SNAPSHOT_NAME_LENGTH];
+	struct btrminix_stats stats;
+	struct btrminix_snapshot_info *info;
+	int flags;
 
 	switch(cmd) {
 		case IOCTL_BTRMINIX_CREATE_SNAPSHOT:
 			snapshot_name_userspace = (char __user*) arg;
-			copy_from_user(snapshot_name, snapshot_name_userspace, SNAPSHOT_NAME_LENGTH);
-			ret = create_snapshot(sb, snapshot_name);
+			ret = get_snapshot_name(snapshot_name, snapshot_name_userspace);
+			if (!ret)
+				ret = create_snapshot(sb, snapshot_name);
 			break;
 		case IOCTL_BTRMINIX_ROLLBACK_SNAPSHOT:
 			snapshot_name_userspace = (char __user*) arg;
-			copy_from_user(snapshot_name, snapshot_name_userspace, SNAPSHOT_NAME_LENGTH);
-			ret = rollback_snapshot(sb, snapshot_name);
+			ret = get_snapshot_name(snapshot_name, snapshot_name_userspace);
+			if (!ret)
+				ret = rollback_snapshot(sb, snapshot_name);
 			break;
 		case IOCTL_BTRMINIX_REMOVE_SNAPSHOT:
 			snapshot_name_userspace = (char __user*) arg;
-			copy_from_user(snapshot_name, snapshot_name_userspace, SNAPSHOT_NAME_LENGTH);
-			ret = remove_snapshot(sb, snapshot_name);
+			ret = get_snapshot_name(snapshot_name, snapshot_name_userspace);
+			if (!ret)
+				ret = remove_snapshot(sb, snapshot_name);
 			break;
 		case IOCTL_BTRMINIX_SLOT_OF_SNAPSHOT:
 			snapshot_struct_userspace = (char __user*) arg;
 			copy_from_user(&snapshot_struct, snapshot_struct_userspace, sizeof(snapshot_struct));
-			copy_from_user(snapshot_name, snapshot_struct.name, SNAPSHOT_NAME_LENGTH);
+			ret = get_snapshot_name(snapshot_name, snapshot_struct.name);
+			if (ret)
+				break;
 			snapshot_slot = slot_of_snapshot(sb, snapshot_name);
 			if(snapshot_slot >= 0) {
 				copy_to_user(snapshot_struct.slot, &snapshot_slot, sizeof(int));
@@ -147,11 +350,85 @@ long ioctl_funcs(struct file *filp, unsigned int cmd, unsigned long arg) {
 			copy_to_user(slot_info+1, &slots_taken, sizeof(int));
 			ret = 0;
 			break;
+		case IOCTL_BTRMINIX_SNAPSHOT_INFO:
+			info = kcalloc(sbi->s_snapshots_slots, sizeof(*info), GFP_KERNEL);
+			if (!info) {
+				ret = -ENOMEM;
+				break;
+			}
+			ret = snapshot_info(sb, info);
+			if (copy_to_user((void __user*) arg, info, sbi->s_snapshots_slots * sizeof(*info)))
+				ret = -EFAULT;
+			kfree(info);
+			break;
+		case IOCTL_BTRMINIX_STATS:
+			minix_get_stats(sb, &stats);
+			if (copy_to_user((void __user*) arg, &stats, sizeof(stats)))
+				ret = -EFAULT;
+			break;
+		case FS_IOC_GETFLAGS:
+			flags = minix_inode_extents(filp->f_inode) ? FS_EXTENT_FL : 0;
+			ret = put_user(flags, (int __user*) arg);
+			break;
+		case FS_IOC_SETFLAGS:
+			ret = minix_ioctl_setflags(filp, (int __user*) arg);
+			break;
 	} 
 
 	return ret;
 }
 
+static ssize_t minix_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	loff_t max_bytes;
+	ssize_t ret;
+
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out_unlock;
+
+	// generic_write_checks() only knows s_maxbytes, which is larger
+	// than what files of the block tree can hold
+	max_bytes = minix_max_bytes(inode);
+	if (iocb->ki_pos >= max_bytes) {
+		ret = -EFBIG;
+		goto out_unlock;
+	}
+	iov_iter_truncate(from, max_bytes - iocb->ki_pos);
+
+	// Let the block allocator reserve a contiguous run for the whole write
+	minix_set_alloc_hint(inode, DIV_ROUND_UP(iov_iter_count(from), inode->i_sb->s_blocksize));
+	ret = __generic_file_write_iter(iocb, from);
+out_unlock:
+	inode_unlock(inode);
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
+
+static int minix_release_file(struct inode *inode, struct file *filp)
+{
+	// Other writers keep using the preallocation window
+	if ((filp->f_mode & FMODE_WRITE) && atomic_read(&inode->i_writecount) == 1)
+		minix_discard_prealloc(inode);
+	return 0;
+}
+
+/*
+ * generic_file_fsync() writes the data and the inode; the metadata they
+ * depend on sits in the running transaction until it is committed.
+ */
+int minix_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+	int err = generic_file_fsync(file, start, end, datasync);
+
+	if (err)
+		return err;
+	return minix_journal_commit(file_inode(file)->i_sb);
+}
+
 /*
  * We have mostly NULLs here: the current defaults are OK for
  * the minix filesystem.
@@ -159,11 +436,14 @@ long ioctl_funcs(struct file *filp, unsigned int cmd, unsigned long arg) {
 const struct file_operations minix_file_operations = {
 	.llseek		= generic_file_llseek,
 	.read_iter	= generic_file_read_iter,
-	.write_iter	= generic_file_write_iter,
+	.write_iter	= minix_file_write_iter,
 	.mmap		= generic_file_mmap,
-	.fsync		= generic_file_fsync,
+	.fsync		= minix_fsync,
+	.release	= minix_release_file,
 	.splice_read	= generic_file_splice_read,
 	.clone_file_range	= minix_clone_file_range,
+	.copy_file_range	= minix_copy_file_range,
+	.dedupe_file_range	= minix_dedupe_file_range,
 	.unlocked_ioctl = ioctl_funcs,
 };
 
@@ -181,9 +461,19 @@ static int minix_setattr(struct dentry *dentry, struct iattr *attr)
 		error = inode_newsize_ok(inode, attr->ia_size);
 		if (error)
 			return error;
+		if (attr->ia_size > minix_max_bytes(inode))
+			return -EFBIG;
 
+		// Unshared before the page cache zeroes the new last block
+		if (attr->ia_size < i_size_read(inode)) {
+			error = minix_truncate_unshare(inode, attr->ia_size);
+			if (error)
+				return error;
+		}
 		truncate_setsize(inode, attr->ia_size);
-		minix_truncate(inode);
+		error = minix_truncate(inode);
+		if (error)
+			return error;
 	}
 
 	setattr_copy(inode, attr);
@@ -18,17 +18,27 @@
 #include <linux/highuid.h>
 #include <linux/vfs.h>
 #include <linux/writeback.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
 
 static int minix_write_inode(struct inode *inode,
 		struct writeback_control *wbc);
+static void minix_dirty_inode(struct inode *inode, int flags);
+static int minix_sync_fs(struct super_block *sb, int wait);
 static int minix_statfs(struct dentry *dentry, struct kstatfs *buf);
 static int minix_remount (struct super_block * sb, int * flags, char * data);
+static int minix_show_options(struct seq_file *seq, struct dentry *root);
+static int minix_cow_tree_path(struct inode *inode, unsigned long first, unsigned long last);
 
 static void minix_evict_inode(struct inode *inode)
 {
+	struct minix_handle handle;
+
 	PRINT_FUNC();
 
 	truncate_inode_pages_final(&inode->i_data);
+	minix_journal_start(inode->i_sb, &handle);
+	minix_discard_prealloc(inode);
 	if (!inode->i_nlink) {
 		inode->i_size = 0;
 		minix_truncate(inode);
@@ -37,24 +47,23 @@ static void minix_evict_inode(struct inode *inode)
 	clear_inode(inode);
 	if (!inode->i_nlink)
 		minix_free_inode(inode);
+	minix_journal_stop(inode->i_sb, &handle);
 }
 
 static void minix_put_super(struct super_block *sb)
 {
-	int i;
 	struct minix_sb_info *sbi = minix_sb(sb);
 
+	// The snapshot reclaim worker still uses the journal
+	minix_snapshot_release(sb);
+	minix_journal_release(sb);
 	if (!(sb->s_flags & MS_RDONLY)) {
 		if (sbi->s_version != MINIX_V3)	 /* s_state is now out from V3 sb */
 			sbi->s_ms->s_state = sbi->s_mount_state;
 		mark_buffer_dirty(sbi->s_sbh);
 	}
-	for (i = 0; i < sbi->s_imap_blocks; i++)
-		brelse(sbi->s_imap[i]);
-	for (i = 0; i < sbi->s_zmap_blocks; i++)
-		brelse(sbi->s_zmap[i]);
 	brelse (sbi->s_sbh);
-	kfree(sbi->s_imap);
+	minix_free_bitmap_summary(sb);
 	sb->s_fs_info = NULL;
 	kfree(sbi);
 }
@@ -70,6 +79,14 @@ static struct inode *minix_alloc_inode(struct super_block *sb)
 	ei = kmem_cache_alloc(minix_inode_cachep, GFP_KERNEL);
 	if (!ei)
 		return NULL;
+	ei->i_prealloc_count = 0;
+	ei->i_alloc_hint = 0;
+	ei->i_reserved_data = 0;
+	ei->i_reserved_meta = 0;
+	ei->i_reserved_last = 0;
+	ei->i_flags = 0;
+	ei->i_share_scan = 0;
+	ei->i_share_gen = READ_ONCE(minix_sb(sb)->s_generation);
 	return &ei->vfs_inode;
 }
 
@@ -90,6 +107,10 @@ static void init_once(void *foo)
 {
 	struct minix_inode_info *ei = (struct minix_inode_info *) foo;
 
+	mutex_init(&ei->i_prealloc_lock);
+	mutex_init(&ei->i_claim_lock);
+	ei->i_claim_task = NULL;
+	init_rwsem(&ei->i_extent_sem);
 	inode_init_once(&ei->vfs_inode);
 }
 
@@ -118,23 +139,75 @@ static void destroy_inodecache(void)
 static const struct super_operations minix_sops = {
 	.alloc_inode	= minix_alloc_inode,
 	.destroy_inode	= minix_destroy_inode,
+	.dirty_inode	= minix_dirty_inode,
 	.write_inode	= minix_write_inode,
 	.evict_inode	= minix_evict_inode,
 	.put_super	= minix_put_super,
+	.sync_fs	= minix_sync_fs,
 	.statfs		= minix_statfs,
 	.remount_fs	= minix_remount,
+	.show_options	= minix_show_options,
+};
+
+enum {
+	Opt_delalloc, Opt_nodelalloc, Opt_err
+};
+
+static const match_table_t tokens = {
+	{Opt_delalloc, "delalloc"},
+	{Opt_nodelalloc, "nodelalloc"},
+	{Opt_err, NULL}
 };
 
+static int parse_options(char *options, struct minix_sb_info *sbi)
+{
+	char *p;
+	substring_t args[MAX_OPT_ARGS];
+
+	if (!options)
+		return 1;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, tokens, args)) {
+		case Opt_delalloc:
+			sbi->s_mount_opt |= MINIX_MOUNT_DELALLOC;
+			break;
+		case Opt_nodelalloc:
+			sbi->s_mount_opt &= ~MINIX_MOUNT_DELALLOC;
+			break;
+		default:
+			printk("MINIX-fs: unrecognized mount option \"%s\"\n", p);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int minix_show_options(struct seq_file *seq, struct dentry *root)
+{
+	if (test_opt(root->d_sb, DELALLOC))
+		seq_puts(seq, ",delalloc");
+	return 0;
+}
+
 static int minix_remount (struct super_block * sb, int * flags, char * data)
 {
 	struct minix_sb_info * sbi = minix_sb(sb);
 	struct minix_super_block * ms;
 
 	sync_filesystem(sb);
+	if (!parse_options(data, sbi))
+		return -EINVAL;
 	ms = sbi->s_ms;
 	if ((*flags & MS_RDONLY) == (sb->s_flags & MS_RDONLY))
 		return 0;
 	if (*flags & MS_RDONLY) {
+		// Leave nothing in the log that the next mount would replay
+		minix_snapshot_reclaim_stop(sb);
+		minix_journal_flush(sb);
 		if (ms->s_state & MINIX_VALID_FS ||
 		    !(sbi->s_mount_state & MINIX_VALID_FS))
 			return 0;
@@ -143,6 +216,10 @@ static int minix_remount (struct super_block * sb, int * flags, char * data)
 			ms->s_state = sbi->s_mount_state;
 		mark_buffer_dirty(sbi->s_sbh);
 	} else {
+		int ret = minix_upgrade_tree_refcount(sb);
+
+		if (ret)
+			return ret;
 	  	/* Mount a partition which is read-only, read-write. */
 		if (sbi->s_version != MINIX_V3) {
 			sbi->s_mount_state = ms->s_state;
@@ -158,6 +235,11 @@ static int minix_remount (struct super_block * sb, int * flags, char * data)
 		else if ((sbi->s_mount_state & MINIX_ERROR_FS))
 			debug_log("MINIX-fs warning: remounting fs with errors, "
 				"running fsck is recommended\n");
+
+		minix_fix_map_bits(sb);
+
+		// Deleted snapshots still waiting for their blocks to be freed
+		minix_snapshot_reclaim_start(sb);
 	}
 	return 0;
 }
@@ -165,10 +247,9 @@ static int minix_remount (struct super_block * sb, int * flags, char * data)
 static int minix_fill_super(struct super_block *s, void *data, int silent)
 {
 	struct buffer_head *bh;
-	struct buffer_head **map;
 	struct minix_super_block *ms;
 	struct minix3_super_block *m3s = NULL;
-	unsigned long i, block;
+	unsigned long block;
 	struct inode *root_inode;
 	struct minix_sb_info *sbi;
 	int ret = -EINVAL;
@@ -179,6 +260,11 @@ static int minix_fill_super(struct super_block *s, void *data, int silent)
 	if (!sbi)
 		return -ENOMEM;
 	s->s_fs_info = sbi;
+	spin_lock_init(&sbi->s_reserve_lock);
+	mutex_init(&sbi->s_overflow_lock);
+
+	if (!parse_options(data, sbi))
+		goto out;
 	
 	BUILD_BUG_ON(32 != sizeof (struct minix_inode));
 	BUILD_BUG_ON(64 != sizeof(struct minix2_inode));
@@ -252,15 +338,23 @@ static int minix_fill_super(struct super_block *s, void *data, int silent)
 		sbi->s_mount_state = MINIX_VALID_FS;
 		sbi->s_inodes_blocks = m3s->s_inodes_blocks;
 		sbi->s_refcount_table_blocks = m3s->s_refcount_table_blocks;
+		sbi->s_features = m3s->s_features;
+		sbi->s_refcount_overflow_blocks = m3s->s_refcount_overflow_blocks;
+		if (sbi->s_features & MINIX_FEATURE_JOURNAL)
+			sbi->s_journal_blocks = m3s->s_journal_blocks;
 		sbi->s_snapshots_start_block =
 			2 +
 			sbi->s_imap_blocks +
 			sbi->s_zmap_blocks +
 			sbi->s_inodes_blocks +
-			sbi->s_refcount_table_blocks;
+			sbi->s_refcount_table_blocks +
+			sbi->s_journal_blocks;
+		// Slots with a header block in front of the table copies
+		sbi->s_snapshot_slot_blocks = sbi->s_imap_blocks + sbi->s_inodes_blocks +
+			(minix_has_feature(sbi, SNAPSHOT_HEADERS) ? 1 : 0);
 		sbi->s_snapshots_slots =
 			(sbi->s_firstdatazone - sbi->s_snapshots_start_block - SNAPSHOT_BLOCKS_FOR_NAMES) / 
-			(sbi->s_imap_blocks + sbi->s_inodes_blocks);
+			sbi->s_snapshot_slot_blocks;
 		debug_log("- snapshot slots is %ld\n", sbi->s_snapshots_slots);
 		debug_log("- blocksize is %d\n", m3s->s_blocksize);
 		sb_set_blocksize(s, m3s->s_blocksize);
@@ -270,32 +364,21 @@ static int minix_fill_super(struct super_block *s, void *data, int silent)
 		goto out_no_fs;
 	}
 
-	/*
-	 * Allocate the buffer map to keep the superblock small.
-	 */
-	if (sbi->s_imap_blocks == 0 || sbi->s_zmap_blocks == 0)
-		goto out_illegal_sb;
-	i = (sbi->s_imap_blocks + sbi->s_zmap_blocks) * sizeof(bh);
-	map = kzalloc(i, GFP_KERNEL);
-	if (!map)
-		goto out_no_map;
-	sbi->s_imap = &map[0];
-	sbi->s_zmap = &map[sbi->s_imap_blocks];
-
-	block=2;
-	for (i=0 ; i < sbi->s_imap_blocks ; i++) {
-		if (!(sbi->s_imap[i]=sb_bread(s, block)))
-			goto out_no_bitmap;
-		block++;
-	}
-	for (i=0 ; i < sbi->s_zmap_blocks ; i++) {
-		if (!(sbi->s_zmap[i]=sb_bread(s, block)))
-			goto out_no_bitmap;
-		block++;
+	// The inode has no room for the triple indirect zone the V2 tree
+	// code knows about, files must fit into the double indirect tree
+	if (sbi->s_version != MINIX_V1) {
+		u64 per_block = s->s_blocksize / sizeof(uint32_t);
+		u64 max_blocks = INDIRECT_BLOCK_INDEX + per_block + per_block * per_block;
+
+		sbi->s_max_size = min_t(u64, sbi->s_max_size, max_blocks << s->s_blocksize_bits);
 	}
+	// Extent mapped files only end where the 32 bit i_size does,
+	// minix_max_bytes() keeps the others at the old limit
+	if (minix_has_feature(sbi, EXTENTS))
+		s->s_maxbytes = U32_MAX;
 
-	minix_set_bit(0,sbi->s_imap[0]->b_data);
-	minix_set_bit(0,sbi->s_zmap[0]->b_data);
+	if (sbi->s_imap_blocks == 0 || sbi->s_zmap_blocks == 0)
+		goto out_illegal_sb;
 
 	/* Apparently minix can create filesystems that allocate more blocks for
 	 * the bitmaps than needed.  We simply ignore that, but verify it didn't
@@ -318,34 +401,58 @@ static int minix_fill_super(struct super_block *s, void *data, int silent)
 	}
 
 	/*
-	 * Allocate and read the refcount table
-	 * This is very similar to reading the inode and zone map,
-	 * except we have to skip over the inodes that come before
-	 * the refcount table on disk
+	 * The refcount table comes after the inodes on disk.
+	 * Like the inode and zone map, it is not kept in memory:
+	 * its blocks are read through the buffer cache when needed.
 	 */
 	if (sbi->s_refcount_table_blocks == 0) {
 		goto out_illegal_sb;
 	}
+	if (sbi->s_features & ~MINIX_FEATURE_ALL) {
+		printk("MINIX-fs: unsupported features 0x%x. Refusing to mount.\n",
+				sbi->s_features & ~MINIX_FEATURE_ALL);
+		goto out_no_bitmap;
+	}
+	// The compact encoding needs a shared map as large as the zone map
+	// and at least one overflow block behind it
+	if (minix_has_feature(sbi, COMPACT_REFCOUNT) &&
+	    (sbi->s_refcount_overflow_blocks == 0 ||
+	     sbi->s_refcount_overflow_blocks >= sbi->s_refcount_table_blocks ||
+	     sbi->s_refcount_table_blocks - sbi->s_refcount_overflow_blocks < sbi->s_zmap_blocks))
+		goto out_illegal_sb;
+	sbi->s_refcount_table_start = 2 + sbi->s_imap_blocks + sbi->s_zmap_blocks + sbi->s_inodes_blocks;
 
-	// Allocate memory
-	i = sbi->s_refcount_table_blocks * sizeof(bh);
-	map = kzalloc(i, GFP_KERNEL);
-	if (!map)
-		goto out_no_map;
-
-	// Set up buffer_head
-	sbi->s_refcount_table = &map[0];
-
-	// Read content
-	block = 2 + sbi->s_imap_blocks + sbi->s_zmap_blocks + sbi->s_inodes_blocks;
-	for (i=0 ; i < sbi->s_refcount_table_blocks ; i++) {
-		if (!(sbi->s_refcount_table[i]=sb_bread(s, block)))
+	// The journal follows the refcount table, replay it before
+	// anything else is read
+	if (minix_has_feature(sbi, JOURNAL) &&
+	    (sbi->s_journal_blocks < MINIX_JOURNAL_MIN_BLOCKS ||
+	     sbi->s_snapshots_start_block > sbi->s_firstdatazone))
+		goto out_illegal_sb;
+	sbi->s_journal_start = sbi->s_refcount_table_start + sbi->s_refcount_table_blocks;
+	ret = minix_journal_load(s);
+	if (ret)
+		goto out_release;
+
+	// Set up the inode map summary and the zone allocation groups
+	ret = minix_init_bitmap_summary(s);
+	if (!ret && !(s->s_flags & MS_RDONLY))
+		ret = minix_fix_map_bits(s);
+	if (ret) {
+		if (ret == -EIO)
 			goto out_no_bitmap;
-		block++;
+		goto out_freemap;
 	}
 
-	// Minix clears the 0 bit on zone and inode map, so we also clear the refcount
-	*((uint32_t*)sbi->s_refcount_table[0]->b_data) = 0;
+	// Lazy snapshots need to know which table blocks they still share
+	ret = minix_snapshot_init(s);
+	if (ret)
+		goto out_freemap;
+
+	if (!(s->s_flags & MS_RDONLY)) {
+		ret = minix_upgrade_tree_refcount(s);
+		if (ret)
+			goto out_freemap;
+	}
 
 	/* set up enough so that it can read an inode */
 	s->s_op = &minix_sops;
@@ -382,17 +489,9 @@ out_no_root:
 out_no_bitmap:
 	printk("MINIX-fs: bad superblock or unable to read bitmaps\n");
 out_freemap:
-	for (i = 0; i < sbi->s_imap_blocks; i++)
-		brelse(sbi->s_imap[i]);
-	for (i = 0; i < sbi->s_zmap_blocks; i++)
-		brelse(sbi->s_zmap[i]);
-	kfree(sbi->s_imap);
-	goto out_release;
-
-out_no_map:
-	ret = -ENOMEM;
-	if (!silent)
-		printk("MINIX-fs: can't allocate map\n");
+	minix_snapshot_release(s);
+	minix_free_bitmap_summary(s);
+	minix_journal_release(s);
 	goto out_release;
 
 out_illegal_sb:
@@ -420,6 +519,14 @@ out:
 	return ret;
 }
 
+static int minix_sync_fs(struct super_block *sb, int wait)
+{
+	// Changed metadata is on disk once the running transaction is committed
+	if (!wait)
+		return 0;
+	return minix_journal_commit(sb);
+}
+
 static int minix_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
 	struct super_block *sb = dentry->d_sb;
@@ -429,6 +536,7 @@ static int minix_statfs(struct dentry *dentry, struct kstatfs *buf)
 	buf->f_bsize = sb->s_blocksize;
 	buf->f_blocks = (sbi->s_nzones - sbi->s_firstdatazone) << sbi->s_log_zone_size;
 	buf->f_bfree = minix_count_free_blocks(sb);
+	buf->f_bfree -= min_t(u64, buf->f_bfree, sbi->s_reserved << sbi->s_log_zone_size);
 	buf->f_bavail = buf->f_bfree;
 	buf->f_files = sbi->s_ninodes;
 	buf->f_ffree = minix_count_free_inodes(sb);
@@ -442,10 +550,90 @@ static int minix_statfs(struct dentry *dentry, struct kstatfs *buf)
 static int minix_get_block(struct inode *inode, sector_t block,
 		    struct buffer_head *bh_result, int create)
 {
+	struct minix_handle handle;
+	int ret;
+
+	// Callers may hold a page lock, so only join the running transaction
+	if (create)
+		minix_journal_join(inode->i_sb, &handle);
 	if (INODE_VERSION(inode) == MINIX_V1)
-		return V1_minix_get_block(inode, block, bh_result, create);
+		ret = V1_minix_get_block(inode, block, bh_result, create);
+	else if (minix_inode_extents(inode))
+		ret = minix_ext_get_block(inode, block, bh_result, create);
 	else
-		return V2_minix_get_block(inode, block, bh_result, create);
+		ret = V2_minix_get_block(inode, block, bh_result, create);
+	if (create)
+		minix_journal_stop(inode->i_sb, &handle);
+	return ret;
+}
+
+/*
+ * get_block for buffered writes with delayed allocation:
+ * holes only get a reservation here, their zones are picked at writeback
+ */
+static int minix_da_get_block(struct inode *inode, sector_t block,
+		    struct buffer_head *bh_result, int create)
+{
+	int ret = minix_get_block(inode, block, bh_result, 0);
+
+	if (ret || buffer_mapped(bh_result) || !create)
+		return ret;
+
+	ret = minix_reserve_block(inode, block);
+	if (ret)
+		return ret;
+
+	map_bh(bh_result, inode->i_sb, MINIX_INVALID_BLOCK);
+	set_buffer_new(bh_result);
+	set_buffer_delay(bh_result);
+	return 0;
+}
+
+/*
+ * get_block for writeback: allocates the zones of delayed buffers
+ * and drops their reservation
+ */
+static int minix_writeback_get_block(struct inode *inode, sector_t block,
+		    struct buffer_head *bh_result, int create)
+{
+	struct minix_inode_info *minix_inode = minix_i(inode);
+	bool delayed = buffer_delay(bh_result);
+	struct minix_handle handle;
+	int ret;
+
+	if (!delayed)
+		return minix_get_block(inode, block, bh_result, create);
+
+	// Size the allocation to everything that is still waiting for a zone
+	if (minix_inode->i_alloc_hint < minix_inode->i_reserved_data)
+		minix_set_alloc_hint(inode, minix_inode->i_reserved_data);
+
+	// Filling the hole changes the inode and its tree: lazy snapshots
+	// copy the inode first, indirect blocks shared with a clone or
+	// snapshot get their own copy. Extent trees unshare their path
+	// while they map the block.
+	// The zones and indirect blocks come out of the reservation
+	mutex_lock(&minix_inode->i_claim_lock);
+	minix_inode->i_claim_task = current;
+	minix_journal_join(inode->i_sb, &handle);
+	minix_snapshot_capture_inode(inode);
+	if (INODE_VERSION(inode) == MINIX_V1 || minix_inode_extents(inode)) {
+		ret = minix_get_block(inode, block, bh_result, create);
+	} else {
+		down_write(&minix_inode->i_extent_sem);
+		ret = 0;
+		if (minix_inode_may_share(inode))
+			ret = minix_cow_tree_path(inode, block, block);
+		if (!ret)
+			ret = minix_get_block(inode, block, bh_result, create);
+		up_write(&minix_inode->i_extent_sem);
+	}
+	minix_journal_stop(inode->i_sb, &handle);
+	if (!ret)
+		minix_release_blocks(inode, 1);
+	minix_inode->i_claim_task = NULL;
+	mutex_unlock(&minix_inode->i_claim_lock);
+	return ret;
 }
 
 static int minix_writepage(struct page *page, struct writeback_control *wbc)
@@ -453,7 +641,36 @@ static int minix_writepage(struct page *page, struct writeback_control *wbc)
 	PRINT_FUNC();
 	debug_log("\tpage = %x\n", page);
 
-	return block_write_full_page(page, minix_get_block, wbc);
+	return block_write_full_page(page, minix_writeback_get_block, wbc);
+}
+
+/*
+ * Drops the reservations of delayed buffers that are thrown away
+ */
+static void minix_invalidatepage(struct page *page, unsigned int offset,
+				 unsigned int length)
+{
+	struct buffer_head *head, *bh;
+	unsigned int curr_off = 0, stop = offset + length, released = 0;
+
+	if (page_has_buffers(page)) {
+		head = bh = page_buffers(page);
+		do {
+			unsigned int next_off = curr_off + bh->b_size;
+
+			if (next_off > stop)
+				break;
+			if (offset <= curr_off && buffer_delay(bh)) {
+				clear_buffer_delay(bh);
+				released++;
+			}
+			curr_off = next_off;
+			bh = bh->b_this_page;
+		} while (bh != head);
+	}
+	if (released)
+		minix_release_blocks(page->mapping->host, released);
+	block_invalidatepage(page, offset, length);
 }
 
 static int minix_readpage(struct file *file, struct page *page)
@@ -478,159 +695,574 @@ static void minix_write_failed(struct address_space *mapping, loff_t to)
 	}
 }
 
-inline uint32_t deep_copy_block(struct inode *inode, uint32_t src_block_index) {
+/*
+ * Copies a block into a newly allocated one, stored in *new_block_ptr.
+ * Copies of metadata go through the journal. Data copies are read back
+ * through the page cache, so they are written right away and the
+ * caller has to wait for all of them with sync_mapping_buffers()
+ * before anything reads the new zones.
+ */
+inline int deep_copy_block(struct inode *inode, uint32_t src_block_index, bool metadata,
+			   uint32_t *new_block_ptr) {
 	struct super_block *sb = inode->i_sb;
 
 	struct buffer_head *src_bh;
 	struct buffer_head *dst_bh;
-	uint32_t new_block = minix_new_block(inode);
+	uint32_t new_block = minix_alloc_block(inode, 0);
 
 	if (new_block == 0) {
-		return 0;
+		return -ENOSPC;
 	}
 
 	// Copy content to new indirect block
 	// Read block content
 	if (!(src_bh = sb_bread(sb, src_block_index))) {
 		debug_log("ERROR: Could not read src block");
-		return 0;
-	}
-
-	// Read target block
-	if (!(dst_bh = sb_bread(sb, new_block))) {
-		debug_log("ERROR: Could not read dst block");
-		return 0;
+		minix_free_block(sb, new_block);
+		return -EIO;
 	}
 
-	// Copy
+	// The target is overwritten completely, no need to read it
+	dst_bh = sb_getblk(sb, new_block);
+	lock_buffer(dst_bh);
 	memcpy(dst_bh->b_data, src_bh->b_data, dst_bh->b_size);
-	mark_buffer_dirty(dst_bh);
-	sync_dirty_buffer(dst_bh);
+	set_buffer_uptodate(dst_bh);
+	unlock_buffer(dst_bh);
+	brelse(src_bh);
+
+	if (metadata) {
+		minix_journal_dirty_inode(dst_bh, inode);
+	} else {
+		mark_buffer_dirty_inode(dst_bh, inode);
+		write_dirty_buffer(dst_bh, 0);
+	}
+	brelse(dst_bh);
 
-	return new_block;
+	*new_block_ptr = new_block;
+	return 0;
 }
 
-inline void cow_block(struct minix_sb_info *sbi, struct inode *inode, uint32_t *block_index_ptr, bool deep_copy) {
+/*
+ * Gives a data block its own copy if it is shared. Returns 1 if
+ * *block_index_ptr changed, 0 if it did not or a negative error.
+ */
+inline int cow_block(struct minix_sb_info *sbi, struct inode *inode, uint32_t *block_index_ptr, bool deep_copy) {
+	struct super_block *sb = inode->i_sb;
 	// We got a physical block number as parameter!
 	uint32_t data_block_index = data_zone_index_for_zone_number(sbi, *block_index_ptr);
 
 	//debug_log("cow_block: %d, %d", *block_index_ptr, data_block_index);
 	// Check refcount of this data block
-	if(get_refcount(sbi, data_block_index) > 1) {
-		uint32_t new_block;
+	if(get_refcount(sb, data_block_index) > 1) {
+		uint32_t new_block = 0;
+		int err = 0;
 
 		// Assign new block
 		if (deep_copy) {
-			new_block = deep_copy_block(inode, *block_index_ptr);
+			err = deep_copy_block(inode, *block_index_ptr, false, &new_block);
 		} else {
-			new_block = minix_new_block(inode);
+			new_block = minix_alloc_block(inode, 0);
+			if (new_block == 0)
+				err = -ENOSPC;
 		}
-		if (new_block != 0) {
-			//debug_log("New block is %d", new_block);
-			// Decrement refcount on old block
-			decrement_refcount(sbi, data_block_index);
-
-			// Set new block
-			*block_index_ptr = new_block;
-		} else {
+		if (err) {
 			debug_log("ERROR: Could not get new block for CoW");
+			return err;
 		}
+		//debug_log("New block is %d", new_block);
+		// Decrement refcount on old block
+		decrement_refcount(sb, data_block_index);
+
+		// Set new block
+		*block_index_ptr = new_block;
+		return 1;
 	}
+	return 0;
 }
 
-inline void cow_indirect_block(struct inode *inode, uint32_t *block_index_ptr, size_t *block_counter, bool deep_copy) {
-	struct super_block *sb = inode->i_sb;
-	struct minix_sb_info *sbi = minix_sb(sb);
+static inline bool minix_zone_shared(struct super_block *sb, uint32_t zone)
+{
+	return zone != 0 &&
+		get_refcount(sb, data_zone_index_for_zone_number(minix_sb(sb), zone)) > 1;
+}
+
+struct cow_walk {
+	struct minix_walk walk;
+	struct inode *inode;
+	bool deep_copy;
+	bool tree_only;		/* leave the data blocks shared */
+	bool changed;
+	unsigned int nblocks;	/* data blocks in the range, for the allocation hint */
+};
+
+/*
+ * Gives a shared indirect block its own copy. The blocks it references
+ * stay shared unless the walk reaches them as well, the copy takes its
+ * own reference on each of them.
+ */
+static int cow_walk_actor(struct minix_walk *walk, uint32_t *zone, int depth, unsigned long block)
+{
+	struct cow_walk *cw = container_of(walk, struct cow_walk, walk);
+	struct super_block *sb = walk->sb;
+	struct minix_refcount_batch batch;
 	struct buffer_head *bh;
-	uint32_t* block_refs;
-	uint32_t data_block_index;
-	size_t i;
-	
-	// Copy the indirect block if needed
-	data_block_index = data_zone_index_for_zone_number(sbi, *block_index_ptr);
-	if(get_refcount(sbi, data_block_index) > 1) {
-		// Assign new block
-		uint32_t new_block = deep_copy_block(inode, *block_index_ptr);
-		if (new_block != 0) {
-			// Decrement refcount on old block
-			decrement_refcount(sbi, data_block_index);
+	uint32_t new_block, *refs;
+	int i, err;
 
-			// Set new block
-			*block_index_ptr = new_block;
-		} else {
-			debug_log("ERROR: Could not get new block for CoW");
-		}
+	if (depth == 0) {
+		if (cw->tree_only)
+			return 0;
+		err = cow_block(minix_sb(sb), cw->inode, zone, cw->deep_copy);
+		if (err > 0)
+			cw->changed = true;
+		return min(err, 0);
 	}
 
-	// Copy the indirect data blocks
-	bh = sb_bread(sb, *block_index_ptr);
-	block_refs = (uint32_t*)bh->b_data;
+	if (!minix_zone_shared(sb, *zone))
+		return 0;
 
-	for(i = 0; i < MINIX_BLOCK_REFS_PER_BLOCK; i++) {
-		if(block_refs[i] == 0) {
-			break;
+	// The blocks of the range are likely shared as well,
+	// so have them copied into one contiguous run
+	minix_set_alloc_hint(cw->inode, 1 + cw->nblocks);
+
+	// The entries below must not be changed in the shared block,
+	// so the walk ends on errors
+	err = deep_copy_block(cw->inode, *zone, true, &new_block);
+	if (err) {
+		debug_log("ERROR: Could not get new block for CoW");
+		return err;
+	}
+	bh = sb_bread(sb, new_block);
+	if (!bh) {
+		minix_free_block(sb, new_block);
+		return -EIO;
+	}
+	refs = (uint32_t *)bh->b_data;
+	minix_refcount_batch_init(&batch, sb);
+	for (i = 0; i < sb->s_blocksize / sizeof(uint32_t); i++) {
+		if (refs[i])
+			minix_refcount_batch_add(&batch, refs[i], 1);
+	}
+	brelse(bh);
+	err = minix_refcount_batch_commit(&batch);
+	if (err) {
+		minix_free_block(sb, new_block);
+		return err;
+	}
+	decrement_refcount(sb, data_zone_index_for_zone_number(minix_sb(sb), *zone));
+	*zone = new_block;
+	cw->changed = true;
+	return 0;
+}
+
+static void cow_walk_changed(struct minix_walk *walk, struct buffer_head *bh)
+{
+	minix_journal_dirty_inode(bh, container_of(walk, struct cow_walk, walk)->inode);
+}
+
+/*
+ * Starts the reads of the shared data blocks about to be copied,
+ * so deep copies of a range wait for the disk only once
+ */
+static void cow_walk_prefetch(struct minix_walk *walk, uint32_t *refs,
+			      unsigned long first, unsigned long last, int depth)
+{
+	unsigned long i;
+
+	if (depth != 0 || !container_of(walk, struct cow_walk, walk)->deep_copy)
+		return;
+
+	for (i = first; i <= last; i++) {
+		if (minix_zone_shared(walk->sb, refs[i]))
+			sb_breadahead(walk->sb, refs[i]);
+	}
+}
+
+/*
+ * Unshares the path from the inode to the data blocks first..last
+ * (logical block numbers). Without deep_copy the data blocks get fresh
+ * zones without their old contents. Returns 1 if the inode, one of its
+ * indirect blocks or one of the data blocks changed, 0 if nothing did
+ * or a negative error. Blocks may have changed before an error as well.
+ */
+int minix_cow_range(struct inode *inode, unsigned long first, unsigned long last, bool deep_copy)
+{
+	unsigned long per_block = inode->i_sb->s_blocksize / sizeof(uint32_t);
+	struct cow_walk cw = {
+		.walk = {
+			.sb = inode->i_sb,
+			.actor = cow_walk_actor,
+			.changed = cow_walk_changed,
+			.prefetch = cow_walk_prefetch,
+		},
+		.inode = inode,
+		.deep_copy = deep_copy,
+		.nblocks = last - first < per_block ? last - first + 1 : per_block,
+	};
+	int err;
+
+	if (minix_inode_extents(inode))
+		return minix_ext_cow_range(inode, first, last, deep_copy);
+	down_write(&minix_i(inode)->i_extent_sem);
+	err = minix_walk_zones(&cw.walk, minix_i(inode)->u.i2_data, first, last);
+	up_write(&minix_i(inode)->i_extent_sem);
+	if (err < 0)
+		return err;
+	return cw.changed;
+}
+
+/*
+ * Unshares the indirect blocks on the paths to the blocks first..last,
+ * so their entries can change. The data blocks stay shared.
+ */
+static int minix_cow_tree_path(struct inode *inode, unsigned long first, unsigned long last)
+{
+	struct cow_walk cw = {
+		.walk = {
+			.sb = inode->i_sb,
+			.actor = cow_walk_actor,
+			.changed = cow_walk_changed,
+		},
+		.inode = inode,
+		.tree_only = true,
+		.nblocks = 1,
+	};
+	int err;
+
+	err = minix_walk_zones(&cw.walk, minix_i(inode)->u.i2_data, first, last);
+	if (cw.changed)
+		mark_inode_dirty(inode);
+	return min(err, 0);
+}
+
+struct map_walk {
+	struct cow_walk cw;
+	uint32_t zone;
+	struct minix_refcount_batch *batch;
+	bool mapped;
+};
+
+static int map_walk_actor(struct minix_walk *walk, uint32_t *zone, int depth, unsigned long block)
+{
+	struct map_walk *mw = container_of(walk, struct map_walk, cw.walk);
+
+	if (depth)
+		return cow_walk_actor(walk, zone, depth, block);
+	minix_refcount_batch_add(mw->batch, *zone, -1);
+	*zone = mw->zone;
+	mw->mapped = true;
+	return 0;
+}
+
+/*
+ * Points a logical block of an inode to zone, or makes it a hole for
+ * zone 0. The caller added the reference of the block to zone to the
+ * batch, the one to the zone it mapped before goes there as well.
+ */
+static int minix_map_zone(struct inode *inode, unsigned long block, uint32_t zone,
+			  struct minix_refcount_batch *batch)
+{
+	struct buffer_head map = { .b_size = inode->i_sb->s_blocksize };
+	struct map_walk mw = {
+		.cw = {
+			.walk = {
+				.sb = inode->i_sb,
+				.actor = map_walk_actor,
+				.changed = cow_walk_changed,
+			},
+			.inode = inode,
+			.tree_only = true,
+			.nblocks = 1,
+		},
+		.zone = zone,
+		.batch = batch,
+	};
+	int err;
+
+	if (minix_inode_extents(inode))
+		return minix_ext_map_zone(inode, block, zone, batch);
+
+	// get_block fills holes in place, the indirect blocks on the way must
+	// not be shared then. The zone it allocates is replaced right away.
+	down_write(&minix_i(inode)->i_extent_sem);
+	err = minix_cow_tree_path(inode, block, block);
+	if (!err)
+		err = minix_get_block(inode, block, &map, zone != 0);
+	if (!err && buffer_mapped(&map))
+		err = minix_walk_zones(&mw.cw.walk, minix_i(inode)->u.i2_data, block, block);
+	up_write(&minix_i(inode)->i_extent_sem);
+	if (err || !buffer_mapped(&map))
+		return err;
+	// An indirect block on the way could not be copied
+	if (!mw.mapped)
+		return -ENOSPC;
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+/* Blocks minix_clone_blocks() looks up and takes references for at a time */
+#define MINIX_CLONE_CHUNK	64
+
+/*
+ * Makes count blocks of dst from dst_block on map the zones of the
+ * blocks of src from src_block on, holes included. The blocks dst
+ * mapped there before lose their reference. The caller holds the locks
+ * of both inodes and has written back their cached pages in the range.
+ * The references on the zones of src are taken before dst maps them,
+ * a range that cannot take them is left as it was. The outermost
+ * handle is the caller's and may be restarted between chunks.
+ */
+int minix_clone_blocks(struct inode *src, unsigned long src_block, struct inode *dst,
+		       unsigned long dst_block, unsigned long count)
+{
+	struct minix_refcount_batch batch;
+	uint32_t zones[MINIX_CLONE_CHUNK];
+	struct buffer_head map;
+	unsigned long done, i, n;
+	int err = 0, ret;
+
+	for (done = 0; done < count && !err; done += n) {
+		n = min_t(unsigned long, count - done, MINIX_CLONE_CHUNK);
+
+		minix_refcount_batch_init(&batch, dst->i_sb);
+		for (i = 0; i < n; i++) {
+			map.b_state = 0;
+			map.b_size = src->i_sb->s_blocksize;
+			err = minix_get_block(src, src_block + done + i, &map, 0);
+			if (err)
+				break;
+			zones[i] = buffer_mapped(&map) ? map.b_blocknr : 0;
+			if (zones[i])
+				minix_refcount_batch_add(&batch, zones[i], 1);
+		}
+		ret = minix_refcount_batch_commit(&batch);
+		if (err || ret)
+			return err ? err : ret;
+
+		// The old zones of dst lose their reference, and so do the
+		// zones of src that could not be mapped
+		minix_refcount_batch_init(&batch, dst->i_sb);
+		for (i = 0; i < n; i++) {
+			if (!err)
+				err = minix_map_zone(dst, dst_block + done + i, zones[i], &batch);
+			if (err && zones[i])
+				minix_refcount_batch_add(&batch, zones[i], -1);
 		}
+		ret = minix_refcount_batch_commit(&batch);
+		if (!err)
+			err = ret;
 
-		cow_block(sbi, inode, block_refs+i, deep_copy);
-		(*block_counter)++;
+		// Each chunk leaves both files consistent, a large range
+		// goes on in a new transaction
+		minix_journal_restart(dst->i_sb);
 	}
+	return err;
 }
 
-inline void cow_double_indirect_block(struct inode *inode, uint32_t *block_index_ptr, size_t *block_counter, bool deep_copy) {
-	struct super_block *sb = inode->i_sb;
-	struct minix_sb_info *sbi = minix_sb(sb);
-	struct buffer_head *bh;
-	uint32_t* block_refs;
-	uint32_t data_block_index;
-	size_t i;
-	
-	// Copy the double indirect block if needed
-	//debug_log("CoW double indirect block from %d", *block_index_ptr);
-	data_block_index = data_zone_index_for_zone_number(sbi, *block_index_ptr);
-	if(get_refcount(sbi, data_block_index) > 1) {
-		// Assign new block
-		uint32_t new_block = deep_copy_block(inode, *block_index_ptr);
-		if (new_block != 0) {
-			// Decrement refcount on old block
-			decrement_refcount(sbi, data_block_index);
+struct share_walk {
+	struct minix_walk walk;
+	unsigned long start;
+	long found;
+};
 
-			// Set new block
-			*block_index_ptr = new_block;
-		} else {
-			debug_log("ERROR: Could not get new block for CoW");
+static int share_walk_actor(struct minix_walk *walk, uint32_t *zone, int depth, unsigned long block)
+{
+	if (!minix_zone_shared(walk->sb, *zone))
+		return 0;
+	container_of(walk, struct share_walk, walk)->found = block;
+	return MINIX_WALK_STOP;
+}
+
+static int share_walk_extent(struct minix_walk *walk, struct minix_extent *ext)
+{
+	struct share_walk *sw = container_of(walk, struct share_walk, walk);
+	unsigned long block = max_t(unsigned long, ext->e_block, sw->start);
+
+	for (; block < (unsigned long)ext->e_block + ext->e_len; block++) {
+		if (minix_zone_shared(walk->sb, ext->e_start + (block - ext->e_block))) {
+			sw->found = block;
+			return MINIX_WALK_STOP;
 		}
 	}
+	return 0;
+}
+
+/*
+ * Returns the first logical block from start on that is mapped through
+ * a shared zone, or -1 if there is none
+ */
+static long minix_first_shared_block(struct inode *inode, unsigned long start)
+{
+	struct share_walk sw = {
+		.walk = {
+			.sb = inode->i_sb,
+			.actor = share_walk_actor,
+			.extent = share_walk_extent,
+		},
+		.start = start,
+		.found = -1,
+	};
+	int err;
+
+	if (minix_inode_extents(inode)) {
+		down_read(&minix_i(inode)->i_extent_sem);
+		err = minix_ext_walk(&sw.walk, minix_i(inode)->u.i2_data, start, ~0UL);
+		up_read(&minix_i(inode)->i_extent_sem);
+	} else {
+		err = minix_walk_zones(&sw.walk, minix_i(inode)->u.i2_data, start, ~0UL);
+	}
 
-	// Copy the indirect data blocks
-	bh = sb_bread(sb, *block_index_ptr);
-	block_refs = (uint32_t*)bh->b_data;
+	// Blocks that cannot be read are assumed to be shared
+	if (err < 0)
+		return start;
+	return sw.found;
+}
 
-	for(i = 0; i < MINIX_BLOCK_REFS_PER_BLOCK; i++) {
-		if(block_refs[i] == 0) {
-			break;
+/*
+ * Returns whether the inode may still reference shared zones and the
+ * CoW walks are needed. Clears MINIX_I_MAY_SHARE once no zone from
+ * i_share_scan on is shared, so unshared files skip the walks.
+ * The caller holds the inode lock.
+ */
+bool minix_inode_may_share(struct inode *inode)
+{
+	struct minix_inode_info *minix_inode = minix_i(inode);
+	u32 generation = READ_ONCE(minix_sb(inode->i_sb)->s_generation);
+	unsigned long start;
+	long block;
+
+	// Lazy snapshots copy the inode before its zones change
+	minix_snapshot_capture_inode(inode);
+
+	// A snapshot taken since the last check may share any zone
+	if (READ_ONCE(minix_inode->i_share_gen) != generation) {
+		spin_lock(&inode->i_lock);
+		minix_inode->i_share_gen = generation;
+		minix_inode->i_share_scan = 0;
+		set_bit(MINIX_I_MAY_SHARE, &minix_inode->i_flags);
+		spin_unlock(&inode->i_lock);
+	}
+
+	if (!test_bit(MINIX_I_MAY_SHARE, &minix_inode->i_flags))
+		return false;
+
+	// Cleared first so a snapshot taken meanwhile sets it again
+	spin_lock(&inode->i_lock);
+	clear_bit(MINIX_I_MAY_SHARE, &minix_inode->i_flags);
+	start = minix_inode->i_share_scan;
+	spin_unlock(&inode->i_lock);
+
+	block = minix_first_shared_block(inode, start);
+
+	// A snapshot taken during the scan may share the zones it passed
+	smp_rmb();
+	if (READ_ONCE(minix_sb(inode->i_sb)->s_generation) != generation) {
+		set_bit(MINIX_I_MAY_SHARE, &minix_inode->i_flags);
+		return true;
+	}
+	if (block < 0)
+		return test_bit(MINIX_I_MAY_SHARE, &minix_inode->i_flags);
+
+	spin_lock(&inode->i_lock);
+	if (!test_and_set_bit(MINIX_I_MAY_SHARE, &minix_inode->i_flags))
+		minix_inode->i_share_scan = block;
+	spin_unlock(&inode->i_lock);
+	return true;
+}
+
+/*
+ * Lets the buffers of a locked page look their zones up again,
+ * see minix_cow_remap_pages(). With dirty, the uptodate buffers are
+ * dirtied because the new zones do not hold their contents yet.
+ */
+static void minix_cow_remap_buffers(struct page *page, bool dirty)
+{
+	struct minix_sb_info *sbi = minix_sb(page->mapping->host->i_sb);
+	struct buffer_head *head, *bh;
+
+	if (!page_has_buffers(page))
+		return;
+	bh = head = page_buffers(page);
+	do {
+		// Delayed buffers have no zone yet
+		if (buffer_mapped(bh) && !buffer_delay(bh)) {
+			clear_buffer_mapped(bh);
+			if (dirty && buffer_uptodate(bh))
+				mark_buffer_dirty(bh);
 		}
+		bh = bh->b_this_page;
+	} while (bh != head);
+	atomic64_inc(&sbi->s_cow_remapped_pages);
+}
 
-		cow_indirect_block(inode, block_refs+i, block_counter, deep_copy);
+/*
+ * Makes the cached pages of blocks first..last follow the zones the
+ * inode references after CoW. Their buffers are unmapped and keep
+ * data and uptodate state, block_write_begin() and writeback look the
+ * new zone up through get_block. With dirty, the uptodate buffers are
+ * dirtied because the new zones do not hold their contents yet.
+ */
+void minix_cow_remap_pages(struct inode *inode, unsigned long first, unsigned long last, bool dirty)
+{
+	unsigned int shift = PAGE_SHIFT - inode->i_blkbits;
+	struct page *page;
+	pgoff_t index;
+
+	for (index = first >> shift; index <= last >> shift; index++) {
+		page = find_lock_page(inode->i_mapping, index);
+		if (!page)
+			continue;
+		// Writeback of the old mapping has to finish first
+		wait_on_page_writeback(page);
+		minix_cow_remap_buffers(page, dirty);
+		unlock_page(page);
+		put_page(page);
 	}
 }
 
+/*
+ * Returns the page of a write with the old contents of the blocks the
+ * write only covers partly, read from the zones they use before CoW.
+ * The caller keeps the reference until block_write_begin(), so the
+ * page stays cached once its buffers point to the new zones. Returns
+ * NULL when nothing has to be read.
+ */
+static struct page *minix_cow_read_page(struct file *file, struct address_space *mapping,
+			loff_t pos, unsigned len)
+{
+	struct inode *inode = mapping->host;
+	loff_t mask = inode->i_sb->s_blocksize - 1;
+	loff_t end = pos + len;
+	bool partial = false;
+
+	// Blocks the write covers completely lose their old contents
+	if ((pos & mask) && (pos & ~mask) < i_size_read(inode))
+		partial = true;
+	if ((end & mask) && (end & ~mask) < i_size_read(inode))
+		partial = true;
+	if (!partial)
+		return NULL;
+
+	// block_write_begin() would read this page anyway
+	return read_mapping_page(mapping, pos >> PAGE_SHIFT, file);
+}
+
+/* fsdata of a write whose shared blocks move to new zones in write_end */
+#define MINIX_WRITE_COW		((void *)1)
+
 static int minix_write_begin(struct file *file, struct address_space *mapping,
 			loff_t pos, unsigned len, unsigned flags,
 			struct page **pagep, void **fsdata)
 {
 	int ret;
 	struct inode *inode = file->f_inode;
-	struct minix_inode_info *minix_inode = minix_i(inode);
 	struct super_block *sb = inode->i_sb;
-	struct minix_sb_info *sbi = minix_sb(sb);
 	size_t first_inode_block_index;
 	size_t last_inode_block_index;
-	size_t current_inode_block_index;
-
-	size_t n_blockrefs_in_inode = NUM_ZONES_IN_INODE - 2;
-	size_t n_blockrefs_in_block = sb->s_blocksize / sizeof(uint32_t);
 
-	bool had_change = false;
+	get_block_t *get_block = minix_get_block;
+	struct minix_handle handle;
+	struct page *old_page = NULL;
 
 	PRINT_FUNC();
 	debug_log("- file: %x\n", file);
@@ -652,60 +1284,123 @@ static int minix_write_begin(struct file *file, struct address_space *mapping,
 	// Check which blocks would be written to
 	first_inode_block_index = pos / sb->s_blocksize;
 	last_inode_block_index = (pos + len -1) / sb->s_blocksize;
-	current_inode_block_index = first_inode_block_index;
-
-	truncate_inode_pages_range(&inode->i_data, first_inode_block_index * sb->s_blocksize, (last_inode_block_index + 1) * sb->s_blocksize);
-
-	// Directly referenced
-	//debug_log("== %d, %d, %d, %d ==", pos, len, first_inode_block_index, last_inode_block_index);
-	//debug_log("Current_inode_block_indes is %d", current_inode_block_index);
-	for(current_inode_block_index = first_inode_block_index;
-		current_inode_block_index <= MIN(last_inode_block_index, n_blockrefs_in_inode);
-		current_inode_block_index++) {
-		// Check if block is not yet allocated
-		// All following blocks will also be unallocated
-		if(minix_inode->u.i2_data[current_inode_block_index] == 0) {
-			break;
-		}
 
-		// CoW block if needed
-		cow_block(sbi, inode, &minix_inode->u.i2_data[current_inode_block_index], true);
-		had_change = true;
+	// Files that were never cloned or snapshotted have nothing to copy
+	if (minix_inode_may_share(inode)) {
+		// The old contents of partial blocks are copied through the page:
+		// it is read from the shared zones here and written to the new
+		// ones in minix_write_end(), no block is copied on disk
+		old_page = minix_cow_read_page(file, mapping, pos, len);
+		if (IS_ERR(old_page))
+			return PTR_ERR(old_page);
+
+		// The data blocks keep their shared zones until the page holds
+		// their new contents. get_block may fill holes of the range in
+		// place, so the indirect blocks on the way are unshared now.
+		ret = 0;
+		if (INODE_VERSION(inode) != MINIX_V1 && !minix_inode_extents(inode)) {
+			minix_journal_start(sb, &handle);
+			down_write(&minix_i(inode)->i_extent_sem);
+			ret = minix_cow_tree_path(inode, first_inode_block_index, last_inode_block_index);
+			up_write(&minix_i(inode)->i_extent_sem);
+			minix_journal_stop(sb, &handle);
+		}
+		if (ret < 0) {
+			if (old_page)
+				put_page(old_page);
+			return ret;
+		}
+		*fsdata = MINIX_WRITE_COW;
 	}
 
-	// Single indirect
-	//debug_log("Current_inode_block_indes is %d (%d, %d)", current_inode_block_index, last_inode_block_index, n_blockrefs_in_inode + n_blockrefs_in_block);
-	if(current_inode_block_index <= MIN(last_inode_block_index, n_blockrefs_in_inode + n_blockrefs_in_block) &&
-		minix_inode->u.i2_data[INDIRECT_BLOCK_INDEX] != 0) {
+	// block_write_begin will allocate new blocks and rewrite indirect blocks if needed
+	// We have to prepare the inode so that all these operations are done on blocks with refcount == 1
+	if (test_opt(sb, DELALLOC) && S_ISREG(inode->i_mode))
+		get_block = minix_da_get_block;
+	ret = block_write_begin(mapping, pos, len, flags, pagep, get_block);
+	if (old_page)
+		put_page(old_page);
+	if (unlikely(ret))
+		minix_write_failed(mapping, pos + len);
 
-		// CoW indirect block if needed
-		cow_indirect_block(inode, &minix_inode->u.i2_data[INDIRECT_BLOCK_INDEX], &current_inode_block_index, true);
-		had_change = true;
-	}
+	return ret;
+}
 
-	// Double indirect
-	//debug_log("Current_inode_block_indes is %d", current_inode_block_index);
-	if(current_inode_block_index <= last_inode_block_index &&
-		minix_inode->u.i2_data[DOUBLE_INDIRECT_BLOCK_INDEX] != 0) {
-		
-		// CoW indirect block if needed
-		cow_double_indirect_block(inode, &minix_inode->u.i2_data[DOUBLE_INDIRECT_BLOCK_INDEX], &current_inode_block_index, true);
-		had_change = true;
-	}
+/*
+ * Moves the blocks a write went to off their shared zones, now that
+ * the locked page holds their new contents, and writes the page before
+ * the commit that maps the new zones. A block whose old contents were
+ * lost to a crash or a short copy would be left with whatever the new
+ * zone held before.
+ */
+static int minix_cow_write_end(struct inode *inode, loff_t pos, unsigned copied,
+			       struct page *page)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned long first = pos >> sb->s_blocksize_bits;
+	unsigned long last = (pos + copied - 1) >> sb->s_blocksize_bits;
+	struct minix_handle handle;
+	struct buffer_head *head, *bh;
+	int ret;
 
-	if(had_change) {
+	// The page lock is held, so the handle must not wait for a commit
+	minix_journal_join(sb, &handle);
+	ret = minix_cow_range(inode, first, last, false);
+	if (ret)
 		mark_inode_dirty(inode);
-		write_inode_now(inode, 1);
+	if (ret < 0 && page_has_buffers(page)) {
+		// Blocks still on their shared zones must not be written
+		// there, the page is read back instead
+		bh = head = page_buffers(page);
+		do {
+			if (buffer_mapped(bh) && !buffer_delay(bh)) {
+				clear_buffer_mapped(bh);
+				clear_buffer_dirty(bh);
+				clear_buffer_uptodate(bh);
+				ClearPageUptodate(page);
+			}
+			bh = bh->b_this_page;
+		} while (bh != head);
+	} else if (ret > 0) {
+		minix_cow_remap_buffers(page, true);
 	}
+	if (ret > 0 && PageDirty(page))
+		ret = write_one_page(page);
+	else
+		unlock_page(page);
+	minix_journal_stop(sb, &handle);
+	return min(ret, 0);
+}
 
-	// block_write_begin will allocate new blocks and rewrite indirect blocks if needed
-	// We have to prepare the inode so that all these operations are done on blocks with refcount == 1
-	ret = block_write_begin(mapping, pos, len, flags, pagep,
-				minix_get_block);
-	if (unlikely(ret))
-		minix_write_failed(mapping, pos + len);
+static int minix_write_end(struct file *file, struct address_space *mapping,
+			loff_t pos, unsigned len, unsigned copied,
+			struct page *page, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+	loff_t old_size = inode->i_size;
+	bool i_size_changed = false;
+	int ret = 0;
+
+	if (fsdata != MINIX_WRITE_COW)
+		return generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+
+	// generic_write_end(), with the page written before it is unlocked
+	copied = block_write_end(file, mapping, pos, len, copied, page, fsdata);
+	if (pos + copied > inode->i_size) {
+		i_size_write(inode, pos + copied);
+		i_size_changed = true;
+	}
+	if (copied)
+		ret = minix_cow_write_end(inode, pos, copied, page);
+	else
+		unlock_page(page);
+	put_page(page);
 
-	return ret;
+	if (old_size < pos)
+		pagecache_isize_extended(inode, old_size, pos);
+	if (i_size_changed)
+		mark_inode_dirty(inode);
+	return ret ? ret : copied;
 }
 
 static sector_t minix_bmap(struct address_space *mapping, sector_t block)
@@ -719,7 +1414,8 @@ static const struct address_space_operations minix_aops = {
 	.readpage = minix_readpage,
 	.writepage = minix_writepage,
 	.write_begin = minix_write_begin,
-	.write_end = generic_write_end,
+	.write_end = minix_write_end,
+	.invalidatepage = minix_invalidatepage,
 	.bmap = minix_bmap
 };
 
@@ -823,6 +1519,10 @@ static struct inode *V2_minix_iget(struct inode *inode)
 	inode->i_blocks = 0;
 	for (i = 0; i < NUM_ZONES_IN_INODE; i++)
 		minix_inode->u.i2_data[i] = raw_inode->i_zone[i];
+	if (S_ISREG(inode->i_mode) && (raw_inode->i_flags & MINIX_INODE_EXTENTS))
+		set_bit(MINIX_I_EXTENTS, &minix_inode->i_flags);
+	// Clones and snapshots of earlier mounts are not known yet
+	set_bit(MINIX_I_MAY_SHARE, &minix_inode->i_flags);
 	minix_set_inode(inode, old_decode_dev(raw_inode->i_zone[0]));
 	brelse(bh);
 	unlock_new_inode(inode);
@@ -871,7 +1571,7 @@ static struct buffer_head * V1_minix_update_inode(struct inode * inode)
 		raw_inode->i_zone[0] = old_encode_dev(inode->i_rdev);
 	else for (i = 0; i < 9; i++)
 		raw_inode->i_zone[i] = minix_inode->u.i1_data[i];
-	mark_buffer_dirty(bh);
+	minix_journal_dirty(inode->i_sb, bh);
 	return bh;
 }
 
@@ -888,6 +1588,7 @@ static struct buffer_head * V2_minix_update_inode(struct inode * inode)
 	PRINT_FUNC()
 	//debug_log("\tWorking on inode %x\n", inode);
 
+	minix_snapshot_capture_inode(inode);
 	raw_inode = minix_V2_raw_inode(inode->i_sb, inode->i_ino, &bh);
 	if (!raw_inode)
 		return NULL;
@@ -910,25 +1611,61 @@ static struct buffer_head * V2_minix_update_inode(struct inode * inode)
 		//debug_log("\tWriting block %d to %x\n", i, minix_inode->u.i2_data[i]);
 		raw_inode->i_zone[i] = minix_inode->u.i2_data[i];
 	}
-	mark_buffer_dirty(bh);
+	raw_inode->i_flags = minix_inode_extents(inode) ? MINIX_INODE_EXTENTS : 0;
+	minix_journal_dirty(inode->i_sb, bh);
 	return bh;
 }
 
+/*
+ * Writes the inode to its buffer, which is added to the journal
+ */
+static int minix_update_inode(struct inode *inode)
+{
+	struct buffer_head *bh;
+
+	if (INODE_VERSION(inode) == MINIX_V1)
+		bh = V1_minix_update_inode(inode);
+	else
+		bh = V2_minix_update_inode(inode);
+	if (!bh)
+		return -EIO;
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * Inside a handle, the inode goes into the running transaction right
+ * away, together with the blocks that were changed for it
+ */
+static void minix_dirty_inode(struct inode *inode, int flags)
+{
+	if (minix_sb(inode->i_sb)->s_journal && current->journal_info)
+		minix_update_inode(inode);
+}
+
 static int minix_write_inode(struct inode *inode, struct writeback_control *wbc)
 {
 	int err = 0;
 	struct buffer_head *bh;
+	struct minix_handle handle;
 
 	PRINT_FUNC();
 	debug_log("\tFor inode %x", inode);
 
+	// Writeback may run while the inode's pages are locked
+	minix_journal_join(inode->i_sb, &handle);
 	if (INODE_VERSION(inode) == MINIX_V1)
 		bh = V1_minix_update_inode(inode);
 	else
 		bh = V2_minix_update_inode(inode);
+	minix_journal_stop(inode->i_sb, &handle);
 	if (!bh)
 		return -EIO;
-	if (wbc->sync_mode == WB_SYNC_ALL && buffer_dirty(bh)) {
+	if (minix_sb(inode->i_sb)->s_journal) {
+		// sync(2) commits once for all inodes in ->sync_fs()
+		if (wbc->sync_mode == WB_SYNC_ALL && !wbc->for_sync)
+			err = minix_journal_commit(inode->i_sb);
+	} else if (wbc->sync_mode == WB_SYNC_ALL && buffer_dirty(bh)) {
 		sync_dirty_buffer(bh);
 		if (buffer_req(bh) && !buffer_uptodate(bh)) {
 			printk("IO error syncing minix inode [%s:%08lx]\n",
@@ -949,23 +1686,85 @@ int minix_getattr(const struct path *path, struct kstat *stat,
 	generic_fillattr(inode, stat);
 	if (INODE_VERSION(inode) == MINIX_V1)
 		stat->blocks = (BLOCK_SIZE / 512) * V1_minix_blocks(stat->size, sb);
+	else if (minix_inode_extents(inode))
+		stat->blocks = (sb->s_blocksize / 512) * DIV_ROUND_UP(stat->size, sb->s_blocksize);
 	else
 		stat->blocks = (sb->s_blocksize / 512) * V2_minix_blocks(stat->size, sb);
 	stat->blksize = sb->s_blocksize;
 	return 0;
 }
 
+/*
+ * Unshares what a truncate to size changes: the partial last block,
+ * whose tail is zeroed, and the indirect blocks truncate cuts.
+ * Called before the page cache is truncated, so a failure leaves the
+ * file as it was.
+ */
+int minix_truncate_unshare(struct inode *inode, loff_t size)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned long from = (size + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+	struct minix_handle handle;
+	int ret = 0, err;
+
+	if (INODE_VERSION(inode) == MINIX_V1)
+		return 0;
+	minix_journal_start(sb, &handle);
+	if (!minix_inode_may_share(inode))
+		goto out;
+
+	// The tail of a partial last block is zeroed, which must not
+	// reach the files sharing it
+	if (size & (sb->s_blocksize - 1)) {
+		ret = minix_cow_range(inode, from - 1, from - 1, true);
+		if (ret) {
+			mark_inode_dirty(inode);
+			// block_truncate_page() reads the copy back from disk
+			err = sync_mapping_buffers(inode->i_mapping);
+			if (ret > 0)
+				ret = err;
+			minix_cow_remap_pages(inode, from - 1, from - 1, false);
+		}
+		if (ret < 0)
+			goto out;
+		ret = 0;
+	}
+	// Indirect blocks are shared as a whole, the ones truncate
+	// cuts need their own copy
+	if (!minix_inode_extents(inode)) {
+		down_write(&minix_i(inode)->i_extent_sem);
+		ret = minix_cow_tree_path(inode, from, from);
+		up_write(&minix_i(inode)->i_extent_sem);
+	}
+out:
+	minix_journal_stop(sb, &handle);
+	return ret;
+}
+
 /*
  * The function that is called for file truncation.
  */
-void minix_truncate(struct inode * inode)
+int minix_truncate(struct inode * inode)
 {
+	struct minix_handle handle;
+	int ret;
+
 	if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) || S_ISLNK(inode->i_mode)))
-		return;
+		return 0;
+	minix_journal_start(inode->i_sb, &handle);
+	minix_discard_prealloc(inode);
+	ret = minix_truncate_unshare(inode, inode->i_size);
+	if (ret)
+		goto out;
 	if (INODE_VERSION(inode) == MINIX_V1)
 		V1_minix_truncate(inode);
+	else if (minix_inode_extents(inode))
+		minix_ext_truncate(inode);
 	else
 		V2_minix_truncate(inode);
+out:
+	minix_journal_stop(inode->i_sb, &handle);
+	return ret;
 }
 
 static struct dentry *minix_mount(struct file_system_type *fs_type,
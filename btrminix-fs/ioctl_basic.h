@@ -1,3 +1,6 @@
+#ifndef BTRMINIX_IOCTL_BASIC_H
+#define BTRMINIX_IOCTL_BASIC_H
+
 #include <linux/ioctl.h>
 
 struct snapshot_slot {
@@ -12,7 +15,51 @@ struct snapshot_slot {
 #define IOCTL_BTRMINIX_SLOT_OF_SNAPSHOT 	_IOWR(IOC_MAGIC, 3, struct snapshot_slot*)
 #define IOCTL_BTRMINIX_LIST_SNAPSHOTS 		_IOWR(IOC_MAGIC, 4, char*)
 #define IOCTL_BTRMINIX_SNAPSHOT_SLOTS 		_IOW(IOC_MAGIC, 5, int*)
+#define IOCTL_BTRMINIX_STATS				_IOR(IOC_MAGIC, 6, struct btrminix_stats*)
+#define IOCTL_BTRMINIX_SNAPSHOT_INFO		_IOWR(IOC_MAGIC, 7, struct btrminix_snapshot_info*)
 
 #define IOCTL_ERROR_SNAPSHOT_EXISTS			-1
 #define IOCTL_ERROR_SNAPSHOT_DOES_NOT_EXIST	-2
-#define IOCTL_ERROR_NO_FREE_SNAPSHOTS		-3
\ No newline at end of file
+#define IOCTL_ERROR_NO_FREE_SNAPSHOTS		-3
+
+/*
+ * Allocator statistics, to see how much of a bitmap has to be
+ * looked at per allocation
+ */
+struct btrminix_map_stats {
+	unsigned long long allocs;		/* number of allocation requests */
+	unsigned long long summary_steps;	/* summary entries looked at */
+	unsigned long long blocks_searched;	/* bitmap blocks searched for a free bit */
+	unsigned long long longest_scan;	/* most summary entries looked at in one request */
+};
+
+/*
+ * Page cache effects of copy-on-write
+ */
+struct btrminix_cow_stats {
+	unsigned long long remapped_pages;	/* cached pages moved to the copied blocks */
+	unsigned long long invalidated_pages;	/* cached pages dropped instead */
+};
+
+struct btrminix_stats {
+	struct btrminix_map_stats zmap;
+	struct btrminix_map_stats imap;
+	struct btrminix_cow_stats cow;
+};
+
+/*
+ * A snapshot slot as IOCTL_BTRMINIX_SNAPSHOT_INFO returns it, the caller
+ * passes room for every slot. Times and sizes are 0 on file systems
+ * without snapshot headers.
+ */
+#define BTRMINIX_SNAPSHOT_DELETING	0x0001	/* blocks still being freed */
+
+struct btrminix_snapshot_info {
+	char name[32];			/* empty for a free slot */
+	unsigned int flags;
+	unsigned int generation;	/* file system generation it was taken in */
+	long long ctime;		/* creation time in seconds since the epoch */
+	unsigned long long size;	/* bytes in use when it was taken */
+};
+
+#endif /* BTRMINIX_IOCTL_BASIC_H */
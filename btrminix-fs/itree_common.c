@@ -66,20 +66,38 @@ no_block:
 	return p;
 }
 
+/*
+ * Picks the zone a new block should go to: right behind the closest
+ * block on its left, or right behind the indirect block holding it
+ */
+static inline unsigned long find_goal(struct inode *inode, Indirect *partial)
+{
+	block_t *start = partial->bh ? (block_t *)partial->bh->b_data : i_data(inode);
+	block_t *p;
+
+	for (p = partial->p - 1; p >= start; p--)
+		if (*p)
+			return block_to_cpu(*p) + (partial->p - p);
+	if (partial->bh)
+		return partial->bh->b_blocknr + 1;
+	return 0;
+}
+
 static int alloc_branch(struct inode *inode,
 			     int num,
 			     int *offsets,
-			     Indirect *branch)
+			     Indirect *branch,
+			     unsigned long goal)
 {
 	int n = 0;
 	int i;
-	int parent = minix_new_block(inode);
+	int parent = minix_alloc_block(inode, goal);
 
 	branch[0].key = cpu_to_block(parent);
 	if (parent) for (n = 1; n < num; n++) {
 		struct buffer_head *bh;
 		/* Allocate the next block */
-		int nr = minix_new_block(inode);
+		int nr = minix_alloc_block(inode, parent + 1);
 		if (!nr)
 			break;
 		branch[n].key = cpu_to_block(nr);
@@ -91,7 +109,7 @@ static int alloc_branch(struct inode *inode,
 		*branch[n].p = branch[n].key;
 		set_buffer_uptodate(bh);
 		unlock_buffer(bh);
-		mark_buffer_dirty_inode(bh, inode);
+		minix_journal_dirty_inode(bh, inode);
 		parent = nr;
 	}
 	if (n == num)
@@ -128,7 +146,7 @@ static inline int splice_branch(struct inode *inode,
 
 	/* had we spliced it onto indirect block? */
 	if (where->bh)
-		mark_buffer_dirty_inode(where->bh, inode);
+		minix_journal_dirty_inode(where->bh, inode);
 
 	mark_inode_dirty(inode);
 	return 0;
@@ -187,7 +205,8 @@ out:
 		goto changed;
 
 	left = (chain + depth) - partial;
-	err = alloc_branch(inode, left, offsets+(partial-chain), partial);
+	err = alloc_branch(inode, left, offsets+(partial-chain), partial,
+			   find_goal(inode, partial));
 	if (err)
 		goto cleanup;
 
@@ -277,6 +296,11 @@ static void free_branches(struct inode *inode, block_t *p, block_t *q, int depth
 			if (!nr)
 				continue;
 			*p = 0;
+			// A shared indirect block keeps its entries
+			if (!minix_put_tree_block(inode->i_sb, nr)) {
+				mark_inode_dirty(inode);
+				continue;
+			}
 			bh = sb_bread(inode->i_sb, nr);
 			if (!bh)
 				continue;
@@ -321,14 +345,14 @@ static inline void truncate (struct inode * inode)
 		if (partial == chain)
 			mark_inode_dirty(inode);
 		else
-			mark_buffer_dirty_inode(partial->bh, inode);
+			minix_journal_dirty_inode(partial->bh, inode);
 		free_branches(inode, &nr, &nr+1, (chain+n-1) - partial);
 	}
 	/* Clear the ends of indirect blocks on the shared branch */
 	while (partial > chain) {
 		free_branches(inode, partial->p + 1, block_end(partial->bh),
 				(chain+n-1) - partial);
-		mark_buffer_dirty_inode(partial->bh, inode);
+		minix_journal_dirty_inode(partial->bh, inode);
 		brelse (partial->bh);
 		partial--;
 	}
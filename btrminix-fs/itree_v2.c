@@ -73,3 +73,122 @@ unsigned V2_minix_blocks(loff_t size, struct super_block *sb)
 {
 	return nblocks(size, sb);
 }
+
+static int walk_branch(struct minix_walk *walk, uint32_t *zone, int depth,
+		       unsigned long base, unsigned long first, unsigned long last)
+{
+	struct super_block *sb = walk->sb;
+	unsigned long span = 1;
+	unsigned long i;
+	struct buffer_head *bh;
+	uint32_t *refs, old;
+	bool changed = false;
+	int d, ret;
+
+	ret = walk->actor(walk, zone, depth, base + first);
+	if (ret == MINIX_WALK_SKIP)
+		return 0;
+	if (ret || depth == 0)
+		return ret;
+
+	// Number of blocks each entry of this indirect block maps
+	for (d = 1; d < depth; d++)
+		span *= INDIRCOUNT(sb);
+
+	bh = sb_bread(sb, *zone);
+	if (!bh) {
+		printk("MINIX-fs: unable to read indirect block %u\n", *zone);
+		return -EIO;
+	}
+	refs = (uint32_t *)bh->b_data;
+	if (walk->prefetch)
+		walk->prefetch(walk, refs, first / span, last / span, depth - 1);
+
+	for (i = first / span; i <= last / span; i++) {
+		if (refs[i] == 0)
+			continue;
+		old = refs[i];
+		ret = walk_branch(walk, &refs[i], depth - 1, base + i * span,
+				  i == first / span ? first % span : 0,
+				  i == last / span ? last % span : span - 1);
+		if (refs[i] != old)
+			changed = true;
+		if (ret)
+			break;
+	}
+	if (changed && walk->changed)
+		walk->changed(walk, bh);
+	brelse(bh);
+	return ret;
+}
+
+/*
+ * Calls walk->actor for every zone that maps logical blocks first..last
+ * of an inode, indirect blocks before the blocks they reference.
+ * Holes are skipped. The tree is as deep as the inode has zones for.
+ * Returns 0, MINIX_WALK_STOP or the first error.
+ */
+int minix_walk_zones(struct minix_walk *walk, __u32 *zones,
+		     unsigned long first, unsigned long last)
+{
+	unsigned long base = 0;
+	unsigned long span = 1;
+	int i, depth, ret;
+
+	if (walk->prefetch && first < DIRCOUNT)
+		walk->prefetch(walk, zones, first, min(last, (unsigned long)DIRCOUNT - 1), 0);
+
+	for (i = 0; i < NUM_ZONES_IN_INODE && base <= last; i++) {
+		depth = 0;
+		if (i >= DIRCOUNT) {
+			depth = i - DIRCOUNT + 1;
+			span *= INDIRCOUNT(walk->sb);
+		}
+		if (zones[i] != 0 && first < base + span) {
+			ret = walk_branch(walk, &zones[i], depth, base,
+					  max(first, base) - base,
+					  min(last - base, span - 1));
+			if (ret)
+				return ret;
+		}
+		base += span;
+	}
+	return 0;
+}
+
+/*
+ * Drops a reference to a zone of the tree with depth levels of indirect
+ * blocks below it, for inodes that are not in memory. An indirect block
+ * drops the references to its entries with its own last reference.
+ */
+int minix_put_branch(struct minix_refcount_batch *batch, uint32_t zone, int depth)
+{
+	struct super_block *sb = batch->sb;
+	struct buffer_head *bh;
+	uint32_t *refs;
+	int i, err = 0, ret;
+
+	if (depth == 0) {
+		minix_refcount_batch_add(batch, zone, -1);
+		return 0;
+	}
+	if (!minix_put_tree_block(sb, zone))
+		return 0;
+
+	bh = sb_bread(sb, zone);
+	if (!bh) {
+		printk("MINIX-fs: unable to read indirect block %u\n", zone);
+		return -EIO;
+	}
+	refs = (uint32_t *)bh->b_data;
+	for (i = 0; i < INDIRCOUNT(sb); i++) {
+		if (!refs[i])
+			continue;
+		ret = minix_put_branch(batch, refs[i], depth - 1);
+		if (ret && !err)
+			err = ret;
+	}
+	brelse(bh);
+	minix_refcount_batch_add(batch, zone, -1);
+	return err;
+}
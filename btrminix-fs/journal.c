@@ -0,0 +1,1020 @@
+/*
+ *  linux/fs/minix/journal.c
+ *
+ *  Write-ahead journal for the metadata blocks
+ */
+
+/*
+ * Inode, bitmap, refcount and snapshot table blocks are not written
+ * to their home location when they change. minix_journal_dirty() adds
+ * them to the running transaction instead, which is committed to the
+ * log in the background, by sync or fsync. Many updates thus share one
+ * commit, the only synchronous write is the commit block.
+ *
+ * Blocks only go home at checkpoint, when every change made so far is
+ * committed. After that the log starts over at its first block.
+ * A commit copies the blocks while no handle is running, so it never
+ * sees half of an update. Tasks holding a page lock only join the
+ * running transaction, they do not wait for a commit that is about to
+ * start (it may wait for a task that waits for their page).
+ *
+ * A new handle waits while the running transaction is as large as a
+ * commit may be, and long operations call minix_journal_restart()
+ * between their steps, so every transaction fits into the log.
+ *
+ * On mount, the transactions that have a commit block are replayed.
+ * Freed zones are revoked, so that replay does not overwrite a zone
+ * that is in use as data by now with an old copy of metadata.
+ */
+
+#include "minix.h"
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/workqueue.h>
+#include <linux/mm.h>
+#include <linux/sort.h>
+#include <linux/bsearch.h>
+#include <linux/hashtable.h>
+
+/* Longest time a change waits for its commit */
+#define MINIX_COMMIT_INTERVAL	(5 * HZ)
+
+#define MINIX_JOURNAL_HASH_BITS	10
+
+enum minix_journal_state_bits {
+	BH_Minix_Logged = BH_PrivateStart,	/* in the running transaction */
+	BH_Minix_Checkpoint,	/* committed, written home at checkpoint */
+	BH_Minix_Freed,		/* zone was freed, never write it home */
+};
+
+BUFFER_FNS(Minix_Logged, minix_logged)
+TAS_BUFFER_FNS(Minix_Logged, minix_logged)
+BUFFER_FNS(Minix_Checkpoint, minix_checkpoint)
+TAS_BUFFER_FNS(Minix_Checkpoint, minix_checkpoint)
+BUFFER_FNS(Minix_Freed, minix_freed)
+TAS_BUFFER_FNS(Minix_Freed, minix_freed)
+
+/* A buffer of a transaction or of the checkpoint, holds a reference */
+struct minix_jbuf {
+	struct list_head list;
+	struct buffer_head *bh;
+};
+
+struct minix_jrevoke {
+	struct list_head list;
+	__u32 block;
+};
+
+/*
+ * A block logged since the last checkpoint. Revokes go by these, so
+ * they do not depend on the buffer still being cached.
+ */
+struct minix_jblock {
+	struct hlist_node node;
+	__u32 block;
+	bool running;		/* in the running transaction */
+	bool revoked;		/* revoked in the running transaction */
+};
+
+struct minix_journal {
+	struct super_block *j_sb;
+	sector_t j_first;		/* journal super block */
+	unsigned int j_blocks;
+	unsigned int j_tags;		/* block numbers per descriptor block */
+	unsigned int j_max_log;		/* log blocks kept free for the next commit */
+	unsigned int j_max_buffers;	/* buffers that fit into j_max_log */
+
+	/*
+	 * j_updates counts the handles. A commit sets j_barrier so that
+	 * no new handle starts, then j_frozen once they are all gone.
+	 */
+	spinlock_t j_lock;
+	wait_queue_head_t j_wait;
+	unsigned int j_updates;
+	bool j_barrier;
+	bool j_frozen;
+	struct list_head j_running;	/* minix_jbuf */
+	unsigned int j_nrunning;
+	struct list_head j_revoked;	/* minix_jrevoke */
+	unsigned int j_nrevoked;
+	DECLARE_HASHTABLE(j_logged, MINIX_JOURNAL_HASH_BITS);	/* minix_jblock */
+
+	/* Protected by j_commit_mutex */
+	struct mutex j_commit_mutex;
+	unsigned int j_head;		/* next free log block */
+	__u32 j_seq;			/* sequence of the next commit */
+	struct list_head j_checkpoint;	/* minix_jbuf */
+	struct delayed_work j_commit_work;
+};
+
+static inline unsigned int log_blocks_needed(struct minix_journal *journal,
+		unsigned int nbuffers, unsigned int nrevoked)
+{
+	return DIV_ROUND_UP(nbuffers, journal->j_tags) + nbuffers +
+		DIV_ROUND_UP(nrevoked, journal->j_tags) + 1;
+}
+
+static struct buffer_head *journal_getblk(struct minix_journal *journal,
+		unsigned int blk, __u32 type)
+{
+	struct buffer_head *bh = sb_getblk(journal->j_sb, journal->j_first + blk);
+	struct minix_journal_header *header = (struct minix_journal_header *) bh->b_data;
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, bh->b_size);
+	header->h_magic = MINIX_JOURNAL_MAGIC;
+	header->h_type = type;
+	header->h_seq = journal->j_seq;
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	return bh;
+}
+
+static int journal_write_super(struct minix_journal *journal)
+{
+	struct buffer_head *bh = journal_getblk(journal, 0, MINIX_JOURNAL_SUPER);
+	struct minix_journal_super *js = (struct minix_journal_super *) bh->b_data;
+	int ret;
+
+	js->s_start = journal->j_head;
+	mark_buffer_dirty(bh);
+	ret = __sync_dirty_buffer(bh, REQ_SYNC | REQ_FUA);
+	brelse(bh);
+	return ret;
+}
+
+/*
+ * Handles
+ */
+
+static void journal_lock_updates(struct minix_journal *journal)
+{
+	spin_lock(&journal->j_lock);
+	journal->j_barrier = true;
+	while (journal->j_updates) {
+		spin_unlock(&journal->j_lock);
+		wait_event(journal->j_wait, !READ_ONCE(journal->j_updates));
+		spin_lock(&journal->j_lock);
+	}
+	journal->j_frozen = true;
+	spin_unlock(&journal->j_lock);
+}
+
+static void journal_unlock_updates(struct minix_journal *journal)
+{
+	spin_lock(&journal->j_lock);
+	journal->j_barrier = false;
+	journal->j_frozen = false;
+	spin_unlock(&journal->j_lock);
+	wake_up_all(&journal->j_wait);
+}
+
+/*
+ * New handles also wait while the running transaction is full,
+ * so that only the handles already running can make it grow
+ */
+static inline bool journal_may_start(struct minix_journal *journal, bool join)
+{
+	return !READ_ONCE(journal->j_frozen) &&
+		(join || (!READ_ONCE(journal->j_barrier) &&
+			  READ_ONCE(journal->j_nrunning) < journal->j_max_buffers));
+}
+
+static void journal_start(struct super_block *sb, struct minix_handle *handle, bool join)
+{
+	struct minix_journal *journal = minix_sb(sb)->s_journal;
+
+	handle->h_nested = current->journal_info != NULL;
+	if (!journal || handle->h_nested)
+		return;
+
+	spin_lock(&journal->j_lock);
+	while (!journal_may_start(journal, join)) {
+		spin_unlock(&journal->j_lock);
+		mod_delayed_work(system_wq, &journal->j_commit_work, 0);
+		wait_event(journal->j_wait, journal_may_start(journal, join));
+		spin_lock(&journal->j_lock);
+	}
+	journal->j_updates++;
+	spin_unlock(&journal->j_lock);
+
+	// Reclaim must not enter the file system and wait for a commit
+	handle->h_nofs = memalloc_nofs_save();
+	current->journal_info = handle;
+}
+
+void minix_journal_start(struct super_block *sb, struct minix_handle *handle)
+{
+	journal_start(sb, handle, false);
+}
+
+/*
+ * Like minix_journal_start(), for callers that hold a page lock
+ */
+void minix_journal_join(struct super_block *sb, struct minix_handle *handle)
+{
+	journal_start(sb, handle, true);
+}
+
+void minix_journal_stop(struct super_block *sb, struct minix_handle *handle)
+{
+	struct minix_journal *journal = minix_sb(sb)->s_journal;
+	bool last;
+
+	if (!journal || handle->h_nested)
+		return;
+
+	current->journal_info = NULL;
+	memalloc_nofs_restore(handle->h_nofs);
+
+	spin_lock(&journal->j_lock);
+	last = !--journal->j_updates;
+	spin_unlock(&journal->j_lock);
+	if (last)
+		wake_up_all(&journal->j_wait);
+}
+
+static int journal_do_commit(struct minix_journal *journal, bool checkpoint);
+
+/*
+ * Lets a long operation go on in a new transaction once the running
+ * one is half full. Called between steps that leave the file system
+ * consistent, by the task that started the outermost handle, with no
+ * page lock or other lock held that a task with a handle may wait for.
+ */
+void minix_journal_restart(struct super_block *sb)
+{
+	struct minix_journal *journal = minix_sb(sb)->s_journal;
+	struct minix_handle *handle = current->journal_info;
+
+	if (!journal || !handle ||
+	    READ_ONCE(journal->j_nrunning) < journal->j_max_buffers / 2)
+		return;
+	minix_journal_stop(sb, handle);
+	journal_do_commit(journal, false);
+	minix_journal_start(sb, handle);
+}
+
+/*
+ * Makes room for a step that has to be atomic and logs up to blocks
+ * buffers, committing the running transaction first if they do not fit
+ * into it. Returns -ENOSPC if they never fit. Same callers as
+ * minix_journal_restart().
+ */
+int minix_journal_reserve(struct super_block *sb, unsigned int blocks)
+{
+	struct minix_journal *journal = minix_sb(sb)->s_journal;
+	struct minix_handle *handle = current->journal_info;
+
+	if (!journal)
+		return 0;
+	if (blocks > journal->j_max_buffers)
+		return -ENOSPC;
+	if (handle && READ_ONCE(journal->j_nrunning) + blocks > journal->j_max_buffers) {
+		minix_journal_stop(sb, handle);
+		journal_do_commit(journal, false);
+		minix_journal_start(sb, handle);
+	}
+	return 0;
+}
+
+/*
+ * Adding buffers to the running transaction
+ */
+
+/*
+ * Looks up a block logged since the last checkpoint.
+ * The caller holds j_lock.
+ */
+static struct minix_jblock *journal_find_block(struct minix_journal *journal, __u32 block)
+{
+	struct minix_jblock *jblk;
+
+	hash_for_each_possible(journal->j_logged, jblk, node, block) {
+		if (jblk->block == block)
+			return jblk;
+	}
+	return NULL;
+}
+
+static void cancel_revoke(struct minix_journal *journal, __u32 block)
+{
+	struct minix_jrevoke *rv;
+
+	list_for_each_entry(rv, &journal->j_revoked, list) {
+		if (rv->block == block) {
+			list_del(&rv->list);
+			journal->j_nrevoked--;
+			kfree(rv);
+			return;
+		}
+	}
+}
+
+/*
+ * Marks a changed metadata buffer, in place of mark_buffer_dirty().
+ * The caller holds a handle.
+ */
+void minix_journal_dirty(struct super_block *sb, struct buffer_head *bh)
+{
+	struct minix_journal *journal = minix_sb(sb)->s_journal;
+	struct minix_jblock *jblk, *found;
+	struct minix_jbuf *jb;
+	unsigned int nrunning = 0;
+
+	if (!journal) {
+		mark_buffer_dirty(bh);
+		return;
+	}
+	if (buffer_minix_logged(bh) && !buffer_minix_freed(bh))
+		return;
+
+	jb = kmalloc(sizeof(*jb), GFP_NOFS | __GFP_NOFAIL);
+	jblk = kmalloc(sizeof(*jblk), GFP_NOFS | __GFP_NOFAIL);
+	spin_lock(&journal->j_lock);
+	// The home block is written at checkpoint, not by writeback
+	clear_buffer_dirty(bh);
+	clear_buffer_minix_freed(bh);
+	found = journal_find_block(journal, bh->b_blocknr);
+	if (!found) {
+		jblk->block = bh->b_blocknr;
+		jblk->revoked = false;
+		hash_add(journal->j_logged, &jblk->node, jblk->block);
+		found = jblk;
+		jblk = NULL;
+	}
+	found->running = true;
+	if (found->revoked) {
+		cancel_revoke(journal, found->block);
+		found->revoked = false;
+	}
+	if (!test_set_buffer_minix_logged(bh)) {
+		get_bh(bh);
+		jb->bh = bh;
+		list_add_tail(&jb->list, &journal->j_running);
+		nrunning = ++journal->j_nrunning;
+		jb = NULL;
+	}
+	spin_unlock(&journal->j_lock);
+	kfree(jb);
+	kfree(jblk);
+
+	// Commit early when the log fills up
+	if (nrunning == 1)
+		schedule_delayed_work(&journal->j_commit_work, MINIX_COMMIT_INTERVAL);
+	else if (nrunning == journal->j_max_buffers / 2)
+		mod_delayed_work(system_wq, &journal->j_commit_work, 0);
+}
+
+/*
+ * Same for buffers that belong to an inode, like its indirect blocks
+ */
+void minix_journal_dirty_inode(struct buffer_head *bh, struct inode *inode)
+{
+	if (!minix_sb(inode->i_sb)->s_journal)
+		mark_buffer_dirty_inode(bh, inode);
+	else
+		minix_journal_dirty(inode->i_sb, bh);
+}
+
+/*
+ * Called when a zone is freed. If the zone is in the log, replay must
+ * not copy it back, as it may be data by then.
+ */
+void minix_journal_revoke(struct super_block *sb, unsigned long block)
+{
+	struct minix_journal *journal = minix_sb(sb)->s_journal;
+	struct minix_jrevoke *rv = NULL;
+	struct minix_jblock *jblk;
+	struct buffer_head *bh;
+	bool logged;
+
+	if (!journal)
+		return;
+	spin_lock(&journal->j_lock);
+	for (;;) {
+		jblk = journal_find_block(journal, block);
+		logged = jblk != NULL;
+		if (!jblk || jblk->revoked || rv)
+			break;
+		spin_unlock(&journal->j_lock);
+		rv = kmalloc(sizeof(*rv), GFP_NOFS | __GFP_NOFAIL);
+		spin_lock(&journal->j_lock);
+	}
+	if (jblk && !jblk->revoked) {
+		jblk->revoked = true;
+		rv->block = block;
+		list_add_tail(&rv->list, &journal->j_revoked);
+		journal->j_nrevoked++;
+		rv = NULL;
+	}
+	spin_unlock(&journal->j_lock);
+	kfree(rv);
+	if (!logged)
+		return;
+
+	// The checkpoint must not write it home either. Buffers in the
+	// log are pinned until then, so a missing one is not in it.
+	bh = sb_find_get_block(sb, block);
+	if (bh) {
+		if (buffer_minix_logged(bh) || buffer_minix_checkpoint(bh))
+			set_buffer_minix_freed(bh);
+		brelse(bh);
+	}
+}
+
+/*
+ * Commit and checkpoint
+ */
+
+static void journal_put_buffers(struct list_head *bufs)
+{
+	struct minix_jbuf *jb, *tmp;
+
+	list_for_each_entry_safe(jb, tmp, bufs, list) {
+		list_del(&jb->list);
+		put_bh(jb->bh);
+		kfree(jb);
+	}
+}
+
+static void journal_free_revokes(struct minix_journal *journal, struct list_head *revoked)
+{
+	struct minix_jrevoke *rv, *tmp;
+	struct minix_jblock *jblk;
+
+	spin_lock(&journal->j_lock);
+	list_for_each_entry_safe(rv, tmp, revoked, list) {
+		jblk = journal_find_block(journal, rv->block);
+		if (jblk)
+			jblk->revoked = false;
+		list_del(&rv->list);
+		kfree(rv);
+	}
+	spin_unlock(&journal->j_lock);
+}
+
+/*
+ * Moves a buffer of the committing transaction towards the checkpoint,
+ * buffers that already wait for it go to dups. Changes from now on
+ * belong to the next transaction.
+ */
+static void journal_take_buffer(struct minix_journal *journal, struct minix_jbuf *jb,
+		struct list_head *dups)
+{
+	struct minix_jblock *jblk;
+
+	spin_lock(&journal->j_lock);
+	jblk = journal_find_block(journal, jb->bh->b_blocknr);
+	if (jblk)
+		jblk->running = false;
+	spin_unlock(&journal->j_lock);
+	// Set before logged is cleared, minix_journal_revoke() tests both
+	if (test_set_buffer_minix_checkpoint(jb->bh))
+		list_move_tail(&jb->list, dups);
+	clear_buffer_minix_logged(jb->bh);
+}
+
+/*
+ * Forgets the blocks that are only in the emptied log. Blocks of the
+ * running transaction or with a revoke pending stay.
+ */
+static void journal_forget_blocks(struct minix_journal *journal)
+{
+	struct minix_jblock *jblk;
+	struct hlist_node *tmp;
+	int bkt;
+
+	spin_lock(&journal->j_lock);
+	hash_for_each_safe(journal->j_logged, bkt, tmp, jblk, node) {
+		if (jblk->running || jblk->revoked)
+			continue;
+		hash_del(&jblk->node);
+		kfree(jblk);
+	}
+	spin_unlock(&journal->j_lock);
+}
+
+/*
+ * Writes all committed buffers home and empties the log.
+ * No handle may be running.
+ */
+static int journal_checkpoint(struct minix_journal *journal)
+{
+	struct minix_jbuf *jb, *tmp;
+	int ret = 0;
+
+	if (list_empty(&journal->j_checkpoint) && journal->j_head == 1)
+		return 0;
+
+	list_for_each_entry(jb, &journal->j_checkpoint, list) {
+		if (buffer_minix_freed(jb->bh))
+			continue;
+		mark_buffer_dirty(jb->bh);
+		write_dirty_buffer(jb->bh, REQ_SYNC);
+	}
+	list_for_each_entry_safe(jb, tmp, &journal->j_checkpoint, list) {
+		if (!buffer_minix_freed(jb->bh)) {
+			wait_on_buffer(jb->bh);
+			if (!buffer_uptodate(jb->bh))
+				ret = -EIO;
+		}
+		clear_buffer_minix_freed(jb->bh);
+		clear_buffer_minix_checkpoint(jb->bh);
+		list_del(&jb->list);
+		put_bh(jb->bh);
+		kfree(jb);
+	}
+	if (!ret)
+		ret = blkdev_issue_flush(journal->j_sb->s_bdev, GFP_NOFS, NULL);
+	if (ret) {
+		// Keep the log, the next mount replays it
+		printk("MINIX-fs: journal checkpoint failed (%d)\n", ret);
+		return ret;
+	}
+
+	journal->j_head = 1;
+	journal_forget_blocks(journal);
+	return journal_write_super(journal);
+}
+
+static void journal_add_log(struct list_head *log, struct buffer_head *bh)
+{
+	struct minix_jbuf *jb = kmalloc(sizeof(*jb), GFP_NOFS | __GFP_NOFAIL);
+
+	jb->bh = bh;
+	list_add_tail(&jb->list, log);
+}
+
+/*
+ * Writes descriptor or revoke blocks and returns the next log block
+ */
+static unsigned int journal_log_block(struct minix_journal *journal, unsigned int blk,
+		struct minix_journal_descriptor **d, __u32 type, __u32 block,
+		struct list_head *log)
+{
+	struct buffer_head *bh;
+
+	if (!*d || (*d)->d_count == journal->j_tags) {
+		bh = journal_getblk(journal, blk++, type);
+		journal_add_log(log, bh);
+		*d = (struct minix_journal_descriptor *) bh->b_data;
+	}
+	(*d)->d_blocknr[(*d)->d_count++] = block;
+	return blk;
+}
+
+/*
+ * Commits the running transaction. With checkpoint the log is emptied
+ * as well, before any handle can change the committed buffers again.
+ */
+static int journal_commit(struct minix_journal *journal, bool checkpoint)
+{
+	struct super_block *sb = journal->j_sb;
+	struct minix_journal_descriptor *d = NULL;
+	struct buffer_head *bh;
+	struct minix_jbuf *jb, *tmp;
+	struct minix_jrevoke *rv;
+	LIST_HEAD(bufs);
+	LIST_HEAD(dups);
+	LIST_HEAD(revoked);
+	LIST_HEAD(log);
+	unsigned int nbuffers, nrevoked, need, blk;
+	int ret = 0, err;
+
+	journal_lock_updates(journal);
+	spin_lock(&journal->j_lock);
+	list_splice_init(&journal->j_running, &bufs);
+	list_splice_init(&journal->j_revoked, &revoked);
+	nbuffers = journal->j_nrunning;
+	nrevoked = journal->j_nrevoked;
+	journal->j_nrunning = 0;
+	journal->j_nrevoked = 0;
+	spin_unlock(&journal->j_lock);
+
+	if (!nbuffers && !nrevoked) {
+		if (checkpoint)
+			ret = journal_checkpoint(journal);
+		journal_unlock_updates(journal);
+		return ret;
+	}
+
+	// New handles wait while the running transaction is full and
+	// every commit leaves room for a full one, so only a single
+	// handle larger than the log gets here. It can only be written
+	// home right away, together with the checkpoint.
+	need = log_blocks_needed(journal, nbuffers, nrevoked);
+	if (journal->j_head + need > journal->j_blocks) {
+		printk("MINIX-fs: transaction of %u blocks does not fit into the journal, "
+				"writing it in place\n", nbuffers);
+		list_for_each_entry_safe(jb, tmp, &bufs, list)
+			journal_take_buffer(journal, jb, &dups);
+		list_splice_tail_init(&bufs, &journal->j_checkpoint);
+		journal_put_buffers(&dups);
+		journal_free_revokes(journal, &revoked);
+		ret = journal_checkpoint(journal);
+		journal_unlock_updates(journal);
+		return ret;
+	}
+
+	// Copy the buffers into the log
+	blk = journal->j_head;
+	list_for_each_entry_safe(jb, tmp, &bufs, list) {
+		blk = journal_log_block(journal, blk, &d, MINIX_JOURNAL_DESCRIPTOR,
+				jb->bh->b_blocknr, &log);
+		bh = sb_getblk(sb, journal->j_first + blk++);
+		lock_buffer(bh);
+		memcpy(bh->b_data, jb->bh->b_data, bh->b_size);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		journal_add_log(&log, bh);
+		journal_take_buffer(journal, jb, &dups);
+	}
+	d = NULL;
+	list_for_each_entry(rv, &revoked, list)
+		blk = journal_log_block(journal, blk, &d, MINIX_JOURNAL_REVOKE,
+				rv->block, &log);
+	journal_free_revokes(journal, &revoked);
+
+	// Handles run again while the log is written, unless the
+	// log has to be emptied for the next commit
+	if (blk + 1 + journal->j_max_log > journal->j_blocks)
+		checkpoint = true;
+	if (!checkpoint)
+		journal_unlock_updates(journal);
+
+	list_for_each_entry(jb, &log, list) {
+		mark_buffer_dirty(jb->bh);
+		write_dirty_buffer(jb->bh, REQ_SYNC);
+	}
+	list_for_each_entry_safe(jb, tmp, &log, list) {
+		wait_on_buffer(jb->bh);
+		if (!buffer_uptodate(jb->bh))
+			ret = -EIO;
+		brelse(jb->bh);
+		list_del(&jb->list);
+		kfree(jb);
+	}
+
+	// The commit block makes the transaction count for replay,
+	// so everything written before is flushed first
+	if (!ret) {
+		bh = journal_getblk(journal, blk, MINIX_JOURNAL_COMMIT);
+		mark_buffer_dirty(bh);
+		ret = __sync_dirty_buffer(bh, REQ_SYNC | REQ_PREFLUSH | REQ_FUA);
+		brelse(bh);
+	}
+	if (ret)
+		printk("MINIX-fs: journal commit failed (%d)\n", ret);
+
+	list_splice_tail_init(&bufs, &journal->j_checkpoint);
+	journal_put_buffers(&dups);
+	journal->j_head = blk + 1;
+	journal->j_seq++;
+
+	if (checkpoint) {
+		err = journal_checkpoint(journal);
+		if (!ret)
+			ret = err;
+		journal_unlock_updates(journal);
+	}
+	return ret;
+}
+
+static int journal_do_commit(struct minix_journal *journal, bool checkpoint)
+{
+	unsigned int nofs;
+	int ret;
+
+	mutex_lock(&journal->j_commit_mutex);
+	nofs = memalloc_nofs_save();
+	ret = journal_commit(journal, checkpoint);
+	memalloc_nofs_restore(nofs);
+	mutex_unlock(&journal->j_commit_mutex);
+	return ret;
+}
+
+static void journal_commit_work(struct work_struct *work)
+{
+	struct minix_journal *journal =
+		container_of(to_delayed_work(work), struct minix_journal, j_commit_work);
+
+	journal_do_commit(journal, false);
+}
+
+/*
+ * Makes all changes so far durable
+ */
+int minix_journal_commit(struct super_block *sb)
+{
+	struct minix_journal *journal = minix_sb(sb)->s_journal;
+
+	if (!journal)
+		return 0;
+	// A task inside a handle cannot wait for the handles to stop
+	if (current->journal_info) {
+		mod_delayed_work(system_wq, &journal->j_commit_work, 0);
+		return 0;
+	}
+	return journal_do_commit(journal, false);
+}
+
+/*
+ * Commits and writes everything home, leaving an empty log
+ */
+int minix_journal_flush(struct super_block *sb)
+{
+	struct minix_journal *journal = minix_sb(sb)->s_journal;
+
+	if (!journal || (sb->s_flags & MS_RDONLY))
+		return 0;
+	return journal_do_commit(journal, true);
+}
+
+/*
+ * Recovery
+ */
+
+struct minix_jrecord {
+	__u32 block;
+	__u32 seq;
+};
+
+struct journal_recovery {
+	struct minix_jrecord *revoked;
+	unsigned int nrevoked;
+	unsigned int size;
+	__u32 end;		/* first sequence without a commit block */
+	unsigned int replayed;
+};
+
+static int cmp_jrecord(const void *a, const void *b)
+{
+	const struct minix_jrecord *x = a, *y = b;
+
+	if (x->block != y->block)
+		return x->block < y->block ? -1 : 1;
+	if (x->seq != y->seq)
+		return x->seq < y->seq ? -1 : 1;
+	return 0;
+}
+
+static int cmp_jrecord_block(const void *key, const void *elt)
+{
+	const struct minix_jrecord *x = key, *y = elt;
+
+	if (x->block != y->block)
+		return x->block < y->block ? -1 : 1;
+	return 0;
+}
+
+static int add_revoke_record(struct journal_recovery *rec, __u32 block, __u32 seq)
+{
+	struct minix_jrecord *records;
+
+	if (rec->nrevoked == rec->size) {
+		rec->size = rec->size ? 2 * rec->size : 64;
+		records = kvmalloc_array(rec->size, sizeof(*records), GFP_KERNEL);
+		if (!records)
+			return -ENOMEM;
+		if (rec->nrevoked)
+			memcpy(records, rec->revoked, rec->nrevoked * sizeof(*records));
+		kvfree(rec->revoked);
+		rec->revoked = records;
+	}
+	rec->revoked[rec->nrevoked].block = block;
+	rec->revoked[rec->nrevoked].seq = seq;
+	rec->nrevoked++;
+	return 0;
+}
+
+/*
+ * Keeps the newest revoke of each block, of committed transactions only
+ */
+static void sort_revoke_records(struct journal_recovery *rec)
+{
+	unsigned int i, n = 0;
+
+	sort(rec->revoked, rec->nrevoked, sizeof(*rec->revoked), cmp_jrecord, NULL);
+	for (i = 0; i < rec->nrevoked; i++) {
+		if ((__s32)(rec->revoked[i].seq - rec->end) >= 0)
+			continue;
+		if (n && rec->revoked[n - 1].block == rec->revoked[i].block)
+			n--;
+		rec->revoked[n++] = rec->revoked[i];
+	}
+	rec->nrevoked = n;
+}
+
+static int replay_block(struct minix_journal *journal, struct journal_recovery *rec,
+		__u32 block, unsigned int blk, __u32 seq)
+{
+	struct super_block *sb = journal->j_sb;
+	struct minix_jrecord key = { .block = block }, *revoke;
+	struct buffer_head *log, *home;
+
+	if (block < 2 || block >= minix_sb(sb)->s_nzones ||
+	    (block >= journal->j_first && block < journal->j_first + journal->j_blocks)) {
+		printk("MINIX-fs: journal refers to bad block %u\n", block);
+		return -EIO;
+	}
+	revoke = bsearch(&key, rec->revoked, rec->nrevoked, sizeof(key), cmp_jrecord_block);
+	if (revoke && (__s32)(revoke->seq - seq) >= 0)
+		return 0;
+
+	log = sb_bread(sb, journal->j_first + blk);
+	if (!log)
+		return -EIO;
+	home = sb_getblk(sb, block);
+	lock_buffer(home);
+	memcpy(home->b_data, log->b_data, home->b_size);
+	set_buffer_uptodate(home);
+	unlock_buffer(home);
+	mark_buffer_dirty(home);
+	brelse(home);
+	brelse(log);
+	rec->replayed++;
+	return 0;
+}
+
+/*
+ * Walks the log from start. The first pass finds the committed
+ * transactions and their revokes, the second one replays them.
+ */
+static int journal_scan(struct minix_journal *journal, unsigned int start,
+		struct journal_recovery *rec, bool replay)
+{
+	struct minix_journal_descriptor *d;
+	struct buffer_head *bh;
+	unsigned int blk = start, i;
+	__u32 seq = journal->j_seq;
+	bool done = false;
+	int ret = 0;
+
+	while (!done && !ret && blk < journal->j_blocks && !(replay && seq == rec->end)) {
+		bh = sb_bread(journal->j_sb, journal->j_first + blk);
+		if (!bh)
+			return -EIO;
+		d = (struct minix_journal_descriptor *) bh->b_data;
+		if (d->d_header.h_magic != MINIX_JOURNAL_MAGIC || d->d_header.h_seq != seq) {
+			brelse(bh);
+			break;
+		}
+
+		switch (d->d_header.h_type) {
+		case MINIX_JOURNAL_DESCRIPTOR:
+			if (d->d_count > journal->j_tags) {
+				done = true;
+				break;
+			}
+			for (i = 0; replay && i < d->d_count && !ret; i++)
+				ret = replay_block(journal, rec, d->d_blocknr[i], blk + 1 + i, seq);
+			blk += 1 + d->d_count;
+			break;
+		case MINIX_JOURNAL_REVOKE:
+			if (d->d_count > journal->j_tags) {
+				done = true;
+				break;
+			}
+			for (i = 0; !replay && i < d->d_count && !ret; i++)
+				ret = add_revoke_record(rec, d->d_blocknr[i], seq);
+			blk++;
+			break;
+		case MINIX_JOURNAL_COMMIT:
+			seq++;
+			blk++;
+			if (!replay)
+				rec->end = seq;
+			break;
+		default:
+			done = true;
+			break;
+		}
+		brelse(bh);
+	}
+	return ret;
+}
+
+static int journal_recover(struct minix_journal *journal, unsigned int start)
+{
+	struct super_block *sb = journal->j_sb;
+	struct journal_recovery rec = { .revoked = NULL };
+	int ret;
+
+	rec.end = journal->j_seq;
+	ret = journal_scan(journal, start, &rec, false);
+	if (ret || rec.end == journal->j_seq)
+		goto out;
+
+	if (bdev_read_only(sb->s_bdev)) {
+		printk("MINIX-fs: journal needs recovery, but the device is read-only\n");
+		ret = -EROFS;
+		goto out;
+	}
+
+	sort_revoke_records(&rec);
+	ret = journal_scan(journal, start, &rec, true);
+	if (!ret)
+		ret = sync_blockdev(sb->s_bdev);
+	if (!ret)
+		ret = blkdev_issue_flush(sb->s_bdev, GFP_KERNEL, NULL);
+	if (ret)
+		goto out;
+
+	printk("MINIX-fs: replayed %u blocks of %u transactions from the journal\n",
+			rec.replayed, rec.end - journal->j_seq);
+	journal->j_seq = rec.end;
+	ret = journal_write_super(journal);
+out:
+	kvfree(rec.revoked);
+	return ret;
+}
+
+/*
+ * Sets up the journal at mount, after replaying what it holds
+ */
+int minix_journal_load(struct super_block *sb)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	struct minix_journal *journal;
+	struct minix_journal_super *js;
+	struct buffer_head *bh;
+	unsigned int start;
+	int ret;
+
+	if (!minix_has_feature(sbi, JOURNAL))
+		return 0;
+
+	journal = kzalloc(sizeof(struct minix_journal), GFP_KERNEL);
+	if (!journal)
+		return -ENOMEM;
+	journal->j_sb = sb;
+	journal->j_first = sbi->s_journal_start;
+	journal->j_blocks = sbi->s_journal_blocks;
+	journal->j_tags = (sb->s_blocksize - sizeof(struct minix_journal_descriptor)) / sizeof(__u32);
+	// Half of the log stays free, so a commit of up to j_max_buffers
+	// always fits without writing in place
+	journal->j_max_log = (journal->j_blocks - 1) / 2;
+	journal->j_max_buffers = (journal->j_max_log - 2) * journal->j_tags / (journal->j_tags + 1);
+	journal->j_head = 1;
+	spin_lock_init(&journal->j_lock);
+	init_waitqueue_head(&journal->j_wait);
+	INIT_LIST_HEAD(&journal->j_running);
+	INIT_LIST_HEAD(&journal->j_revoked);
+	INIT_LIST_HEAD(&journal->j_checkpoint);
+	hash_init(journal->j_logged);
+	mutex_init(&journal->j_commit_mutex);
+	INIT_DELAYED_WORK(&journal->j_commit_work, journal_commit_work);
+
+	bh = sb_bread(sb, journal->j_first);
+	if (!bh) {
+		ret = -EIO;
+		goto out_free;
+	}
+	js = (struct minix_journal_super *) bh->b_data;
+	if (js->s_header.h_magic != MINIX_JOURNAL_MAGIC ||
+	    js->s_header.h_type != MINIX_JOURNAL_SUPER ||
+	    js->s_start == 0 || js->s_start >= journal->j_blocks) {
+		printk("MINIX-fs: bad journal super block\n");
+		brelse(bh);
+		ret = -EINVAL;
+		goto out_free;
+	}
+	journal->j_seq = js->s_header.h_seq;
+	start = js->s_start;
+	brelse(bh);
+
+	ret = journal_recover(journal, start);
+	if (ret)
+		goto out_free;
+	sbi->s_journal = journal;
+	return 0;
+
+out_free:
+	kfree(journal);
+	return ret;
+}
+
+void minix_journal_release(struct super_block *sb)
+{
+	struct minix_sb_info *sbi = minix_sb(sb);
+	struct minix_journal *journal = sbi->s_journal;
+	struct minix_jblock *jblk;
+	struct hlist_node *tmp;
+	int bkt;
+
+	if (!journal)
+		return;
+	cancel_delayed_work_sync(&journal->j_commit_work);
+	minix_journal_flush(sb);
+
+	// Left over after a failed checkpoint, the log still has them
+	journal_put_buffers(&journal->j_checkpoint);
+	hash_for_each_safe(journal->j_logged, bkt, tmp, jblk, node)
+		kfree(jblk);
+	sbi->s_journal = NULL;
+	kfree(journal);
+}
@@ -3,7 +3,11 @@
 
 #include <linux/fs.h>
 #include <linux/pagemap.h>
+#include <linux/percpu_counter.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
 #include "minix_fs.h"
+#include "ioctl_basic.h"
 
 #define INODE_VERSION(inode)	minix_sb(inode->i_sb)->s_version
 #define MINIX_V1		0x0001		/* original minix fs */
@@ -18,9 +22,140 @@ struct minix_inode_info {
 		__u16 i1_data[16];
 		__u32 i2_data[16];
 	} u;
+
+	/*
+	 * Preallocation window: zones already taken from the zone map
+	 * for this inode but not yet referenced by it.
+	 * i_alloc_hint is the number of blocks the current write still needs.
+	 */
+	struct mutex i_prealloc_lock;
+	unsigned long i_prealloc_start;
+	unsigned int i_prealloc_count;
+	unsigned int i_alloc_hint;
+
+	/*
+	 * Delayed allocation: zones reserved for buffers that have no zone
+	 * yet, plus an estimate of the indirect blocks they will need.
+	 * i_reserved_last is the logical block reserved last.
+	 * Protected by i_prealloc_lock.
+	 * i_claim_task is the writeback task that allocates for delayed
+	 * buffers under i_claim_lock and may use the reserved zones.
+	 */
+	unsigned int i_reserved_data;
+	unsigned int i_reserved_meta;
+	sector_t i_reserved_last;
+	struct mutex i_claim_lock;
+	struct task_struct *i_claim_task;
+
+	/*
+	 * MINIX_I_MAY_SHARE is set while the inode may reference zones
+	 * with a refcount above one, blocks below i_share_scan are known
+	 * to be private. Both only live in memory and are updated
+	 * together under i_lock. i_share_gen is the snapshot generation
+	 * of the file system when they were last set.
+	 */
+	unsigned long i_flags;
+	unsigned long i_share_scan;
+	u32 i_share_gen;
+
+	/*
+	 * Protects the extent tree of extent mapped inodes, see extents.c.
+	 * Writeback fills holes of indirect mapped inodes under it as well,
+	 * the walks that unshare their indirect blocks hold it for writing.
+	 */
+	struct rw_semaphore i_extent_sem;
 	struct inode vfs_inode;
 };
 
+#define MINIX_I_MAY_SHARE	0
+#define MINIX_I_EXTENTS		1	/* i_data holds the root of an extent tree */
+
+/* Deepest extent tree, more than 32 bit logical block numbers need */
+#define MINIX_EXT_MAX_DEPTH	5
+
+/*
+ * Allocation group: a range of the zone map with its own lock.
+ * The lock also protects the refcounts of the zones in the group.
+ */
+struct minix_alloc_group {
+	struct mutex lock;
+	unsigned long first;	/* first bit of the group in the zone map */
+	unsigned long nbits;
+	unsigned long cursor;	/* next bit to look at, relative to first */
+	unsigned int free;	/* neither allocated nor reserved */
+	bool counted;		/* free is known, see count_zone_group() */
+	unsigned long *reserved;	/* preallocated zones, relative to first */
+	struct btrminix_map_stats stats;
+};
+
+/*
+ * Refcount changes collected to be applied in one pass,
+ * see minix_refcount_batch_add() and minix_refcount_batch_commit()
+ */
+struct minix_refcount_delta {
+	__u32 zone;
+	__s32 delta;
+};
+
+struct minix_refcount_batch {
+	struct super_block *sb;
+	struct minix_refcount_delta *deltas;
+	unsigned int count;
+	unsigned int size;
+	int error;
+	bool restart;	/* may go on in new transactions, see minix_journal_restart() */
+};
+
+/*
+ * Walk over the zone tree of an inode, see minix_walk_zones().
+ * The actor gets the reference to a zone, the number of indirect
+ * levels below it and the first logical block of the walked range
+ * that the zone maps. It may replace the zone, changed() is then
+ * called for the indirect block holding the reference.
+ * prefetch() sees the entries of an indirect block before they are
+ * walked. Both are optional.
+ * Walks over an extent tree (minix_ext_walk()) call the actor for the
+ * tree blocks and extent() for every extent, they change nothing.
+ */
+struct minix_walk {
+	struct super_block *sb;
+	int (*actor)(struct minix_walk *walk, uint32_t *zone, int depth, unsigned long block);
+	void (*changed)(struct minix_walk *walk, struct buffer_head *bh);
+	void (*prefetch)(struct minix_walk *walk, uint32_t *refs, unsigned long first,
+			 unsigned long last, int depth);
+	int (*extent)(struct minix_walk *walk, struct minix_extent *ext);
+};
+
+/* Actor return values besides 0 and errors */
+#define MINIX_WALK_SKIP		1	/* do not descend into this zone */
+#define MINIX_WALK_STOP		2	/* end the walk */
+
+/*
+ * A task changing metadata holds a handle, so that a journal commit
+ * never sees half of an update. Handles nest, only the outermost counts.
+ */
+struct minix_handle {
+	unsigned int h_nofs;
+	bool h_nested;
+};
+
+struct minix_journal;
+
+/*
+ * In-memory copy of a snapshot slot, see s_snapshot_entries
+ */
+#define MINIX_SNAPSHOT_HASH_BITS	5
+
+struct minix_snapshot_entry {
+	struct hlist_node hash;
+	char name[SNAPSHOT_NAME_LENGTH];	/* empty for a free slot */
+	bool deleting;
+	bool rolling_back;			/* pinned against removal */
+	u32 generation;
+	u32 ctime;
+	u32 blocks;
+};
+
 /*
  * minix super-block data in memory
  */
@@ -34,19 +169,113 @@ struct minix_sb_info {
 	unsigned long s_max_size;
 	int s_dirsize;
 	int s_namelen;
-	struct buffer_head ** s_imap;
-	struct buffer_head ** s_zmap;
 	struct buffer_head * s_sbh;
 	struct minix_super_block * s_ms;
 	unsigned short s_mount_state;
 	unsigned short s_version;
 	__u32 s_inodes_blocks;
 	__u32 s_refcount_table_blocks;
-	struct buffer_head ** s_refcount_table;
+	unsigned long s_refcount_table_start;
+	__u32 s_features;
+
+	/*
+	 * Compact refcount encoding: the refcount table area holds the
+	 * shared map followed by s_refcount_overflow_blocks blocks of
+	 * overflow table, which is protected by s_overflow_lock.
+	 */
+	__u32 s_refcount_overflow_blocks;
+	struct mutex s_overflow_lock;
+
+	/*
+	 * Live entries of the overflow table, counted the first time they
+	 * are needed, and entries set aside for batches being applied
+	 */
+	bool s_overflow_counted;
+	unsigned long s_overflow_used;
+	unsigned long s_overflow_reserved;
+
+	/* Metadata journal between the refcount table and the snapshots */
+	unsigned long s_journal_start;
+	__u32 s_journal_blocks;
+	struct minix_journal *s_journal;
 	unsigned long s_snapshots_start_block;
 	unsigned long s_snapshots_slots;
+	unsigned long s_snapshot_slot_blocks;
+
+	/*
+	 * Inode map and inode table blocks a lazy snapshot still shares
+	 * with the live file system, numbered as in the snapshot slots.
+	 * Protected by s_snapshot_lock, NULL without lazy snapshots.
+	 */
+	unsigned long *s_snapshot_pending;
+	struct mutex s_snapshot_lock;
+
+	/*
+	 * Snapshot names and slot headers, read at mount and kept up to
+	 * date with the disk under s_snapshot_lock. Named slots are
+	 * hashed by name into s_snapshot_names.
+	 */
+	struct minix_snapshot_entry *s_snapshot_entries;
+	struct hlist_head s_snapshot_names[1 << MINIX_SNAPSHOT_HASH_BITS];
+
+	/*
+	 * Drops the references of deleted snapshots in the background,
+	 * s_reclaim_next is the inode table block it goes on with
+	 */
+	struct delayed_work s_snapshot_reclaim;
+	unsigned long s_reclaim_next;
+	struct super_block *s_sb;
+
+	/*
+	 * Advanced by every snapshot and rollback instead of marking the
+	 * inodes: an inode from an older generation may share any zone.
+	 * Starts above the generation in every snapshot header.
+	 */
+	u32 s_generation;
+
+	/*
+	 * Summary level above the inode map: number of free bits per bitmap
+	 * block and the bit where the next search starts.
+	 * Protected by bitmap_lock (bitmap.c).
+	 * The bitmap blocks themselves are read on demand, and counted
+	 * the first time they are (MINIX_IMAP_UNCOUNTED until then).
+	 */
+	unsigned int *s_imap_free;
+	unsigned long s_imap_cursor;
+	struct btrminix_map_stats s_imap_stats;
+
+	/* The zone map is split into allocation groups */
+	struct minix_alloc_group *s_zgroups;
+	unsigned long s_zgroup_count;
+	unsigned long s_zgroup_bits;
+
+	/* Free zones and inodes, updated wherever a bitmap bit flips */
+	struct percpu_counter s_free_zones;
+	struct percpu_counter s_free_inodes;
+
+	unsigned long s_mount_opt;
+
+	/* Zones reserved by delayed allocation, protected by s_reserve_lock */
+	spinlock_t s_reserve_lock;
+	unsigned long s_reserved;
+
+	/* See struct btrminix_cow_stats */
+	atomic64_t s_cow_remapped_pages;
+	atomic64_t s_cow_invalidated_pages;
 };
 
+/*
+ * Mount options
+ */
+#define MINIX_MOUNT_DELALLOC	0x0001	/* delay zone allocation to writeback */
+
+/* Block number of buffers whose zone is not allocated yet */
+#define MINIX_INVALID_BLOCK	(~(sector_t)0)
+
+#define test_opt(sb, opt)	(minix_sb(sb)->s_mount_opt & MINIX_MOUNT_##opt)
+
+#define minix_has_feature(sbi, f)	((sbi)->s_features & MINIX_FEATURE_##f)
+
 extern struct inode *minix_iget(struct super_block *, unsigned long);
 extern struct minix_inode * minix_V1_raw_inode(struct super_block *, ino_t, struct buffer_head **);
 extern struct minix2_inode * minix_V2_raw_inode(struct super_block *, ino_t, struct buffer_head **);
@@ -54,14 +283,28 @@ extern struct inode * minix_new_inode(const struct inode *, umode_t, int *);
 extern void minix_free_inode(struct inode * inode);
 extern unsigned long minix_count_free_inodes(struct super_block *sb);
 extern int minix_new_block(struct inode * inode);
+extern unsigned long minix_new_blocks(struct inode *inode, unsigned long goal, unsigned int *count, bool reserve);
+extern unsigned long minix_alloc_block(struct inode *inode, unsigned long goal);
+extern void minix_discard_prealloc(struct inode *inode);
+extern int minix_reserve_block(struct inode *inode, sector_t block);
+extern void minix_release_blocks(struct inode *inode, unsigned int count);
 extern void minix_free_block(struct super_block *sb, unsigned long block);
 extern unsigned long minix_count_free_blocks(struct super_block *sb);
+extern int minix_init_bitmap_summary(struct super_block *sb);
+extern int minix_fix_map_bits(struct super_block *sb);
+extern void minix_free_bitmap_summary(struct super_block *sb);
+extern void minix_update_imap_summary(struct super_block *sb);
+extern void minix_get_stats(struct super_block *sb, struct btrminix_stats *stats);
 extern int minix_getattr(const struct path *, struct kstat *, u32, unsigned int);
+extern int minix_fsync(struct file *, loff_t, loff_t, int);
 extern int minix_prepare_chunk(struct page *page, loff_t pos, unsigned len);
 
 extern void V1_minix_truncate(struct inode *);
+extern int minix_walk_zones(struct minix_walk *, __u32 *, unsigned long, unsigned long);
+extern int minix_put_branch(struct minix_refcount_batch *, uint32_t, int);
 extern void V2_minix_truncate(struct inode *);
-extern void minix_truncate(struct inode *);
+extern int minix_truncate(struct inode *);
+extern int minix_truncate_unshare(struct inode *, loff_t);
 extern void minix_set_inode(struct inode *, dev_t);
 extern int V1_minix_get_block(struct inode *, long, struct buffer_head *, int);
 extern int V2_minix_get_block(struct inode *, long, struct buffer_head *, int);
@@ -79,18 +322,54 @@ extern struct minix_dir_entry *minix_dotdot(struct inode*, struct page**);
 extern ino_t minix_inode_by_name(struct dentry*);
 extern void minix_destroy_inode(struct inode*);
 
-extern inline uint32_t get_refcount(struct minix_sb_info *, size_t);
-extern inline void set_refcount(struct minix_sb_info *, size_t, uint32_t);
-extern inline uint32_t increment_refcount(struct minix_sb_info *, size_t);
-extern inline uint32_t increment_refcount_snapshot_callback(struct super_block *, size_t);
-extern inline uint32_t decrement_refcount(struct minix_sb_info *, size_t);
+extern inline uint32_t get_refcount(struct super_block *, size_t);
+extern inline int set_refcount(struct super_block *, size_t, uint32_t);
+extern inline int increment_refcount(struct super_block *, size_t);
+extern inline uint32_t decrement_refcount(struct super_block *, size_t);
 extern inline uint32_t data_zone_index_for_zone_number(struct minix_sb_info *, size_t);
-extern void increment_refcounts_on_indirect_block(struct super_block *, uint32_t);
-
-extern inline uint32_t deep_copy_block(struct inode *inode, uint32_t src_block_index);
-extern inline void cow_block(struct minix_sb_info *sbi, struct inode *inode, uint32_t *block_index_ptr, bool deep_copy);
-extern inline void cow_indirect_block(struct inode *inode, uint32_t *block_index_ptr, size_t *block_counter, bool deep_copy);
-extern inline void cow_double_indirect_block(struct inode *inode, uint32_t *block_index_ptr, size_t *block_counter, bool deep_copy);
+extern bool minix_put_tree_block(struct super_block *, unsigned long);
+extern void minix_refcount_batch_get_zones(struct minix_refcount_batch *, __u32 *, bool);
+extern int minix_refcount_batch_put_zones(struct minix_refcount_batch *, __u32 *, bool);
+extern void minix_refcount_batch_init(struct minix_refcount_batch *, struct super_block *);
+extern void minix_refcount_batch_add(struct minix_refcount_batch *, unsigned long, int);
+extern void minix_refcount_batch_add_range(struct minix_refcount_batch *, unsigned long, unsigned long, int);
+extern int minix_upgrade_tree_refcount(struct super_block *);
+extern int minix_refcount_batch_commit(struct minix_refcount_batch *);
+
+extern inline int deep_copy_block(struct inode *inode, uint32_t src_block_index, bool metadata,
+				  uint32_t *new_block_ptr);
+extern inline int cow_block(struct minix_sb_info *sbi, struct inode *inode, uint32_t *block_index_ptr, bool deep_copy);
+extern int minix_cow_range(struct inode *inode, unsigned long first, unsigned long last, bool deep_copy);
+extern int minix_clone_blocks(struct inode *src, unsigned long src_block, struct inode *dst,
+			      unsigned long dst_block, unsigned long count);
+extern void minix_cow_remap_pages(struct inode *inode, unsigned long first, unsigned long last, bool dirty);
+extern bool minix_inode_may_share(struct inode *inode);
+
+// Extents
+extern void minix_ext_init(struct inode *);
+extern int minix_ext_set_mapping(struct inode *, bool);
+extern int minix_ext_get_block(struct inode *, sector_t, struct buffer_head *, int);
+extern void minix_ext_truncate(struct inode *);
+extern int minix_ext_cow_range(struct inode *, unsigned long, unsigned long, bool);
+extern int minix_ext_walk(struct minix_walk *, __u32 *, unsigned long, unsigned long);
+extern int minix_ext_share_root(struct inode *);
+extern int minix_ext_map_zone(struct inode *, unsigned long, unsigned long, struct minix_refcount_batch *);
+extern void minix_ext_get_root(struct minix_refcount_batch *, __u32 *);
+extern int minix_ext_put_root(struct minix_refcount_batch *, __u32 *);
+
+// Journal
+extern int minix_journal_load(struct super_block *);
+extern void minix_journal_release(struct super_block *);
+extern void minix_journal_start(struct super_block *, struct minix_handle *);
+extern void minix_journal_join(struct super_block *, struct minix_handle *);
+extern void minix_journal_stop(struct super_block *, struct minix_handle *);
+extern void minix_journal_restart(struct super_block *);
+extern int minix_journal_reserve(struct super_block *, unsigned int);
+extern void minix_journal_dirty(struct super_block *, struct buffer_head *);
+extern void minix_journal_dirty_inode(struct buffer_head *, struct inode *);
+extern void minix_journal_revoke(struct super_block *, unsigned long);
+extern int minix_journal_commit(struct super_block *);
+extern int minix_journal_flush(struct super_block *);
 
 // Snapshots
 long create_snapshot(struct super_block *sb, char *name);
@@ -99,6 +378,13 @@ long remove_snapshot(struct super_block *sb, char *name);
 long slot_of_snapshot(struct super_block *sb, char *name);
 long list_snapshots(struct super_block *sb, char* names);
 size_t count_snapshots(struct super_block *sb);
+long snapshot_info(struct super_block *sb, struct btrminix_snapshot_info *info);
+int minix_snapshot_init(struct super_block *sb);
+void minix_snapshot_release(struct super_block *sb);
+void minix_snapshot_capture(struct super_block *sb, unsigned long block);
+void minix_snapshot_capture_inode(struct inode *inode);
+void minix_snapshot_reclaim_start(struct super_block *sb);
+void minix_snapshot_reclaim_stop(struct super_block *sb);
 
 extern const struct inode_operations minix_file_inode_operations;
 extern const struct inode_operations minix_dir_inode_operations;
@@ -115,6 +401,57 @@ static inline struct minix_inode_info *minix_i(struct inode *inode)
 	return container_of(inode, struct minix_inode_info, vfs_inode);
 }
 
+/*
+ * Tells the allocator how many blocks the next writes will need,
+ * so the preallocation window can be sized accordingly
+ */
+static inline void minix_set_alloc_hint(struct inode *inode, unsigned int nblocks)
+{
+	minix_i(inode)->i_alloc_hint = nblocks;
+}
+
+static inline bool minix_inode_extents(struct inode *inode)
+{
+	return test_bit(MINIX_I_EXTENTS, &minix_i(inode)->i_flags);
+}
+
+/*
+ * Largest size of a file. s_maxbytes is what the 32 bit i_size holds
+ * on file systems with extents, files mapped by the block tree keep
+ * the limit they always had.
+ */
+static inline loff_t minix_max_bytes(struct inode *inode)
+{
+	if (minix_inode_extents(inode))
+		return inode->i_sb->s_maxbytes;
+	return MAX_NON_LFS;
+}
+
+/*
+ * Called before the zones of an inode get an additional reference,
+ * makes the next write go through the CoW walk again
+ */
+static inline void minix_set_may_share(struct inode *inode)
+{
+	spin_lock(&inode->i_lock);
+	minix_i(inode)->i_share_scan = 0;
+	set_bit(MINIX_I_MAY_SHARE, &minix_i(inode)->i_flags);
+	spin_unlock(&inode->i_lock);
+}
+
+/*
+ * Disk blocks of the inode and zone map
+ */
+static inline sector_t minix_imap_block(struct minix_sb_info *sbi, unsigned long i)
+{
+	return 2 + i;
+}
+
+static inline sector_t minix_zmap_block(struct minix_sb_info *sbi, unsigned long i)
+{
+	return 2 + sbi->s_imap_blocks + i;
+}
+
 static inline unsigned minix_blocks_needed(unsigned bits, unsigned blocksize)
 {
 	return DIV_ROUND_UP(bits, blocksize * 8);
@@ -123,6 +460,9 @@ static inline unsigned minix_blocks_needed(unsigned bits, unsigned blocksize)
 // For debugging
 #define PRINT_TO_KERNEL_LOG	0
 
+// Cross-check the free counters against the bitmaps and the refcount table on statfs
+#define CHECK_FREE_COUNTS	0
+
 #if PRINT_TO_KERNEL_LOG == 1
 	#define debug_log(...) _debug_log(__VA_ARGS__)
 #else
@@ -173,6 +513,8 @@ static inline void _debug_log(const char* format, ...) {
 	test_bit((nr), (unsigned long *)(addr))
 #define minix_find_first_zero_bit(addr, size) \
 	find_first_zero_bit((unsigned long *)(addr), (size))
+#define minix_find_next_zero_bit(addr, size, offset) \
+	find_next_zero_bit((unsigned long *)(addr), (size), (offset))
 
 #elif defined(CONFIG_MINIX_FS_BIG_ENDIAN_16BIT_INDEXED)
 
@@ -198,6 +540,17 @@ static inline int minix_find_first_zero_bit(const void *vaddr, unsigned size)
 	return ((p - addr) << 4) + ffz(num);
 }
 
+static inline int minix_find_next_zero_bit(const void *vaddr, unsigned size,
+					   unsigned offset)
+{
+	const unsigned short *p = vaddr;
+
+	for (; offset < size; offset++)
+		if (!(p[offset >> 4] & (1U << (offset & 15))))
+			return offset;
+	return size;
+}
+
 #define minix_test_and_set_bit(nr, addr)	\
 	__test_and_set_bit((nr) ^ 16, (unsigned long *)(addr))
 #define minix_set_bit(nr, addr)	\
@@ -222,6 +575,7 @@ static inline int minix_test_bit(int nr, const void *vaddr)
 #define minix_test_and_clear_bit	__test_and_clear_bit_le
 #define minix_test_bit	test_bit_le
 #define minix_find_first_zero_bit	find_first_zero_bit_le
+#define minix_find_next_zero_bit	find_next_zero_bit_le
 
 #endif
 
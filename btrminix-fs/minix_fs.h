@@ -67,10 +67,13 @@ struct minix2_inode {
 	__u32 i_mtime;
 	__u32 i_ctime;
 	__u32 i_zone[NUM_ZONES_IN_INODE];
-	__u16 i_unused;
+	__u16 i_flags;
 	__u16 i_real_mode;
 };
 
+/* minix2_inode.i_flags */
+#define MINIX_INODE_EXTENTS	0x0001	/* i_zone holds the root of an extent tree */
+
 /*
  * minix super-block data on disk
  */
@@ -107,6 +110,116 @@ struct minix3_super_block {
 	__u8  s_pad3;
 	__u32 s_inodes_blocks;
 	__u32 s_refcount_table_blocks;
+	__u32 s_features;
+	__u32 s_refcount_overflow_blocks;
+	__u32 s_journal_blocks;
+};
+
+/* minix3_super_block.s_features */
+#define MINIX_FEATURE_COMPACT_REFCOUNT	0x0001	/* shared map plus overflow table */
+#define MINIX_FEATURE_JOURNAL		0x0002	/* metadata journal after the refcount table */
+#define MINIX_FEATURE_EXTENTS		0x0004	/* extent mapped inodes may exist */
+#define MINIX_FEATURE_EXTENTS_DEFAULT	0x0008	/* new regular files are extent mapped */
+#define MINIX_FEATURE_SNAPSHOT_HEADERS	0x0010	/* snapshot slots start with a header block */
+#define MINIX_FEATURE_TREE_REFCOUNT	0x0020	/* tree blocks hold the references of their entries */
+#define MINIX_FEATURE_ALL		(MINIX_FEATURE_COMPACT_REFCOUNT | \
+					 MINIX_FEATURE_JOURNAL | \
+					 MINIX_FEATURE_EXTENTS | \
+					 MINIX_FEATURE_EXTENTS_DEFAULT | \
+					 MINIX_FEATURE_SNAPSHOT_HEADERS | \
+					 MINIX_FEATURE_TREE_REFCOUNT)
+
+/*
+ * First block of a snapshot slot with MINIX_FEATURE_SNAPSHOT_HEADERS,
+ * followed by the copies of the inode map and the inode table. A lazy
+ * snapshot only has its own copy of the table blocks (inode map blocks
+ * first) set in sh_captured, the others are still the same as the live
+ * ones and get copied before they change. A deleted snapshot keeps
+ * its slot while MINIX_SNAPSHOT_DELETING is set: its references are
+ * dropped one inode table block at a time, clearing sh_captured.
+ */
+#define MINIX_SNAPSHOT_MAGIC	0x534e4150
+#define MINIX_SNAPSHOT_LAZY	0x0001
+#define MINIX_SNAPSHOT_DELETING	0x0002
+
+struct minix_snapshot_header {
+	__u32 sh_magic;
+	__u32 sh_flags;
+	__u32 sh_pending;	/* table blocks not captured yet */
+	__u32 sh_generation;	/* generation the snapshot was taken in */
+	__u32 sh_ctime;		/* creation time */
+	__u32 sh_blocks;	/* blocks in use when it was taken */
+	__u32 sh_unused[2];
+	__u8  sh_captured[];	/* bit per inode map and inode table block */
+};
+
+/*
+ * Extent tree of an extent mapped inode. Every node starts with a
+ * header, leaves (depth 0) hold extents sorted by logical block and
+ * index nodes hold the first logical block and the zone of each child.
+ * The root lives in i_zone, the other nodes fill a block each.
+ */
+#define MINIX_EXTENT_MAGIC	0x4d58
+
+struct minix_extent_header {
+	__u16 eh_magic;
+	__u16 eh_entries;
+	__u16 eh_max;
+	__u16 eh_depth;
+};
+
+struct minix_extent {
+	__u32 e_block;		/* first logical block */
+	__u32 e_start;		/* first zone */
+	__u32 e_len;		/* number of blocks */
+};
+
+struct minix_extent_idx {
+	__u32 ei_block;		/* first logical block below this entry */
+	__u32 ei_leaf;		/* zone of the child node */
+};
+
+/*
+ * Entry of the refcount overflow table of the compact encoding.
+ * zone 0 marks an empty slot, count 0 a deleted one.
+ */
+struct minix_refcount_entry {
+	__u32 zone;
+	__u32 count;
+};
+
+/*
+ * Metadata journal: a journal super block followed by the log.
+ * Each transaction is written as descriptor blocks, each followed by
+ * the blocks it lists, then revoke blocks and a commit block.
+ * Every block except the logged copies starts with a header that
+ * carries the sequence number of its transaction.
+ */
+#define MINIX_JOURNAL_MAGIC		0x4d4a524e
+#define MINIX_JOURNAL_MIN_BLOCKS	32
+
+#define MINIX_JOURNAL_SUPER		1
+#define MINIX_JOURNAL_DESCRIPTOR	2
+#define MINIX_JOURNAL_REVOKE		3
+#define MINIX_JOURNAL_COMMIT		4
+
+struct minix_journal_header {
+	__u32 h_magic;
+	__u32 h_type;
+	__u32 h_seq;
+};
+
+/* h_seq is the sequence of the first transaction to replay */
+struct minix_journal_super {
+	struct minix_journal_header s_header;
+	__u32 s_start;		/* first log block, relative to the journal */
+};
+
+/* Descriptor and revoke blocks: home block numbers */
+struct minix_journal_descriptor {
+	struct minix_journal_header d_header;
+	__u32 d_count;
+	__u32 d_blocknr[0];
 };
 
 struct minix_dir_entry {
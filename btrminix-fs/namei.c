@@ -10,59 +10,27 @@
 #include <linux/highmem.h>
 #include <linux/swap.h>
 
-void cow_dir(struct inode *inode) {
-	struct minix_inode_info *minix_inode = minix_i(inode);
-	struct minix_sb_info *sbi = minix_sb(inode->i_sb);
-	size_t i;
-	unsigned long npages;
-	struct page *page = NULL;
-	bool had_change = false;
-
-	// Directly referenced
-	//debug_log("== %d, %d, %d, %d ==", pos, len, first_inode_block_index, last_inode_block_index);
-	//debug_log("Current_inode_block_indes is %d", current_inode_block_index);
-	for(i = 0; i < INDIRECT_BLOCK_INDEX; i++) {
-		// Check if block is not yet allocated
-		// All following blocks will also be unallocated
-		if(minix_inode->u.i2_data[i] == 0) {
-			break;
-		}
-
-		// CoW block if needed
-		cow_block(sbi, inode, &minix_inode->u.i2_data[i], true);
-		had_change = true;
-	}
+int cow_dir(struct inode *inode) {
+	int ret, err;
 
-	// Single indirect
-	//debug_log("Current_inode_block_indes is %d (%d, %d)", current_inode_block_index, last_inode_block_index, n_blockrefs_in_inode + n_blockrefs_in_block);
-	if(minix_inode->u.i2_data[INDIRECT_BLOCK_INDEX] != 0) {
-		// CoW indirect block if needed
-		cow_indirect_block(inode, &minix_inode->u.i2_data[INDIRECT_BLOCK_INDEX], &i, true);
-		had_change = true;
-	}
+	if (!minix_inode_may_share(inode))
+		return 0;
 
-	// Double indirect
-	//debug_log("Current_inode_block_indes is %d", current_inode_block_index);
-	if(minix_inode->u.i2_data[DOUBLE_INDIRECT_BLOCK_INDEX] != 0) {
+	// Blocks copied before an error are remapped all the same
+	ret = minix_cow_range(inode, 0, ~0UL, true);
 
-		// CoW indirect block if needed
-		cow_double_indirect_block(inode, &minix_inode->u.i2_data[DOUBLE_INDIRECT_BLOCK_INDEX], &i, true);
-		had_change = true;
-	}
-
-	if (had_change) {
+	if (ret) {
 		mark_inode_dirty(inode);
-		write_inode_now(inode, 1);
-
-		// Remove all pages of the directory entry from the cache
-		npages = dir_pages(inode);
-		for(i = 0; i < npages; i++) {
-			page = dir_get_page(inode, i);
-			lock_page(page);
-			delete_from_page_cache(page);
-			unlock_page(page);
-		}
+		// Pages that are not cached are read back from the data copies
+		err = sync_mapping_buffers(inode->i_mapping);
+		if (ret > 0)
+			ret = err;
+
+		// Cached pages of the directory stay, their buffers move to the new blocks
+		if (inode->i_size)
+			minix_cow_remap_pages(inode, 0, (inode->i_size - 1) >> inode->i_blkbits, false);
 	}
+	return min(ret, 0);
 }
 
 static int add_nondir(struct dentry *dentry, struct inode *inode)
@@ -104,14 +72,18 @@ static int minix_mknod(struct inode * dir, struct dentry *dentry, umode_t mode,
 {
 	int error;
 	struct inode *inode;
+	struct minix_handle handle;
 	
 	PRINT_FUNC();
 
-	cow_dir(dir);
-
 	if (!old_valid_dev(rdev))
 		return -EINVAL;
 
+	minix_journal_start(dir->i_sb, &handle);
+	error = cow_dir(dir);
+	if (error)
+		goto out;
+
 	inode = minix_new_inode(dir, mode, &error);
 
 	if (inode) {
@@ -119,6 +91,8 @@ static int minix_mknod(struct inode * dir, struct dentry *dentry, umode_t mode,
 		mark_inode_dirty(inode);
 		error = add_nondir(dentry, inode);
 	}
+out:
+	minix_journal_stop(dir->i_sb, &handle);
 	return error;
 }
 
@@ -126,9 +100,13 @@ static int minix_tmpfile(struct inode *dir, struct dentry *dentry, umode_t mode)
 {
 	int error;
 	struct inode *inode;
+	struct minix_handle handle;
 
 	PRINT_FUNC();
-	cow_dir(dir);
+	minix_journal_start(dir->i_sb, &handle);
+	error = cow_dir(dir);
+	if (error)
+		goto out;
 	
 	inode = minix_new_inode(dir, mode, &error);
 	
@@ -137,30 +115,43 @@ static int minix_tmpfile(struct inode *dir, struct dentry *dentry, umode_t mode)
 		mark_inode_dirty(inode);
 		d_tmpfile(dentry, inode);
 	}
+out:
+	minix_journal_stop(dir->i_sb, &handle);
 	return error;
 }
 
 static int minix_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 		bool excl)
 {
-	PRINT_FUNC();
+	struct minix_handle handle;
+	int error;
 
-	cow_dir(dir);
+	PRINT_FUNC();
 
-	return minix_mknod(dir, dentry, mode, 0);
+	minix_journal_start(dir->i_sb, &handle);
+	error = cow_dir(dir);
+	if (!error)
+		error = minix_mknod(dir, dentry, mode, 0);
+	minix_journal_stop(dir->i_sb, &handle);
+	return error;
 }
 
 static int minix_symlink(struct inode * dir, struct dentry *dentry,
 	  const char * symname)
 {
-	int err = -ENAMETOOLONG;
+	int err;
 	int i = strlen(symname)+1;
 	struct inode * inode;
+	struct minix_handle handle;
 	
 	PRINT_FUNC();
 
-	cow_dir(dir);
+	minix_journal_start(dir->i_sb, &handle);
+	err = cow_dir(dir);
+	if (err)
+		goto out;
 
+	err = -ENAMETOOLONG;
 	if (i > dir->i_sb->s_blocksize)
 		goto out;
 
@@ -175,6 +166,7 @@ static int minix_symlink(struct inode * dir, struct dentry *dentry,
 
 	err = add_nondir(dentry, inode);
 out:
+	minix_journal_stop(dir->i_sb, &handle);
 	return err;
 
 out_fail:
@@ -187,25 +179,37 @@ static int minix_link(struct dentry * old_dentry, struct inode * dir,
 	struct dentry *dentry)
 {
 	struct inode *inode = d_inode(old_dentry);
+	struct minix_handle handle;
+	int err;
 	
 	PRINT_FUNC();
 
-	cow_dir(inode);
+	minix_journal_start(dir->i_sb, &handle);
+	err = cow_dir(inode);
+	if (err)
+		goto out;
 
 	inode->i_ctime = current_time(inode);
 	inode_inc_link_count(inode);
 	ihold(inode);
-	return add_nondir(dentry, inode);
+	err = add_nondir(dentry, inode);
+out:
+	minix_journal_stop(dir->i_sb, &handle);
+	return err;
 }
 
 static int minix_mkdir(struct inode * dir, struct dentry *dentry, umode_t mode)
 {
 	struct inode * inode;
 	int err;
+	struct minix_handle handle;
 	
 	PRINT_FUNC();
 
-	cow_dir(dir);
+	minix_journal_start(dir->i_sb, &handle);
+	err = cow_dir(dir);
+	if (err)
+		goto out;
 
 	inode_inc_link_count(dir);
 
@@ -227,6 +231,7 @@ static int minix_mkdir(struct inode * dir, struct dentry *dentry, umode_t mode)
 
 	d_instantiate(dentry, inode);
 out:
+	minix_journal_stop(dir->i_sb, &handle);
 	return err;
 
 out_fail:
@@ -240,16 +245,22 @@ out_dir:
 
 static int minix_unlink(struct inode * dir, struct dentry *dentry)
 {
-	int err = -ENOENT;
+	int err;
 	struct inode * inode = d_inode(dentry);
 	struct page * page;
 	struct minix_dir_entry * de;
+	struct minix_handle handle;
 	
 	PRINT_FUNC();
 
+	minix_journal_start(dir->i_sb, &handle);
+
 	// CoW
-	cow_dir(dir);
+	err = cow_dir(dir);
+	if (err)
+		goto end_unlink;
 
+	err = -ENOENT;
 	de = minix_find_entry(dentry, &page);
 	if (!de)
 		goto end_unlink;
@@ -261,18 +272,24 @@ static int minix_unlink(struct inode * dir, struct dentry *dentry)
 	inode->i_ctime = dir->i_ctime;
 	inode_dec_link_count(inode);
 end_unlink:
+	minix_journal_stop(dir->i_sb, &handle);
 	return err;
 }
 
 static int minix_rmdir(struct inode * dir, struct dentry *dentry)
 {
 	struct inode * inode = d_inode(dentry);
-	int err = -ENOTEMPTY;
+	int err;
+	struct minix_handle handle;
 
 	PRINT_FUNC();
 
-	cow_dir(dir);
+	minix_journal_start(dir->i_sb, &handle);
+	err = cow_dir(dir);
+	if (err)
+		goto out;
 
+	err = -ENOTEMPTY;
 	if (minix_empty_dir(inode)) {
 		err = minix_unlink(dir, dentry);
 		if (!err) {
@@ -280,6 +297,8 @@ static int minix_rmdir(struct inode * dir, struct dentry *dentry)
 			inode_dec_link_count(inode);
 		}
 	}
+out:
+	minix_journal_stop(dir->i_sb, &handle);
 	return err;
 }
 
@@ -293,16 +312,22 @@ static int minix_rename(struct inode * old_dir, struct dentry *old_dentry,
 	struct minix_dir_entry * dir_de = NULL;
 	struct page * old_page;
 	struct minix_dir_entry * old_de;
-	int err = -ENOENT;
+	int err;
+	struct minix_handle handle;
 
 	PRINT_FUNC();
 
-	cow_dir(old_dir);
-	cow_dir(new_dir);
-
 	if (flags & ~RENAME_NOREPLACE)
 		return -EINVAL;
 
+	minix_journal_start(old_dir->i_sb, &handle);
+	err = cow_dir(old_dir);
+	if (!err)
+		err = cow_dir(new_dir);
+	if (err)
+		goto out;
+
+	err = -ENOENT;
 	old_de = minix_find_entry(old_dentry, &old_page);
 	if (!old_de)
 		goto out;
@@ -346,6 +371,7 @@ static int minix_rename(struct inode * old_dir, struct dentry *old_dentry,
 		minix_set_link(dir_de, dir_page, new_dir);
 		inode_dec_link_count(old_dir);
 	}
+	minix_journal_stop(old_dir->i_sb, &handle);
 	return 0;
 
 out_dir:
@@ -357,6 +383,7 @@ out_old:
 	kunmap(old_page);
 	put_page(old_page);
 out:
+	minix_journal_stop(old_dir->i_sb, &handle);
 	return err;
 }
 
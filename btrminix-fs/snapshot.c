@@ -3,76 +3,101 @@
 #include "minix.h"
 #include "ioctl_basic.h"
 
-void do_for_blocks_in_indirect_block(struct super_block *sb, size_t block_no, void(*callback)(struct super_block*, size_t)) {
-	struct buffer_head *bh = sb_bread(sb, block_no);
-	uint32_t* block_refs = (uint32_t*)bh->b_data;
-	size_t i;
+// Takes (delta > 0) or drops a reference of the given inode on its zones
+void do_for_blocks_of_inode(struct super_block *sb, struct minix2_inode *inode, struct minix_refcount_batch *batch, int delta) {
+	bool extents = inode->i_flags & MINIX_INODE_EXTENTS;
+
+	// The first zone of device inodes holds the device number
+	if (S_ISCHR(inode->i_real_mode) || S_ISBLK(inode->i_real_mode))
+		return;
+
+	if (delta > 0)
+		minix_refcount_batch_get_zones(batch, inode->i_zone, extents);
+	else
+		minix_refcount_batch_put_zones(batch, inode->i_zone, extents);
+}
 
-	for(i = 0; i < MINIX_BLOCK_REFS_PER_BLOCK; i++) {
-		if(block_refs[i] == 0) {
-			break;
-		}
 
-		callback(sb, block_refs[i]);
-	}
+// First block of the inode map copy of a slot, the header is in front of it
+size_t get_block_for_snapshot_slot(struct super_block *sb, int slot) {
+	struct minix_sb_info *sbi = minix_sb(sb);
+	size_t start = sbi->s_snapshots_start_block + SNAPSHOT_BLOCKS_FOR_NAMES + slot * sbi->s_snapshot_slot_blocks;
+
+	if (minix_has_feature(sbi, SNAPSHOT_HEADERS))
+		start++;
+	return start;
 }
 
 
-// Calls a callback for all blocks of the given inode
-void do_for_blocks_of_inode(struct super_block *sb, struct minix2_inode *inode, void(*callback)(struct super_block*, size_t)) {
-	size_t i;
-	//struct minix_sb_info *sbi = minix_sb(sb);
+// Number of inode map plus inode table blocks, the tables a snapshot copies
+static inline unsigned long snapshot_table_blocks(struct minix_sb_info *sbi) {
+	return sbi->s_imap_blocks + sbi->s_inodes_blocks;
+}
 
-	// Direct data blocks
-	for(i = 0; i < INDIRECT_BLOCK_INDEX; i++) {
-		if(inode->i_zone[i] == 0) {
-			break;
-		}
 
-		debug_log("\tInode contains data block %d", inode->i_zone[i]);
+// Block of the live inode map or inode table with the given table index
+static sector_t live_table_block(struct minix_sb_info *sbi, unsigned long k) {
+	if (k < sbi->s_imap_blocks)
+		return minix_imap_block(sbi, k);
+	return 2 + sbi->s_imap_blocks + sbi->s_zmap_blocks + (k - sbi->s_imap_blocks);
+}
 
-		callback(sb, inode->i_zone[i]);
-	}
 
-	// Single indirect blocks
-	if(inode->i_zone[INDIRECT_BLOCK_INDEX] != 0) {
-		callback(sb, inode->i_zone[INDIRECT_BLOCK_INDEX]);
-		do_for_blocks_in_indirect_block(sb, inode->i_zone[INDIRECT_BLOCK_INDEX], callback);
+// Whether a snapshot still shares table block k with the live file system
+static inline bool snapshot_shares_block(struct minix_snapshot_header *sh, unsigned long k) {
+	return sh && (sh->sh_flags & MINIX_SNAPSHOT_LAZY) && !minix_test_bit(k, sh->sh_captured);
+}
 
-		// Double indirect blocks
-		if(inode->i_zone[DOUBLE_INDIRECT_BLOCK_INDEX] != 0) {
-			struct buffer_head *bh = sb_bread(sb, inode->i_zone[DOUBLE_INDIRECT_BLOCK_INDEX]);
-			uint32_t* block_refs = (uint32_t*)bh->b_data;
-			
-			callback(sb, inode->i_zone[DOUBLE_INDIRECT_BLOCK_INDEX]);
 
-			for(i = 0; i < MINIX_BLOCK_REFS_PER_BLOCK; i++) {
-				if(block_refs[i] == 0) {
-					break;
-				}
+// Block holding table block k of a slot (-1: the live tables)
+static sector_t snapshot_table_block(struct super_block *sb, int slot, struct minix_snapshot_header *sh, unsigned long k) {
+	if (slot < 0 || snapshot_shares_block(sh, k))
+		return live_table_block(minix_sb(sb), k);
+	return get_block_for_snapshot_slot(sb, slot) + k;
+}
 
-				callback(sb, block_refs[i]);
-				do_for_blocks_in_indirect_block(sb, block_refs[i], callback);
-			}
-		}
+
+// Reads the header of a slot, NULL without headers or with a bad one
+static struct buffer_head *read_snapshot_header(struct super_block *sb, int slot) {
+	struct buffer_head *bh;
+
+	if (!minix_has_feature(minix_sb(sb), SNAPSHOT_HEADERS))
+		return NULL;
+	bh = sb_bread(sb, get_block_for_snapshot_slot(sb, slot) - 1);
+	if (bh && ((struct minix_snapshot_header *)bh->b_data)->sh_magic != MINIX_SNAPSHOT_MAGIC) {
+		brelse(bh);
+		bh = NULL;
 	}
+	return bh;
 }
 
 
-// Calls a callback for all blocks of all inodes found in the specified blocks
-void do_for_blocks_of_inodes(struct super_block *sb, size_t imap_start_block, size_t inodes_start_block, void(*callback)(struct super_block*, size_t)) {
+// Adds a refcount change for all blocks of all inodes of a slot (-1: the live tables) to a batch.
+// The inodes a lazy snapshot shares with the live file system hold no references of the snapshot.
+void do_for_blocks_of_inodes(struct super_block *sb, int slot, struct minix_refcount_batch *batch, int delta) {
 	struct minix_sb_info *sbi = minix_sb(sb);
 	size_t imap_block_i, bit, inode_i, inode_block_i, inode_block_offset;
-	struct buffer_head *imap_bh, *inode_bh;
+	struct buffer_head *imap_bh, *inode_bh, *header_bh = NULL;
+	struct minix_snapshot_header *sh = NULL;
 	struct minix2_inode *inode;
 
 	PRINT_FUNC();
 
+	if (slot >= 0)
+		header_bh = read_snapshot_header(sb, slot);
+	if (header_bh)
+		sh = (struct minix_snapshot_header *)header_bh->b_data;
+
 	for(imap_block_i = 0; imap_block_i < sbi->s_imap_blocks; imap_block_i++) {
-		imap_bh = sb_bread(sb, imap_start_block + imap_block_i);
+		imap_bh = sb_bread(sb, snapshot_table_block(sb, slot, sh, imap_block_i));
+		if (!imap_bh) {
+			printk("MINIX-fs: unable to read inode map block %zu\n", imap_block_i);
+			batch->error = -EIO;
+			break;
+		}
 
 		for(bit = 0; bit < sb->s_blocksize << 3; bit++) {
-			inode_i = imap_block_i * sb->s_blocksize_bits + bit;
+			inode_i = (imap_block_i << (sb->s_blocksize_bits + 3)) + bit;
 
 			// There is no inode 0...
 			// That's also why we remove one from inode_1 when we read the inode
@@ -80,7 +105,7 @@ void do_for_blocks_of_inodes(struct super_block *sb, size_t imap_start_block, si
 				continue;
 			}
 
-			if(inode_i >= sbi->s_ninodes) {
+			if(inode_i > sbi->s_ninodes) {
 				break;
 			}
 
@@ -93,14 +118,23 @@ void do_for_blocks_of_inodes(struct super_block *sb, size_t imap_start_block, si
 				
 				debug_log("Inode is in block %ld at offset %ld\n", inode_block_i, inode_block_offset);
 
-				inode_bh = sb_bread(sb, inodes_start_block + inode_block_i);
+				if (slot >= 0 && snapshot_shares_block(sh, sbi->s_imap_blocks + inode_block_i))
+					continue;
+				inode_bh = sb_bread(sb, snapshot_table_block(sb, slot, sh, sbi->s_imap_blocks + inode_block_i));
+				if (!inode_bh) {
+					printk("MINIX-fs: unable to read inode %zu\n", inode_i);
+					batch->error = -EIO;
+					continue;
+				}
 				inode = ((struct minix2_inode*)inode_bh->b_data) + inode_block_offset;
 
-				do_for_blocks_of_inode(sb, inode, callback);
+				do_for_blocks_of_inode(sb, inode, batch, delta);
+				brelse(inode_bh);
 			}
 		}
-
+		brelse(imap_bh);
 	}
+	brelse(header_bh);
 }
 
 
@@ -109,57 +143,68 @@ struct buffer_head *get_bh_to_snapshot_names(struct super_block *sb) {
 }
 
 
-// Gets the ID of the next free snapshot slot, -1 if there is none
+// Bucket of a snapshot name in s_snapshot_names
+static inline struct hlist_head *snapshot_name_bucket(struct minix_sb_info *sbi, const char *name) {
+	return &sbi->s_snapshot_names[hash_32(full_name_hash(NULL, name, strnlen(name, SNAPSHOT_NAME_LENGTH - 1)),
+					 MINIX_SNAPSHOT_HASH_BITS)];
+}
+
+
+// Gets the ID of the next free snapshot slot, -1 if there is none. With s_snapshot_lock held
 int get_free_snapshot_slot(struct super_block *sb) {
-	struct buffer_head *snapshot_names_bh = get_bh_to_snapshot_names(sb);
-	size_t i;
+	struct minix_sb_info *sbi = minix_sb(sb);
+	int i;
 
-	// Read snapshot names
-	for(i = 0; i < minix_sb(sb)->s_snapshots_slots; i++) {
-		// Check if the current slot is free
-		if(snapshot_names_bh->b_data[i*SNAPSHOT_NAME_LENGTH] == '\0') {
+	for(i = 0; i < sbi->s_snapshots_slots; i++) {
+		// A deleted snapshot keeps its slot until its blocks are freed
+		if(sbi->s_snapshot_entries[i].name[0] == '\0' && !sbi->s_snapshot_entries[i].deleting &&
+		   !sbi->s_snapshot_entries[i].rolling_back)
 			return i;
-		}
 	}
 
 	return -1;
 }
 
 
-// Writes a snapshot name to a given slot
+// Writes a snapshot name to a given slot, with s_snapshot_lock held
 void write_snapshot_name(struct super_block *sb, int slot, char *name) {
+	struct minix_sb_info *sbi = minix_sb(sb);
+	struct minix_snapshot_entry *entry = &sbi->s_snapshot_entries[slot];
 	struct buffer_head *snapshot_names_bh = get_bh_to_snapshot_names(sb);
-	size_t i;
-
-	for(i = 0; i < SNAPSHOT_NAME_LENGTH; i++) {
-		snapshot_names_bh->b_data[(slot * SNAPSHOT_NAME_LENGTH) + i] = name[i];
-		if(name[i] == '\0') {
-			break;
-		}
+	size_t len = strnlen(name, SNAPSHOT_NAME_LENGTH - 1);
+
+	if (snapshot_names_bh) {
+		memset(snapshot_names_bh->b_data + slot * SNAPSHOT_NAME_LENGTH, 0, SNAPSHOT_NAME_LENGTH);
+		memcpy(snapshot_names_bh->b_data + slot * SNAPSHOT_NAME_LENGTH, name, len);
+		minix_journal_dirty(sb, snapshot_names_bh);
+		brelse(snapshot_names_bh);
+	} else {
+		printk("MINIX-fs: unable to write name of snapshot slot %d\n", slot);
 	}
 
-	snapshot_names_bh->b_data[(slot * SNAPSHOT_NAME_LENGTH) + strlen(name)] = '\0';
-
-	mark_buffer_dirty(snapshot_names_bh);
-	sync_dirty_buffer(snapshot_names_bh);
+	if (entry->name[0] != '\0')
+		hlist_del_init(&entry->hash);
+	memset(entry->name, 0, SNAPSHOT_NAME_LENGTH);
+	memcpy(entry->name, name, len);
+	if (len)
+		hlist_add_head(&entry->hash, snapshot_name_bucket(sbi, entry->name));
 }
 
 
-// Gets the slot of a given snapshot name
+// Gets the slot of a given snapshot name, with s_snapshot_lock held
 int get_slot_of_snapshot_name(struct super_block *sb, char *name) {
-	struct buffer_head *snapshot_names_bh = get_bh_to_snapshot_names(sb);
-	size_t i;
+	struct minix_sb_info *sbi = minix_sb(sb);
+	struct minix_snapshot_entry *entry;
 
 	if(strlen(name) == 0) {
 		return -1;
 	}
 
-	// Read snapshot names
-	for(i = 0; i < minix_sb(sb)->s_snapshots_slots; i++) {
-		// Check if the current slot is free
-		if(strcmp(snapshot_names_bh->b_data + (i * SNAPSHOT_NAME_LENGTH), name) == 0) {
-			debug_log("Found snapshot %s in slot %d", name, i);
-			return i;
+	hlist_for_each_entry(entry, snapshot_name_bucket(sbi, name), hash) {
+		// Compares as much as write_snapshot_name() stores and the bucket hashes
+		if(strncmp(entry->name, name, SNAPSHOT_NAME_LENGTH - 1) == 0) {
+			debug_log("Found snapshot %s in slot %d", name, (int)(entry - sbi->s_snapshot_entries));
+			return entry - sbi->s_snapshot_entries;
 		}
 	}
 
@@ -167,17 +212,293 @@ int get_slot_of_snapshot_name(struct super_block *sb, char *name) {
 }
 
 
-// Gets snapshot name in a given slot
+// Gets snapshot name in a given slot, with s_snapshot_lock held
 char* get_snapshot_name_of_slot(struct super_block *sb, size_t slot) {
-	struct buffer_head *snapshot_names_bh = get_bh_to_snapshot_names(sb);
-	return snapshot_names_bh->b_data + (slot * SNAPSHOT_NAME_LENGTH);
+	return minix_sb(sb)->s_snapshot_entries[slot].name;
 }
 
 
-size_t get_block_for_snapshot_slot(struct super_block *sb, int slot) {
+// Whether a slot holds a snapshot that can be used, with s_snapshot_lock held
+static inline bool snapshot_slot_named(struct minix_sb_info *sbi, int slot) {
+	return sbi->s_snapshot_entries[slot].name[0] != '\0';
+}
+
+
+// Reads the snapshot names and the slot headers into s_snapshot_entries
+static int snapshot_load_entries(struct super_block *sb) {
 	struct minix_sb_info *sbi = minix_sb(sb);
-	size_t snapshot_size = sbi->s_imap_blocks + sbi->s_inodes_blocks;
-	return sbi->s_snapshots_start_block + SNAPSHOT_BLOCKS_FOR_NAMES + slot * snapshot_size;
+	struct minix_snapshot_entry *entry;
+	struct buffer_head *names_bh, *header_bh;
+	struct minix_snapshot_header *sh;
+	int slot;
+
+	for (slot = 0; slot < (1 << MINIX_SNAPSHOT_HASH_BITS); slot++)
+		INIT_HLIST_HEAD(&sbi->s_snapshot_names[slot]);
+	if (!sbi->s_snapshots_slots)
+		return 0;
+
+	sbi->s_snapshot_entries = kcalloc(sbi->s_snapshots_slots, sizeof(*entry), GFP_KERNEL);
+	if (!sbi->s_snapshot_entries)
+		return -ENOMEM;
+	names_bh = get_bh_to_snapshot_names(sb);
+	if (!names_bh)
+		return -EIO;
+
+	for (slot = 0; slot < sbi->s_snapshots_slots; slot++) {
+		entry = &sbi->s_snapshot_entries[slot];
+		INIT_HLIST_NODE(&entry->hash);
+		memcpy(entry->name, names_bh->b_data + slot * SNAPSHOT_NAME_LENGTH, SNAPSHOT_NAME_LENGTH - 1);
+		if (entry->name[0] != '\0')
+			hlist_add_head(&entry->hash, snapshot_name_bucket(sbi, entry->name));
+
+		header_bh = read_snapshot_header(sb, slot);
+		if (!header_bh)
+			continue;
+		sh = (struct minix_snapshot_header *)header_bh->b_data;
+		entry->deleting = sh->sh_flags & MINIX_SNAPSHOT_DELETING;
+		entry->generation = sh->sh_generation;
+		entry->ctime = sh->sh_ctime;
+		entry->blocks = sh->sh_blocks;
+		brelse(header_bh);
+	}
+	return 0;
+}
+
+
+// Starts a new generation, every inode in memory checks its zones again on the next write
+static void next_snapshot_generation(struct super_block *sb) {
+	struct minix_sb_info *sbi = minix_sb(sb);
+
+	WRITE_ONCE(sbi->s_generation, sbi->s_generation + 1);
+	// Before the references of the snapshot, see minix_inode_may_share()
+	smp_wmb();
+}
+
+
+// Writes a new header to a slot, with s_snapshot_lock held
+static void write_snapshot_header(struct super_block *sb, int slot, __u32 flags, __u32 pending) {
+	struct minix_sb_info *sbi = minix_sb(sb);
+	struct minix_snapshot_entry *entry = &sbi->s_snapshot_entries[slot];
+	struct buffer_head *bh = sb_getblk(sb, get_block_for_snapshot_slot(sb, slot) - 1);
+	struct minix_snapshot_header *sh = (struct minix_snapshot_header *)bh->b_data;
+	unsigned long data_blocks = (sbi->s_nzones - sbi->s_firstdatazone) << sbi->s_log_zone_size;
+
+	lock_buffer(bh);
+	memset(bh->b_data, 0, bh->b_size);
+	sh->sh_magic = MINIX_SNAPSHOT_MAGIC;
+	sh->sh_flags = flags;
+	sh->sh_pending = pending;
+	sh->sh_generation = sbi->s_generation;
+	sh->sh_ctime = get_seconds();
+	sh->sh_blocks = data_blocks - minix_count_free_blocks(sb);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	minix_journal_dirty(sb, bh);
+	brelse(bh);
+
+	entry->deleting = flags & MINIX_SNAPSHOT_DELETING;
+	entry->generation = sh->sh_generation;
+	entry->ctime = sh->sh_ctime;
+	entry->blocks = sh->sh_blocks;
+}
+
+
+// Finds the table blocks lazy snapshots still share, with s_snapshot_lock held
+static int snapshot_find_pending(struct super_block *sb) {
+	struct minix_sb_info *sbi = minix_sb(sb);
+	struct buffer_head *header_bh;
+	struct minix_snapshot_header *sh;
+	unsigned long k;
+	int slot;
+
+	bitmap_zero(sbi->s_snapshot_pending, snapshot_table_blocks(sbi));
+	for (slot = 0; slot < sbi->s_snapshots_slots; slot++) {
+		if (!snapshot_slot_named(sbi, slot))
+			continue;
+		header_bh = read_snapshot_header(sb, slot);
+		if (!header_bh)
+			continue;
+		sh = (struct minix_snapshot_header *)header_bh->b_data;
+		for (k = 0; k < snapshot_table_blocks(sbi); k++) {
+			if (snapshot_shares_block(sh, k))
+				set_bit(k, sbi->s_snapshot_pending);
+		}
+		if (sh->sh_generation >= sbi->s_generation)
+			sbi->s_generation = sh->sh_generation + 1;
+		brelse(header_bh);
+	}
+	return 0;
+}
+
+
+static void snapshot_reclaim_work(struct work_struct *work);
+
+
+// Reads the snapshot slots and sets up lazy snapshots if the slot headers have a bit for every table block
+int minix_snapshot_init(struct super_block *sb) {
+	struct minix_sb_info *sbi = minix_sb(sb);
+	unsigned long blocks = snapshot_table_blocks(sbi);
+	int ret;
+
+	mutex_init(&sbi->s_snapshot_lock);
+	INIT_DELAYED_WORK(&sbi->s_snapshot_reclaim, snapshot_reclaim_work);
+	sbi->s_sb = sb;
+	ret = snapshot_load_entries(sb);
+	if (ret)
+		return ret;
+	if (!minix_has_feature(sbi, SNAPSHOT_HEADERS) || !sbi->s_snapshots_slots ||
+	    blocks > (sb->s_blocksize - sizeof(struct minix_snapshot_header)) * 8)
+		return 0;
+
+	sbi->s_snapshot_pending = kvzalloc(BITS_TO_LONGS(blocks) * sizeof(long), GFP_KERNEL);
+	if (!sbi->s_snapshot_pending)
+		return -ENOMEM;
+	ret = snapshot_find_pending(sb);
+	if (ret)
+		minix_snapshot_release(sb);
+	else if (!(sb->s_flags & MS_RDONLY))
+		minix_snapshot_reclaim_start(sb);
+	return ret;
+}
+
+
+void minix_snapshot_release(struct super_block *sb) {
+	minix_snapshot_reclaim_stop(sb);
+	kvfree(minix_sb(sb)->s_snapshot_pending);
+	minix_sb(sb)->s_snapshot_pending = NULL;
+	kfree(minix_sb(sb)->s_snapshot_entries);
+	minix_sb(sb)->s_snapshot_entries = NULL;
+}
+
+
+// Takes (delta > 0) or drops the references of a snapshot for the inodes in its copy of inode table block k
+static void snapshot_inode_refs(struct super_block *sb, int slot, struct minix_snapshot_header *sh, unsigned long k,
+				struct buffer_head *inode_bh, struct minix_refcount_batch *batch, int delta) {
+	struct minix_sb_info *sbi = minix_sb(sb);
+	unsigned long per_block = sb->s_blocksize / sizeof(struct minix2_inode);
+	unsigned long bits = sb->s_blocksize << 3;
+	unsigned long i, ino, imap_k = ~0UL;
+	struct buffer_head *imap_bh = NULL;
+
+	for (i = 0; i < per_block; i++) {
+		ino = (k - sbi->s_imap_blocks) * per_block + i + 1;
+		if (ino > sbi->s_ninodes)
+			break;
+		if (ino / bits != imap_k) {
+			brelse(imap_bh);
+			imap_k = ino / bits;
+			imap_bh = sb_bread(sb, snapshot_table_block(sb, slot, sh, imap_k));
+			if (!imap_bh) {
+				batch->error = -EIO;
+				return;
+			}
+		}
+		if (minix_test_bit(ino % bits, imap_bh->b_data))
+			do_for_blocks_of_inode(sb, (struct minix2_inode *)inode_bh->b_data + i, batch, delta);
+	}
+	brelse(imap_bh);
+}
+
+
+// Gives a lazy snapshot its own copy of table block k, with s_snapshot_lock held.
+// The block only counts as copied once the references of its inodes are taken.
+static int snapshot_capture_slot(struct super_block *sb, int slot, unsigned long k) {
+	struct minix_sb_info *sbi = minix_sb(sb);
+	struct buffer_head *header_bh, *live_bh, *copy_bh;
+	struct minix_snapshot_header *sh;
+	struct minix_refcount_batch batch;
+	int ret = 0;
+
+	header_bh = read_snapshot_header(sb, slot);
+	if (!header_bh)
+		return -EIO;
+	sh = (struct minix_snapshot_header *)header_bh->b_data;
+	if (!snapshot_shares_block(sh, k))
+		goto out;
+
+	live_bh = sb_bread(sb, live_table_block(sbi, k));
+	if (!live_bh) {
+		ret = -EIO;
+		goto out;
+	}
+	// The copy is overwritten completely, no need to read it
+	copy_bh = sb_getblk(sb, get_block_for_snapshot_slot(sb, slot) + k);
+	lock_buffer(copy_bh);
+	memcpy(copy_bh->b_data, live_bh->b_data, copy_bh->b_size);
+	set_buffer_uptodate(copy_bh);
+	unlock_buffer(copy_bh);
+	minix_journal_dirty(sb, copy_bh);
+	brelse(live_bh);
+
+	// Until now the references of the live inodes stood in for the snapshot
+	minix_refcount_batch_init(&batch, sb);
+	if (k >= sbi->s_imap_blocks)
+		snapshot_inode_refs(sb, slot, sh, k, copy_bh, &batch, 1);
+	brelse(copy_bh);
+	ret = minix_refcount_batch_commit(&batch);
+	if (ret)
+		goto out;
+
+	minix_set_bit(k, sh->sh_captured);
+	if (!--sh->sh_pending)
+		sh->sh_flags &= ~MINIX_SNAPSHOT_LAZY;
+	minix_journal_dirty(sb, header_bh);
+out:
+	brelse(header_bh);
+	return ret;
+}
+
+
+/*
+ * Copies table block k (the inode map blocks, then the inode table)
+ * into every lazy snapshot that still shares it. Called before the
+ * block changes and before the zones of an inode in it change.
+ */
+void minix_snapshot_capture(struct super_block *sb, unsigned long k) {
+	struct minix_sb_info *sbi = minix_sb(sb);
+	struct minix_handle handle;
+	int slot, ret, err = 0;
+
+	if (!sbi->s_snapshot_pending || !test_bit(k, sbi->s_snapshot_pending))
+		return;
+
+	// Callers may hold the inode map lock, so only join the running transaction
+	minix_journal_join(sb, &handle);
+	mutex_lock(&sbi->s_snapshot_lock);
+	if (test_bit(k, sbi->s_snapshot_pending)) {
+		for (slot = 0; slot < sbi->s_snapshots_slots; slot++) {
+			if (!snapshot_slot_named(sbi, slot))
+				continue;
+			ret = snapshot_capture_slot(sb, slot, k);
+			if (ret && !err)
+				err = ret;
+		}
+		if (err)
+			printk("MINIX-fs: snapshot copy of table block %lu failed (%d)\n", k, err);
+		else
+			clear_bit(k, sbi->s_snapshot_pending);
+	}
+	mutex_unlock(&sbi->s_snapshot_lock);
+	minix_journal_stop(sb, &handle);
+}
+
+
+// Captures the inode table block of an inode, see minix_snapshot_capture()
+void minix_snapshot_capture_inode(struct inode *inode) {
+	struct minix_sb_info *sbi = minix_sb(inode->i_sb);
+	unsigned long per_block = inode->i_sb->s_blocksize / sizeof(struct minix2_inode);
+
+	if (sbi->s_snapshot_pending)
+		minix_snapshot_capture(inode->i_sb, sbi->s_imap_blocks + (inode->i_ino - 1) / per_block);
+}
+
+
+// Dirties a block of a complete table copy. The copy is too large for the
+// journal and is written before the slot gets its name instead, so replay
+// must not bring back what the log still has of the block.
+static void snapshot_copy_dirty(struct super_block *sb, struct buffer_head *bh) {
+	minix_journal_revoke(sb, bh->b_blocknr);
+	mark_buffer_dirty(bh);
 }
 
 
@@ -186,35 +507,62 @@ long create_snapshot(struct super_block *sb, char *name) {
 	struct minix_sb_info *sbi = minix_sb(sb);
 	size_t i, read_block, write_block;
 	struct buffer_head *read_bh, *write_bh;
-	int slot;
+	struct minix_refcount_batch batch;
+	struct minix_handle handle;
+	int slot, ret;
 	
 	PRINT_FUNC();
 
+	// Writers wait until the snapshot is taken. Freezing writes back
+	// all dirty data first, so delayed buffers have their zones and
+	// the snapshot references them.
+	ret = freeze_super(sb);
+	if (ret)
+		return ret;
+
+	// The refcount updates and the name go into one transaction
+	minix_journal_start(sb, &handle);
+	mutex_lock(&sbi->s_snapshot_lock);
+
 	// Get free slot
 	slot = get_free_snapshot_slot(sb);
 	if(slot == -1) {
 		debug_log("\tNo free slots for snapshot\n");
-		return IOCTL_ERROR_NO_FREE_SNAPSHOTS;
+		ret = IOCTL_ERROR_NO_FREE_SNAPSHOTS;
+		goto out_unlock;
 	}
 
 	// Check if name is free
 	if(get_slot_of_snapshot_name(sb, name) != -1) {
 		debug_log("\tName already exists\n");
-		return IOCTL_ERROR_SNAPSHOT_EXISTS;
+		ret = IOCTL_ERROR_SNAPSHOT_EXISTS;
+		goto out_unlock;
 	}
 
+	// A lazy snapshot copies the tables block by block, before they change.
+	// Its references are taken then, writes only see a new generation now
+	if (sbi->s_snapshot_pending) {
+		write_snapshot_header(sb, slot, MINIX_SNAPSHOT_LAZY, snapshot_table_blocks(sbi));
+		bitmap_set(sbi->s_snapshot_pending, 0, snapshot_table_blocks(sbi));
+		next_snapshot_generation(sb);
+		goto out_name;
+	}
+	if (minix_has_feature(sbi, SNAPSHOT_HEADERS))
+		write_snapshot_header(sb, slot, 0, 0);
+
 	// Get buffer_head to snapshot slot
 	write_block = get_block_for_snapshot_slot(sb, slot);
 	debug_log("\tSnapshot starts at block %ld", write_block);
 
 	// Copy inode bitmap to snapshot
 	for(i = 0; i < sbi->s_imap_blocks; i++) {
-		read_bh = sbi->s_imap[i];
+		read_bh = sb_bread(sb, minix_imap_block(sbi, i));
 		write_bh = sb_bread(sb, write_block);
 
 		memcpy(write_bh->b_data, read_bh->b_data, write_bh->b_size);
-		mark_buffer_dirty(write_bh);
-		sync_dirty_buffer(write_bh);
+		snapshot_copy_dirty(sb, write_bh);
+		brelse(read_bh);
+		brelse(write_bh);
 
 		write_block++;
 	}
@@ -226,8 +574,9 @@ long create_snapshot(struct super_block *sb, char *name) {
 		write_bh = sb_bread(sb, write_block);
 
 		memcpy(write_bh->b_data, read_bh->b_data, write_bh->b_size);
-		mark_buffer_dirty(write_bh);
-		sync_dirty_buffer(write_bh);
+		snapshot_copy_dirty(sb, write_bh);
+		brelse(read_bh);
+		brelse(write_bh);
 
 		read_block++;
 		write_block++;
@@ -235,111 +584,518 @@ long create_snapshot(struct super_block *sb, char *name) {
 
 	debug_log("\tCopied blocks until block %ld\n", write_block);
 
+	// The copies are on disk before the name makes the slot count
+	ret = filemap_write_and_wait_range(sb->s_bdev->bd_inode->i_mapping,
+			(loff_t)get_block_for_snapshot_slot(sb, slot) << sb->s_blocksize_bits,
+			((loff_t)write_block << sb->s_blocksize_bits) - 1);
+	if (ret) {
+		printk("MINIX-fs: snapshot %s: writing the table copy failed (%d)\n", name, ret);
+		goto out_unlock;
+	}
+
+	// Every write checks the zones it touches again. A scan for shared
+	// zones that runs meanwhile sees the new generation once it is done.
+	next_snapshot_generation(sb);
+
 	// Increment refcount of currently referenced data blocks
-	do_for_blocks_of_inodes(sb, 2, 2 + sbi->s_imap_blocks + sbi->s_zmap_blocks, (void(*)(struct super_block*, size_t))increment_refcount_snapshot_callback);
+	minix_refcount_batch_init(&batch, sb);
+	do_for_blocks_of_inodes(sb, -1, &batch, 1);
+	ret = minix_refcount_batch_commit(&batch);
+	if (ret) {
+		// The slot stays unnamed, so it is free again
+		printk("MINIX-fs: snapshot %s: refcount update failed (%d)\n", name, ret);
+		goto out_unlock;
+	}
 
+out_name:
 	// Write snapshot name to table
 	debug_log("\tPutting snapshot %s in slot %d\n", name, slot);
 	write_snapshot_name(sb, slot, name);
 
 	debug_log("\tPut snapshot %s in slot %d\n", name, slot);
+	ret = 0;
 
-	return 0;
+out_unlock:
+	mutex_unlock(&sbi->s_snapshot_lock);
+	minix_journal_stop(sb, &handle);
+	thaw_super(sb);
+	return ret;
+}
+
+
+// Whether table block k of a slot differs from the live one: 1 if it does, 0 if not, -EIO
+static int table_block_changed(struct super_block *sb, int slot, struct minix_snapshot_header *sh, unsigned long k) {
+	struct buffer_head *live_bh, *snap_bh;
+	sector_t block = snapshot_table_block(sb, slot, sh, k);
+	int ret = -EIO;
+
+	// A lazy snapshot that still shares the block reads the live one
+	if (block == live_table_block(minix_sb(sb), k))
+		return 0;
+	live_bh = sb_bread(sb, live_table_block(minix_sb(sb), k));
+	snap_bh = sb_bread(sb, block);
+	if (live_bh && snap_bh)
+		ret = memcmp(live_bh->b_data, snap_bh->b_data, sb->s_blocksize) != 0;
+	brelse(live_bh);
+	brelse(snap_bh);
+	return ret;
+}
+
+
+// Reads the inode map bit of an inode of a slot (-1: the live tables), *bh caches the map block
+static int table_inode_used(struct super_block *sb, int slot, struct minix_snapshot_header *sh,
+			    unsigned long ino, struct buffer_head **bh) {
+	sector_t block = snapshot_table_block(sb, slot, sh, ino >> (sb->s_blocksize_bits + 3));
+
+	if (!*bh || (*bh)->b_blocknr != block) {
+		brelse(*bh);
+		*bh = sb_bread(sb, block);
+		if (!*bh)
+			return -EIO;
+	}
+	return minix_test_bit(ino & ((sb->s_blocksize << 3) - 1), (*bh)->b_data) != 0;
+}
+
+
+// Whether an inode holds references on zones
+static inline bool inode_has_zones(struct minix2_inode *inode, int used) {
+	return used > 0 && !S_ISCHR(inode->i_real_mode) && !S_ISBLK(inode->i_real_mode);
+}
+
+
+// Whether two inodes hold references on the same zones
+static bool inodes_share_zones(struct minix2_inode *a, bool a_zones, struct minix2_inode *b, bool b_zones) {
+	if (a_zones != b_zones)
+		return false;
+	return !a_zones || ((a->i_flags & MINIX_INODE_EXTENTS) == (b->i_flags & MINIX_INODE_EXTENTS) &&
+			    !memcmp(a->i_zone, b->i_zone, sizeof(a->i_zone)));
 }
 
 
-// Rolls back to a given snapshot
+// Adds the references the inodes of the slot take when rolling back inode table block k
+// to a batch. The live inodes they replace go to drop, they give up their references once
+// the tables are restored. Inodes that keep their zones are left alone and zero in drop.
+static int rollback_inode_block(struct super_block *sb, int slot, struct minix_snapshot_header *sh,
+				unsigned long k, struct minix_refcount_batch *batch, struct minix2_inode *drop) {
+	struct minix_sb_info *sbi = minix_sb(sb);
+	unsigned long per_block = sb->s_blocksize / sizeof(struct minix2_inode);
+	struct buffer_head *live_bh, *snap_bh, *live_imap_bh = NULL, *snap_imap_bh = NULL;
+	struct minix2_inode *live, *snap;
+	unsigned long i, ino;
+	bool live_zones, snap_zones;
+	int ret = -EIO;
+
+	live_bh = sb_bread(sb, live_table_block(sbi, k));
+	snap_bh = sb_bread(sb, snapshot_table_block(sb, slot, sh, k));
+	if (!live_bh || !snap_bh)
+		goto out;
+
+	for (i = 0; i < per_block; i++) {
+		ino = (k - sbi->s_imap_blocks) * per_block + i + 1;
+		if (ino > sbi->s_ninodes)
+			break;
+		live = (struct minix2_inode *)live_bh->b_data + i;
+		snap = (struct minix2_inode *)snap_bh->b_data + i;
+		live_zones = inode_has_zones(live, table_inode_used(sb, -1, NULL, ino, &live_imap_bh));
+		snap_zones = inode_has_zones(snap, table_inode_used(sb, slot, sh, ino, &snap_imap_bh));
+		if (!live_imap_bh || !snap_imap_bh)
+			goto out;
+		if (inodes_share_zones(live, live_zones, snap, snap_zones))
+			continue;
+		if (snap_zones)
+			do_for_blocks_of_inode(sb, snap, batch, 1);
+		if (live_zones)
+			drop[i] = *live;
+	}
+	ret = 0;
+out:
+	brelse(live_imap_bh);
+	brelse(snap_imap_bh);
+	brelse(live_bh);
+	brelse(snap_bh);
+	return ret;
+}
+
+
+// Whether rolling back inode table block k may change references: the block
+// or the inode map bits of its inodes differ
+static bool inode_block_changed(struct super_block *sb, unsigned long *changed, unsigned long k) {
+	struct minix_sb_info *sbi = minix_sb(sb);
+	unsigned long per_block = sb->s_blocksize / sizeof(struct minix2_inode);
+	unsigned long first = (k - sbi->s_imap_blocks) * per_block + 1;
+	unsigned long last = min_t(unsigned long, first + per_block - 1, sbi->s_ninodes);
+	unsigned int shift = sb->s_blocksize_bits + 3;
+
+	return test_bit(k, changed) || test_bit(first >> shift, changed) || test_bit(last >> shift, changed);
+}
+
+
+/*
+ * Rolls back to a given snapshot. Only the table blocks that differ
+ * from the snapshot are rewritten and only the inodes whose zones
+ * differ change references, so the cost follows what changed since
+ * the snapshot rather than the size of the file system.
+ * The table blocks are restored in one transaction, so a rollback
+ * can change at most as many as the journal holds. The references
+ * are taken before and dropped after it, a crash in between only
+ * leaves zones allocated.
+ */
 long rollback_snapshot(struct super_block *sb, char *name) {
 	struct minix_sb_info *sbi = minix_sb(sb);
-	size_t i, read_block, write_block;
-	struct buffer_head *read_bh, *write_bh;
-	int slot;
+	unsigned long blocks = snapshot_table_blocks(sbi);
+	struct buffer_head *header_bh, *read_bh, *write_bh;
+	struct minix_snapshot_header *sh = NULL;
+	unsigned long per_block = sb->s_blocksize / sizeof(struct minix2_inode);
+	struct minix2_inode *drop = NULL;
+	struct minix_refcount_batch batch;
+	struct minix_handle handle;
+	unsigned long k, n, *changed;
+	unsigned int weight;
+	int slot, ret = 0;
 
 	PRINT_FUNC();
 
-	// Find snapshot slot
+	// Writers wait until the tables are restored, so the passes below
+	// all see the same live tables
+	ret = freeze_super(sb);
+	if (ret)
+		return ret;
+
+	// Find snapshot slot, it stays pinned against removal until the end
 	debug_log("\tShould rollback to snapshot %s\n", name);
+	mutex_lock(&sbi->s_snapshot_lock);
 	slot = get_slot_of_snapshot_name(sb, name);
+	if (slot != -1)
+		sbi->s_snapshot_entries[slot].rolling_back = true;
+	mutex_unlock(&sbi->s_snapshot_lock);
 	if(slot == -1) {
 		debug_log("\tSnapshot does not exist\n");
-		return IOCTL_ERROR_SNAPSHOT_DOES_NOT_EXIST;
+		ret = IOCTL_ERROR_SNAPSHOT_DOES_NOT_EXIST;
+		goto out_thaw;
 	}
 
-	// Remove current content
-	do_for_blocks_of_inodes(sb, 2, 2 + sbi->s_imap_blocks + sbi->s_zmap_blocks, minix_free_block);
+	changed = kcalloc(BITS_TO_LONGS(blocks), sizeof(long), GFP_KERNEL);
+	if (!changed) {
+		ret = -ENOMEM;
+		goto out_unpin;
+	}
 
-	// Get buffer_head to snapshot
-	read_block = get_block_for_snapshot_slot(sb, slot);
-	debug_log("\tSnapshot starts at block %ld", read_block);
-	read_bh = sb_bread(sb, read_block);
+	minix_journal_start(sb, &handle);
+	header_bh = read_snapshot_header(sb, slot);
+	if (header_bh)
+		sh = (struct minix_snapshot_header *)header_bh->b_data;
+
+	// Lazy snapshots still sharing a block that gets overwritten need their copy now
+	for (k = 0; k < blocks; k++) {
+		ret = table_block_changed(sb, slot, sh, k);
+		if (ret < 0)
+			goto out;
+		if (ret) {
+			set_bit(k, changed);
+			minix_snapshot_capture(sb, k);
+			minix_journal_restart(sb);
+		}
+	}
+	ret = 0;
+
+	weight = bitmap_weight(changed, blocks);
+	if (minix_journal_reserve(sb, weight)) {
+		printk("MINIX-fs: rollback to %s changes %u table blocks, more than the journal holds\n",
+		       name, weight);
+		ret = -ENOSPC;
+		goto out;
+	}
+	for (n = 0, k = sbi->s_imap_blocks; k < blocks; k++)
+		n += inode_block_changed(sb, changed, k);
+	drop = kvzalloc(n * sb->s_blocksize, GFP_KERNEL);
+	if (n && !drop) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
-	// Copy inode bitmap from snapshot
-	for(i = 0; i < sbi->s_imap_blocks; i++) {
-		write_bh = sbi->s_imap[i];
-		read_bh = sb_bread(sb, read_block);
+	// The restored inodes take their references first. Dropping the current
+	// ones frees tree blocks on their last reference right away, so
+	// anything the snapshot shares must already count it.
+	minix_refcount_batch_init(&batch, sb);
+	batch.restart = true;
+	for (n = 0, k = sbi->s_imap_blocks; k < blocks && !ret; k++) {
+		if (inode_block_changed(sb, changed, k))
+			ret = rollback_inode_block(sb, slot, sh, k, &batch, drop + n++ * per_block);
+	}
+	if (ret)
+		batch.error = ret;
+	ret = minix_refcount_batch_commit(&batch);
+	if (ret) {
+		printk("MINIX-fs: rollback to %s: refcount update failed (%d)\n", name, ret);
+		goto out;
+	}
 
-		memcpy(write_bh->b_data, read_bh->b_data, write_bh->b_size);
-		mark_buffer_dirty(write_bh);
-		sync_dirty_buffer(write_bh);
+	// Copy the inode map and inode table blocks that changed
+	minix_journal_reserve(sb, weight);
+	for_each_set_bit(k, changed, blocks) {
+		read_bh = sb_bread(sb, snapshot_table_block(sb, slot, sh, k));
+		write_bh = sb_bread(sb, live_table_block(sbi, k));
+		if (!read_bh || !write_bh) {
+			printk("MINIX-fs: rollback to %s: unable to copy table block %lu\n", name, k);
+			brelse(read_bh);
+			brelse(write_bh);
+			ret = -EIO;
+			break;
+		}
 
-		read_block++;
+		memcpy(write_bh->b_data, read_bh->b_data, write_bh->b_size);
+		minix_journal_dirty(sb, write_bh);
+		brelse(read_bh);
+		brelse(write_bh);
 	}
+	if (find_first_bit(changed, sbi->s_imap_blocks) < sbi->s_imap_blocks)
+		minix_update_imap_summary(sb);
 
-	// Copy inodes to snapshot
-	write_block = 2 + sbi->s_imap_blocks + sbi->s_zmap_blocks;
-	for(i = 0; i < sbi->s_inodes_blocks; i++) {
-		write_bh = sb_bread(sb, write_block);
-		read_bh = sb_bread(sb, read_block);
+	debug_log("\tCopied %u changed table blocks\n", weight);
 
-		memcpy(write_bh->b_data, read_bh->b_data, write_bh->b_size);
-		mark_buffer_dirty(write_bh);
-		sync_dirty_buffer(write_bh);
+	next_snapshot_generation(sb);
+	if (ret)
+		goto out;
 
-		write_block++;
-		read_block++;
+	// The replaced inodes drop their references now that nothing refers to them
+	minix_refcount_batch_init(&batch, sb);
+	batch.restart = true;
+	for (k = 0; k < n * per_block; k++) {
+		do_for_blocks_of_inode(sb, &drop[k], &batch, -1);
+		minix_journal_restart(sb);
 	}
+	ret = minix_refcount_batch_commit(&batch);
+	if (ret)
+		printk("MINIX-fs: rollback to %s: dropping old references failed (%d)\n", name, ret);
+out:
+	brelse(header_bh);
+	minix_journal_stop(sb, &handle);
+	kvfree(drop);
+	kfree(changed);
+out_unpin:
+	mutex_lock(&sbi->s_snapshot_lock);
+	sbi->s_snapshot_entries[slot].rolling_back = false;
+	mutex_unlock(&sbi->s_snapshot_lock);
+out_thaw:
+	thaw_super(sb);
+	return ret;
+}
+
+
+// Inode table blocks one reclaim round visits and the pause between rounds
+#define SNAPSHOT_RECLAIM_BLOCKS	16
+#define SNAPSHOT_RECLAIM_DELAY	(HZ / 50)
 
-	debug_log("\tCopied blocks until block %ld\n", read_block);
 
-	// Increase refcount for current content
-	do_for_blocks_of_inodes(sb, 2, 2 + sbi->s_imap_blocks + sbi->s_zmap_blocks, (void(*)(struct super_block*, size_t))increment_refcount_snapshot_callback);
+// Hands a snapshot to the reclaim worker, with s_snapshot_lock held. The inode map
+// blocks it still shares get copied first, nothing copies them once its name is gone.
+static int snapshot_mark_deleting(struct super_block *sb, int slot) {
+	struct minix_sb_info *sbi = minix_sb(sb);
+	struct buffer_head *header_bh;
+	struct minix_snapshot_header *sh;
+	unsigned long k;
+	int ret;
+
+	for (k = 0; k < sbi->s_imap_blocks; k++) {
+		ret = snapshot_capture_slot(sb, slot, k);
+		if (ret)
+			return ret;
+	}
 
+	header_bh = read_snapshot_header(sb, slot);
+	if (!header_bh)
+		return -EIO;
+	sh = (struct minix_snapshot_header *)header_bh->b_data;
+
+	// A complete copy holds references for every inode table block
+	if (!(sh->sh_flags & MINIX_SNAPSHOT_LAZY)) {
+		for (k = 0; k < snapshot_table_blocks(sbi); k++)
+			minix_set_bit(k, sh->sh_captured);
+		sh->sh_pending = 0;
+	}
+	sh->sh_flags |= MINIX_SNAPSHOT_LAZY | MINIX_SNAPSHOT_DELETING;
+	minix_journal_dirty(sb, header_bh);
+	sbi->s_snapshot_entries[slot].deleting = true;
+	brelse(header_bh);
 	return 0;
 }
 
 
+// Drops the references of a deleted snapshot for inode table blocks first..end-1 and
+// frees its slot once none are left. Returns whether it still holds references.
+static bool snapshot_reclaim_slot(struct super_block *sb, int slot, unsigned long first, unsigned long end,
+				  struct minix_refcount_batch *batch) {
+	struct minix_sb_info *sbi = minix_sb(sb);
+	struct buffer_head *header_bh, *inode_bh;
+	struct minix_snapshot_header *sh;
+	unsigned long k;
+	bool left;
+
+	if (!sbi->s_snapshot_entries[slot].deleting)
+		return false;
+	// Goes on in a later round once the rollback reading the slot is done
+	if (sbi->s_snapshot_entries[slot].rolling_back)
+		return true;
+	header_bh = read_snapshot_header(sb, slot);
+	if (!header_bh)
+		return false;
+	sh = (struct minix_snapshot_header *)header_bh->b_data;
+	if (!(sh->sh_flags & MINIX_SNAPSHOT_DELETING)) {
+		brelse(header_bh);
+		return false;
+	}
+
+	for (k = first; k < end && !batch->error; k++) {
+		if (snapshot_shares_block(sh, k))
+			continue;
+		inode_bh = sb_bread(sb, get_block_for_snapshot_slot(sb, slot) + k);
+		if (!inode_bh) {
+			batch->error = -EIO;
+			break;
+		}
+		snapshot_inode_refs(sb, slot, sh, k, inode_bh, batch, -1);
+		brelse(inode_bh);
+		if (batch->error)
+			break;
+
+		// Without its own copy of the block the snapshot holds no references for it
+		minix_test_and_clear_bit(k, sh->sh_captured);
+		sh->sh_pending++;
+	}
+
+	left = sh->sh_pending < sbi->s_inodes_blocks;
+	if (left)
+		minix_journal_dirty(sb, header_bh);
+	brelse(header_bh);
+	if (!left)
+		write_snapshot_header(sb, slot, 0, 0);
+	return left;
+}
+
+
+// Frees the blocks of deleted snapshots a few inode table blocks per round.
+// Deletions pending together share one pass over the inode table.
+static void snapshot_reclaim_work(struct work_struct *work) {
+	struct minix_sb_info *sbi = container_of(to_delayed_work(work), struct minix_sb_info, s_snapshot_reclaim);
+	struct super_block *sb = sbi->s_sb;
+	unsigned long first, end, blocks = snapshot_table_blocks(sbi);
+	struct minix_refcount_batch batch;
+	struct minix_handle handle;
+	bool left = false;
+	int slot, ret;
+
+	minix_journal_start(sb, &handle);
+	mutex_lock(&sbi->s_snapshot_lock);
+
+	// Deletions that came in during a pass get the rest of the table after wrapping around
+	first = sbi->s_reclaim_next;
+	if (first < sbi->s_imap_blocks || first >= blocks)
+		first = sbi->s_imap_blocks;
+	end = min_t(unsigned long, first + SNAPSHOT_RECLAIM_BLOCKS, blocks);
+
+	minix_refcount_batch_init(&batch, sb);
+	for (slot = 0; slot < sbi->s_snapshots_slots; slot++)
+		left |= snapshot_reclaim_slot(sb, slot, first, end, &batch);
+	ret = minix_refcount_batch_commit(&batch);
+	if (ret)
+		printk("MINIX-fs: freeing blocks of deleted snapshots failed (%d)\n", ret);
+	sbi->s_reclaim_next = end;
+
+	mutex_unlock(&sbi->s_snapshot_lock);
+	minix_journal_stop(sb, &handle);
+
+	// Rounds leave room for other writers, a failed one waits for the next mount
+	if (left && !ret)
+		schedule_delayed_work(&sbi->s_snapshot_reclaim, SNAPSHOT_RECLAIM_DELAY);
+}
+
+
+// Starts freeing the blocks of deleted snapshots
+void minix_snapshot_reclaim_start(struct super_block *sb) {
+	struct minix_sb_info *sbi = minix_sb(sb);
+
+	if (sbi->s_snapshot_pending)
+		mod_delayed_work(system_wq, &sbi->s_snapshot_reclaim, 0);
+}
+
+
+// Waits for the current reclaim round, the rest goes on after the next mount
+void minix_snapshot_reclaim_stop(struct super_block *sb) {
+	struct minix_sb_info *sbi = minix_sb(sb);
+
+	// Not set up if mounting failed early
+	if (sbi->s_sb)
+		cancel_delayed_work_sync(&sbi->s_snapshot_reclaim);
+}
+
+
 // Removes a given snapshot
 long remove_snapshot(struct super_block *sb, char *name) {
 	struct minix_sb_info *sbi = minix_sb(sb);
-	size_t snapshot_block;
-	int slot;
+	struct minix_refcount_batch batch;
+	struct minix_handle handle;
+	int slot, ret;
 
 	PRINT_FUNC();
 
+	minix_journal_start(sb, &handle);
+	mutex_lock(&sbi->s_snapshot_lock);
+
 	// Find snapshot slot
 	slot = get_slot_of_snapshot_name(sb, name);
 	if(slot == -1) {
 		debug_log("\tSnapshot does not exist\n");
+		mutex_unlock(&sbi->s_snapshot_lock);
+		minix_journal_stop(sb, &handle);
 		return IOCTL_ERROR_SNAPSHOT_DOES_NOT_EXIST;
 	}
-	snapshot_block = get_block_for_snapshot_slot(sb, slot);
+	if (sbi->s_snapshot_entries[slot].rolling_back) {
+		mutex_unlock(&sbi->s_snapshot_lock);
+		minix_journal_stop(sb, &handle);
+		return -EBUSY;
+	}
 
-	// Remove snapshot content
-	do_for_blocks_of_inodes(sb, snapshot_block, snapshot_block + sbi->s_imap_blocks, minix_free_block);
+	if (sbi->s_snapshot_pending) {
+		// The blocks are freed in the background, the slot stays taken until then
+		ret = snapshot_mark_deleting(sb, slot);
+		if (ret) {
+			printk("MINIX-fs: removing snapshot %s failed (%d)\n", name, ret);
+			mutex_unlock(&sbi->s_snapshot_lock);
+			minix_journal_stop(sb, &handle);
+			return ret;
+		}
+	} else {
+		// Remove snapshot content
+		minix_refcount_batch_init(&batch, sb);
+		do_for_blocks_of_inodes(sb, slot, &batch, -1);
+		ret = minix_refcount_batch_commit(&batch);
+		if (ret)
+			printk("MINIX-fs: removing snapshot %s: refcount update failed (%d)\n", name, ret);
+		if (minix_has_feature(sbi, SNAPSHOT_HEADERS))
+			write_snapshot_header(sb, slot, 0, 0);
+	}
 
 	// Remove snapshot name
 	write_snapshot_name(sb, slot, "");
+	if (sbi->s_snapshot_pending)
+		snapshot_find_pending(sb);
 
+	mutex_unlock(&sbi->s_snapshot_lock);
+	minix_journal_stop(sb, &handle);
+	minix_snapshot_reclaim_start(sb);
 	return 0;
 }
 
 long slot_of_snapshot(struct super_block *sb, char *name) {
+	struct minix_sb_info *sbi = minix_sb(sb);
 	int slot;
 
 	PRINT_FUNC();
 
 	// Find snapshot slot
+	mutex_lock(&sbi->s_snapshot_lock);
 	slot = get_slot_of_snapshot_name(sb, name);
+	mutex_unlock(&sbi->s_snapshot_lock);
 	if(slot == -1) {
 		debug_log("\tSnapshot does not exist\n");
 		return IOCTL_ERROR_SNAPSHOT_DOES_NOT_EXIST;
@@ -349,28 +1105,50 @@ long slot_of_snapshot(struct super_block *sb, char *name) {
 }
 
 long list_snapshots(struct super_block *sb, char *names) {
+	struct minix_sb_info *sbi = minix_sb(sb);
 	size_t i;
-	char *name;
 
-	for(i = 0; i < minix_sb(sb)->s_snapshots_slots; i++) {
-		name = get_snapshot_name_of_slot(sb, i);
-		strncpy(names + i * SNAPSHOT_NAME_LENGTH, name, SNAPSHOT_NAME_LENGTH);
-	}
+	mutex_lock(&sbi->s_snapshot_lock);
+	for(i = 0; i < sbi->s_snapshots_slots; i++)
+		memcpy(names + i * SNAPSHOT_NAME_LENGTH, get_snapshot_name_of_slot(sb, i), SNAPSHOT_NAME_LENGTH);
+	mutex_unlock(&sbi->s_snapshot_lock);
 
 	return 0;
 }
 
+// Number of slots taken, including the ones of snapshots still being deleted
 size_t count_snapshots(struct super_block *sb) {
+	struct minix_sb_info *sbi = minix_sb(sb);
 	size_t i;
 	size_t count = 0;
-	char *name;
 
-	for(i = 0; i < minix_sb(sb)->s_snapshots_slots; i++) {
-		name = get_snapshot_name_of_slot(sb, i);
-		if(strlen(name) != 0) {
+	mutex_lock(&sbi->s_snapshot_lock);
+	for(i = 0; i < sbi->s_snapshots_slots; i++) {
+		if(sbi->s_snapshot_entries[i].name[0] != '\0' || sbi->s_snapshot_entries[i].deleting)
 			count++;
-		}
 	}
+	mutex_unlock(&sbi->s_snapshot_lock);
 
 	return count;
 }
+
+// Fills an entry per slot with the name and the header of its snapshot
+long snapshot_info(struct super_block *sb, struct btrminix_snapshot_info *info) {
+	struct minix_sb_info *sbi = minix_sb(sb);
+	struct minix_snapshot_entry *entry;
+	size_t i;
+
+	mutex_lock(&sbi->s_snapshot_lock);
+	for(i = 0; i < sbi->s_snapshots_slots; i++) {
+		entry = &sbi->s_snapshot_entries[i];
+		memset(&info[i], 0, sizeof(info[i]));
+		memcpy(info[i].name, entry->name, SNAPSHOT_NAME_LENGTH);
+		info[i].flags = entry->deleting ? BTRMINIX_SNAPSHOT_DELETING : 0;
+		info[i].generation = entry->generation;
+		info[i].ctime = entry->ctime;
+		info[i].size = (unsigned long long)entry->blocks << sb->s_blocksize_bits;
+	}
+	mutex_unlock(&sbi->s_snapshot_lock);
+
+	return 0;
+}
@@ -4,6 +4,7 @@
 #include <sstream>
 #include <cstring>
 #include <chrono>
+#include <vector>
 
 #include "snapshots.h"
 #include "errors.h"
@@ -109,14 +110,25 @@ void list_snapshots(int ioctl_fd) {
         ioctl_error(errno);
     }
 
-    // Get names
-    char names[SNAPSHOT_NAME_LENGTH * slot_info[0]];
-    ioctl_ret = ioctl(ioctl_fd, IOCTL_BTRMINIX_LIST_SNAPSHOTS, &names);
+    // Get names and headers of all slots at once
+    std::vector<struct btrminix_snapshot_info> info(slot_info[0]);
+    ioctl_ret = ioctl(ioctl_fd, IOCTL_BTRMINIX_SNAPSHOT_INFO, info.data());
     if(ioctl_ret != 0) {
         ioctl_error(errno);
     }
 
     for(int i = 0; i < slot_info[0]; i++) {
-        std::cout << i << ": " << names+(i*SNAPSHOT_NAME_LENGTH) << std::endl;
+        std::cout << i << ": ";
+        if(info[i].flags & BTRMINIX_SNAPSHOT_DELETING) {
+            std::cout << "(being deleted)";
+        } else if(info[i].name[0] != '\0') {
+            std::cout << std::string(info[i].name, strnlen(info[i].name, SNAPSHOT_NAME_LENGTH));
+            if(info[i].ctime) {
+                std::cout << "  created " << formatDateTime(info[i].ctime)
+                          << "  size " << formatSize(info[i].size)
+                          << "  generation " << info[i].generation;
+            }
+        }
+        std::cout << std::endl;
     }
-}
\ No newline at end of file
+}
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <ctime>
+
 #include "utils.h"
 
 bool string_ends_with(const std::string &a, const std::string &b) {
@@ -24,6 +27,29 @@ std::string join_paths(std::string path1, std::string path2) {
     return path1 + std::string("/") + path2;
 }
 
+std::string formatDateTime(time_t time) {
+    struct tm  tstruct;
+    char       buf[80];
+    tstruct = *localtime(&time);
+    strftime(buf, sizeof(buf), "%F %H:%M:%S", &tstruct);
+
+    return buf;
+}
+
+std::string formatSize(unsigned long long bytes) {
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    double size = bytes;
+    size_t unit = 0;
+    while(size >= 1024 && unit < 4) {
+        size /= 1024;
+        unit++;
+    }
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), unit ? "%.1f %s" : "%.0f %s", size, units[unit]);
+    return buf;
+}
+
 std::string currentDateTime() {
     time_t     now = time(0);
     struct tm  tstruct;
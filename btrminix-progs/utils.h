@@ -1,5 +1,8 @@
 #include <string>
+#include <ctime>
 
 bool string_ends_with(const std::string &a, const std::string &b);
 std::string join_paths(std::string path1, std::string path2);
-std::string currentDateTime();
\ No newline at end of file
+std::string currentDateTime();
+std::string formatDateTime(time_t time);
+std::string formatSize(unsigned long long bytes);
\ No newline at end of file
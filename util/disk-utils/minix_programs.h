@@ -112,11 +112,25 @@ static inline size_t get_refcount_table_size(void)
 	return Super3.s_zones * sizeof(uint32_t);
 }
 
+/*
+ * The compact refcount encoding stores a shared map, laid out like the
+ * zone map, followed by the overflow table
+ */
 static inline size_t get_refcount_table_blocks(void)
 {
+	if (Super3.s_features & MINIX_FEATURE_COMPACT_REFCOUNT)
+		return get_nzmaps() + Super3.s_refcount_overflow_blocks;
 	return UPPER(get_refcount_table_size(), MINIX_BLOCK_SIZE);
 }
 
+/* The metadata journal sits between the refcount table and the snapshots */
+static inline size_t get_journal_blocks(void)
+{
+	if (fs_version == 3 && (Super3.s_features & MINIX_FEATURE_JOURNAL))
+		return Super3.s_journal_blocks;
+	return 0;
+}
+
 static inline size_t get_inode_buffer_size(void)
 {
 	return inode_blocks() * MINIX_BLOCK_SIZE;
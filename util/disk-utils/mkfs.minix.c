@@ -93,6 +93,13 @@
 #define DEFAULT_FS_VERSION 3
 #define MAX_NUM_SNAPSHOT_SLOTS 128
 
+/* Default size of the refcount overflow table: one slot per 64 zones */
+#define DEFAULT_ZONES_PER_OVERFLOW_SLOT 64
+
+/* Default journal size: one block per 64 blocks, at most 32M */
+#define DEFAULT_BLOCKS_PER_JOURNAL_BLOCK 64
+#define MAX_DEFAULT_JOURNAL_BLOCKS 8192
+
 /*
  * Global variables used in minix_programs.h inline functions
  */
@@ -117,6 +124,14 @@ struct fs_control {
 	unsigned int
 	 check_blocks:1;		/* check for bad blocks */
 	uint16_t fs_snapshot_slots;
+	unsigned int
+	 fs_compact_refcount:1;		/* shared map plus overflow table */
+	unsigned long fs_refcount_overflow_blocks;
+	unsigned int
+	 fs_journal_given:1;		/* journal size set with -j */
+	unsigned long fs_journal_blocks;
+	unsigned int
+	 fs_extents:1;			/* new regular files are extent mapped */
 };
 
 static char root_block[MINIX_BLOCK_SIZE];
@@ -139,24 +154,29 @@ static inline void mark_zone(unsigned int x) {
 	//printf("Setting bit %d\n", x);
 	unsigned int zone_index = x - get_first_zone() + 1;
 	setbit(zone_map,zone_index);
-	refcount_table[zone_index] = 1;
+	if (refcount_table)
+		refcount_table[zone_index] = 1;
 }
 
 static inline void unmark_zone(unsigned int x) {
 	//printf("Unsetting bit %d\n", x);
 	unsigned int zone_index = x - get_first_zone() + 1;
 	clrbit(zone_map,zone_index);
-	refcount_table[zone_index] = 0;
+	if (refcount_table)
+		refcount_table[zone_index] = 0;
 }
 
 static inline size_t get_snapshot_blocks(const struct fs_control *ctl)
 {
-	return SNAPSHOT_BLOCKS_FOR_NAMES + ctl->fs_snapshot_slots * (get_nimaps() + inode_blocks());
+	// V3 slots start with a header block
+	return SNAPSHOT_BLOCKS_FOR_NAMES +
+		ctl->fs_snapshot_slots * ((fs_version == 3) + get_nimaps() + inode_blocks());
 }
 
 static inline off_t first_zone_data(const struct fs_control *ctl)
 {
-	return 2 + get_nimaps() + get_nzmaps() + inode_blocks() + get_refcount_table_blocks() + get_snapshot_blocks(ctl);
+	return 2 + get_nimaps() + get_nzmaps() + inode_blocks() + get_refcount_table_blocks() +
+		get_journal_blocks() + get_snapshot_blocks(ctl);
 }
 
 static void __attribute__((__noreturn__)) usage(void)
@@ -166,6 +186,10 @@ static void __attribute__((__noreturn__)) usage(void)
 	fprintf(out, _(" %s [options] /dev/name [blocks]\n"), program_invocation_short_name);
 	fputs(USAGE_OPTIONS, out);
 	fputs(_(" -s <num>                number of snapshot slots (<= 128)\n"), out);
+	fputs(_(" -r <encoding>           refcount encoding: full (default) or compact\n"), out);
+	fputs(_(" -R <num>                blocks for the overflow table of the compact encoding\n"), out);
+	fputs(_(" -j <num>                blocks for the metadata journal, 0 for none\n"), out);
+	fputs(_(" -e                      map new regular files with extents\n"), out);
 	fputs(USAGE_SEPARATOR, out);
 	printf(USAGE_HELP_OPTIONS(25));
 	printf(USAGE_MAN_TAIL("mkfs.minix(8)"));
@@ -268,8 +292,32 @@ static void write_tables(const struct fs_control *ctl) {
 	if (write_all(ctl->device_fd, inode_buffer, buffsz))
 		err(MKFS_EX_ERROR, _("%s: unable to write inodes"), ctl->device_name);
 
-	if (write_all(ctl->device_fd, refcount_table, get_refcount_table_size()))
-		err(MKFS_EX_ERROR, _("%s: unable to write refcount table"), ctl->device_name);
+	if (refcount_table) {
+		if (write_all(ctl->device_fd, refcount_table, get_refcount_table_size()))
+			err(MKFS_EX_ERROR, _("%s: unable to write refcount table"), ctl->device_name);
+	} else {
+		// Compact encoding: nothing is shared yet, so the shared map
+		// and the overflow table start out empty
+		char *empty = xcalloc(get_refcount_table_blocks(), MINIX_BLOCK_SIZE);
+
+		if (write_all(ctl->device_fd, empty, get_refcount_table_blocks() * MINIX_BLOCK_SIZE))
+			err(MKFS_EX_ERROR, _("%s: unable to write refcount table"), ctl->device_name);
+		free(empty);
+	}
+
+	if (get_journal_blocks()) {
+		// Empty log: the journal super block points at its first block
+		char *journal = xcalloc(get_journal_blocks(), MINIX_BLOCK_SIZE);
+		struct minix_journal_super *js = (struct minix_journal_super *) journal;
+
+		js->s_header.h_magic = MINIX_JOURNAL_MAGIC;
+		js->s_header.h_type = MINIX_JOURNAL_SUPER;
+		js->s_header.h_seq = 1;
+		js->s_start = 1;
+		if (write_all(ctl->device_fd, journal, get_journal_blocks() * MINIX_BLOCK_SIZE))
+			err(MKFS_EX_ERROR, _("%s: unable to write journal"), ctl->device_name);
+		free(journal);
+	}
 
 	//printf("\n=== Zone map ===\n");
 	//print_zone_map();
@@ -560,6 +608,21 @@ static void super_set_map_blocks(const struct fs_control *ctl, unsigned long ino
 		Super3.s_imap_blocks = UPPER(inodes + 1, BITS_PER_BLOCK);
 		Super3.s_zmap_blocks = UPPER(ctl->fs_blocks - (1 + get_nimaps() + inode_blocks()),
 					     BITS_PER_BLOCK + 1);
+		if (ctl->fs_compact_refcount) {
+			Super3.s_features |= MINIX_FEATURE_COMPACT_REFCOUNT;
+			Super3.s_refcount_overflow_blocks = ctl->fs_refcount_overflow_blocks;
+			if (!Super3.s_refcount_overflow_blocks)
+				Super3.s_refcount_overflow_blocks =
+					UPPER(UPPER(ctl->fs_blocks, DEFAULT_ZONES_PER_OVERFLOW_SLOT) *
+					      sizeof(struct minix_refcount_entry), MINIX_BLOCK_SIZE);
+		}
+		if (ctl->fs_journal_blocks) {
+			Super3.s_features |= MINIX_FEATURE_JOURNAL;
+			Super3.s_journal_blocks = ctl->fs_journal_blocks;
+		}
+		if (ctl->fs_extents)
+			Super3.s_features |= MINIX_FEATURE_EXTENTS | MINIX_FEATURE_EXTENTS_DEFAULT;
+		Super3.s_features |= MINIX_FEATURE_SNAPSHOT_HEADERS | MINIX_FEATURE_TREE_REFCOUNT;
 		Super3.s_firstdatazone = first_zone_data(ctl);
 		Super3.s_inodes_blocks = UPPER(inodes * sizeof(struct minix2_inode), MINIX_BLOCK_SIZE);
 		Super3.s_refcount_table_blocks = get_refcount_table_blocks();
@@ -648,17 +711,20 @@ static void setup_tables(const struct fs_control *ctl) {
 	memset(zone_map,0xff,zmaps * MINIX_BLOCK_SIZE);
 
 	// Set up refcount table
-	// Calculate size
-	refcount_table_size = get_refcount_table_size();
-
-	// Assign data blocks for refcount table
-	refcount_table = xmalloc(refcount_table_size);
-	memset(refcount_table, 0, refcount_table_size);
-
-	// Manually set counter for zone 0 to 1
-	// Its not possible to mark this zone since it is never used,
-	// but for similarity with the zone bitmap, we keep it marked
-	refcount_table[0] = 1;
+	// The compact encoding needs none, the zone map has all refcounts of 0 and 1
+	if (!ctl->fs_compact_refcount) {
+		// Calculate size
+		refcount_table_size = get_refcount_table_size();
+
+		// Assign data blocks for refcount table
+		refcount_table = xmalloc(refcount_table_size);
+		memset(refcount_table, 0, refcount_table_size);
+
+		// Manually set counter for zone 0 to 1
+		// Its not possible to mark this zone since it is never used,
+		// but for similarity with the zone bitmap, we keep it marked
+		refcount_table[0] = 1;
+	}
 
 	// Unmark all zones
 	// This does not unmark zone 0, as it is never used
@@ -676,6 +742,13 @@ static void setup_tables(const struct fs_control *ctl) {
 	printf(_("Firstdatazone=%jd (%jd)\n"),
 		(intmax_t)get_first_zone(), (intmax_t)first_zone_data(ctl));
 	printf("Reserved %ld blocks for %d snapshots\n", get_snapshot_blocks(ctl), ctl->fs_snapshot_slots);
+	if (ctl->fs_compact_refcount)
+		printf("Compact refcounts: %lu shared map and %u overflow blocks\n",
+		       get_nzmaps(), Super3.s_refcount_overflow_blocks);
+	else
+		printf("Refcount table: %zu blocks\n", get_refcount_table_blocks());
+	if (get_journal_blocks())
+		printf("Journal: %zu blocks\n", get_journal_blocks());
 	printf(_("Zonesize=%zu\n"), (size_t) MINIX_BLOCK_SIZE << get_zone_size());
 	printf(_("Maxsize=%zu\n\n"),get_max_size());
 }
@@ -821,6 +894,14 @@ static void determine_device_blocks(struct fs_control *ctl, const struct stat *s
 		ctl->fs_blocks = MINIX_MAX_INODES;
 	if (ctl->fs_blocks > (4 + ((MINIX_MAX_INODES - 4) * BITS_PER_BLOCK)))
 		ctl->fs_blocks = 4 + ((MINIX_MAX_INODES - 4) * BITS_PER_BLOCK);	/* Utter maximum: Clip. */
+
+	// Small file systems get no journal unless one is asked for
+	if (!ctl->fs_journal_given) {
+		ctl->fs_journal_blocks = min(ctl->fs_blocks / DEFAULT_BLOCKS_PER_JOURNAL_BLOCK,
+					     (unsigned long long) MAX_DEFAULT_JOURNAL_BLOCKS);
+		if (ctl->fs_journal_blocks < MINIX_JOURNAL_MIN_BLOCKS)
+			ctl->fs_journal_blocks = 0;
+	}
 }
 
 static void check_user_instructions(struct fs_control *ctl)
@@ -828,6 +909,11 @@ static void check_user_instructions(struct fs_control *ctl)
 	if(ctl->fs_snapshot_slots > MAX_NUM_SNAPSHOT_SLOTS) {
 		errx(MKFS_EX_ERROR, _("number of snapshot slots too high: %d > %d"), ctl->fs_snapshot_slots, MAX_NUM_SNAPSHOT_SLOTS);
 	}
+	if (ctl->fs_refcount_overflow_blocks && !ctl->fs_compact_refcount)
+		errx(MKFS_EX_USAGE, _("overflow blocks only apply to the compact refcount encoding"));
+	if (ctl->fs_journal_blocks && ctl->fs_journal_blocks < MINIX_JOURNAL_MIN_BLOCKS)
+		errx(MKFS_EX_USAGE, _("journal too small: %lu < %d blocks"),
+		     ctl->fs_journal_blocks, MINIX_JOURNAL_MIN_BLOCKS);
 	ctl->fs_magic = find_super_magic(ctl);
 }
 
@@ -853,12 +939,32 @@ int main(int argc, char ** argv)
 
 	strutils_set_exitcode(MKFS_EX_USAGE);
 
-	while ((i = getopt_long(argc, argv, "s:h", longopts, NULL)) != -1)
+	while ((i = getopt_long(argc, argv, "s:r:R:j:eh", longopts, NULL)) != -1)
 		switch (i) {
 		case 's':
 			ctl.fs_snapshot_slots = strtou16_or_err(optarg,
 					_("failed to parse number of snapshot slots"));
 			break;
+		case 'r':
+			if (strcmp(optarg, "compact") == 0)
+				ctl.fs_compact_refcount = 1;
+			else if (strcmp(optarg, "full") == 0)
+				ctl.fs_compact_refcount = 0;
+			else
+				errx(MKFS_EX_USAGE, _("unknown refcount encoding: %s"), optarg);
+			break;
+		case 'R':
+			ctl.fs_refcount_overflow_blocks = strtoul_or_err(optarg,
+					_("failed to parse number of overflow blocks"));
+			break;
+		case 'j':
+			ctl.fs_journal_blocks = strtoul_or_err(optarg,
+					_("failed to parse number of journal blocks"));
+			ctl.fs_journal_given = 1;
+			break;
+		case 'e':
+			ctl.fs_extents = 1;
+			break;
 		case 'h':
 			usage();
 		default:
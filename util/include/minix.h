@@ -23,7 +23,7 @@ struct minix2_inode {
 	uint32_t i_mtime;
 	uint32_t i_ctime;
 	uint32_t i_zone[9];
-	uint16_t i_unused;
+	uint16_t i_flags;
 	uint16_t i_real_mode;
 };
 
@@ -58,6 +58,39 @@ struct minix3_super_block {
 	uint8_t s_pad3; // Pad the disk version to 16 bits. We could put a magic number here if we needed
 	uint32_t s_inodes_blocks;
 	uint32_t s_refcount_table_blocks;
+	uint32_t s_features;
+	uint32_t s_refcount_overflow_blocks;
+	uint32_t s_journal_blocks;
+};
+
+/* minix3_super_block.s_features */
+#define MINIX_FEATURE_COMPACT_REFCOUNT	0x0001	/* shared map plus overflow table */
+#define MINIX_FEATURE_JOURNAL		0x0002	/* metadata journal after the refcount table */
+#define MINIX_FEATURE_EXTENTS		0x0004	/* extent mapped inodes may exist */
+#define MINIX_FEATURE_EXTENTS_DEFAULT	0x0008	/* new regular files are extent mapped */
+#define MINIX_FEATURE_SNAPSHOT_HEADERS	0x0010	/* snapshot slots start with a header block */
+#define MINIX_FEATURE_TREE_REFCOUNT	0x0020	/* tree blocks hold the references of their entries */
+
+/* Entry of the refcount overflow table, zone 0 is an empty slot */
+struct minix_refcount_entry {
+	uint32_t zone;
+	uint32_t count;
+};
+
+/* Metadata journal, see the kernel's minix_fs.h for the log format */
+#define MINIX_JOURNAL_MAGIC		0x4d4a524e
+#define MINIX_JOURNAL_MIN_BLOCKS	32
+#define MINIX_JOURNAL_SUPER		1
+
+struct minix_journal_header {
+	uint32_t h_magic;
+	uint32_t h_type;
+	uint32_t h_seq;
+};
+
+struct minix_journal_super {
+	struct minix_journal_header s_header;
+	uint32_t s_start;
 };
 
 /*